@@ -1,3 +1,6 @@
+#include <stdint.h>
+#include <stdlib.h>
+
 #include "boxutil.h"
 #include "utils.h"
 
@@ -13,3 +16,101 @@ int box_intersect_line_rough(const BoxRec *b, const xSegment *seg)
 
 	return TRUE;
 }
+
+/*
+ * Test whether a zero-width line may light any pixel in the box.  The
+ * pixels lit are within half a pixel of the ideal line, so it is tested
+ * against the box grown by a pixel: if all four corners lie on the same
+ * side of the line, it can not touch the box.
+ */
+int box_intersect_line(const BoxRec *b, const xSegment *seg)
+{
+	int64_t dx = seg->x2 - seg->x1;
+	int64_t dy = seg->y2 - seg->y1;
+	int64_t c[4];
+	int i, pos, neg;
+
+	if (!box_intersect_line_rough(b, seg))
+		return FALSE;
+
+	c[0] = dx * (b->y1 - 1 - seg->y1) - dy * (b->x1 - 1 - seg->x1);
+	c[1] = dx * (b->y1 - 1 - seg->y1) - dy * (b->x2 - seg->x1);
+	c[2] = dx * (b->y2 - seg->y1) - dy * (b->x1 - 1 - seg->x1);
+	c[3] = dx * (b->y2 - seg->y1) - dy * (b->x2 - seg->x1);
+
+	for (pos = neg = i = 0; i < 4; i++) {
+		pos |= c[i] > 0;
+		neg |= c[i] < 0;
+	}
+
+	return pos && neg;
+}
+
+struct box_bands *box_bands_create(const BoxRec *boxes, unsigned int nbox)
+{
+	struct box_bands *bands;
+	struct box_band *band;
+	unsigned int i, nband;
+
+	for (nband = i = 0; i < nbox; i++)
+		if (i == 0 || boxes[i].y1 != boxes[i - 1].y1)
+			nband++;
+
+	bands = malloc(sizeof(*bands) + nband * sizeof(*band));
+	if (!bands)
+		return NULL;
+
+	bands->boxes = boxes;
+	bands->nbox = nbox;
+	bands->nband = nband;
+
+	for (band = bands->band, i = 0; i < nbox; i++) {
+		if (i && boxes[i].y1 == boxes[i - 1].y1) {
+			band[-1].end = i + 1;
+			continue;
+		}
+
+		band->y1 = boxes[i].y1;
+		band->y2 = boxes[i].y2;
+		band->start = i;
+		band->end = i + 1;
+		band++;
+	}
+
+	return bands;
+}
+
+/* Find the first band which ends below y */
+const struct box_band *box_bands_find(const struct box_bands *bands, int y)
+{
+	unsigned int lo = 0, hi = bands->nband;
+
+	while (lo < hi) {
+		unsigned int mid = (lo + hi) / 2;
+
+		if (bands->band[mid].y2 <= y)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return bands->band + lo;
+}
+
+/* Find the first box in the band which ends to the right of x */
+const BoxRec *box_band_find(const struct box_bands *bands,
+	const struct box_band *band, int x)
+{
+	unsigned int lo = band->start, hi = band->end;
+
+	while (lo < hi) {
+		unsigned int mid = (lo + hi) / 2;
+
+		if (bands->boxes[mid].x2 <= x)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return bands->boxes + lo;
+}
@@ -27,5 +27,34 @@ static inline int box_area(BoxPtr box)
 }
 
 int box_intersect_line_rough(const BoxRec *b, const xSegment *seg);
+int box_intersect_line(const BoxRec *b, const xSegment *seg);
+
+/*
+ * An index of the bands in a y-x banded array of boxes, such as a
+ * region, so that the boxes overlapping a rectangle can be found by
+ * binary search rather than by scanning every box.
+ */
+struct box_band {
+	short y1, y2;
+	unsigned int start, end;
+};
+
+struct box_bands {
+	const BoxRec *boxes;
+	unsigned int nbox;
+	unsigned int nband;
+	struct box_band band[];
+};
+
+struct box_bands *box_bands_create(const BoxRec *boxes, unsigned int nbox);
+const struct box_band *box_bands_find(const struct box_bands *bands, int y);
+const BoxRec *box_band_find(const struct box_bands *bands,
+	const struct box_band *band, int x);
+
+static inline const struct box_band *box_bands_end(
+	const struct box_bands *bands)
+{
+	return bands->band + bands->nband;
+}
 
 #endif
@@ -0,0 +1,40 @@
+/*
+ * Copy video image planes into overlay buffers.
+ *
+ * The overlay buffers are write-combined, so they are written most
+ * efficiently in long sequential runs with the source streamed in
+ * ahead of the writes.  This is plain C so that it can also be built
+ * into the standalone xv_copy_bench harness.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stddef.h>
+#include <string.h>
+
+#include "prefetch.h"
+#include "xv_copy.h"
+
+/*
+ * Copy height rows of width bytes from a plane with src_pitch bytes
+ * per row to one with dst_pitch bytes per row.  When neither plane
+ * has padding between rows, the plane is copied in one go.
+ */
+void xv_copy_plane(void *dst, uint32_t dst_pitch, const void *src,
+	uint32_t src_pitch, uint32_t width, uint32_t height)
+{
+	const uint8_t *s = src;
+	uint8_t *d = dst;
+
+	if (dst_pitch == width && src_pitch == width) {
+		memcpy(d, s, (size_t)width * height);
+		return;
+	}
+
+	for (; height; height--, s += src_pitch, d += dst_pitch) {
+		if (height > 1)
+			prefetch(s + src_pitch);
+		memcpy(d, s, width);
+	}
+}
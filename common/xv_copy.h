@@ -0,0 +1,9 @@
+#ifndef XV_COPY_H
+#define XV_COPY_H
+
+#include <stdint.h>
+
+void xv_copy_plane(void *dst, uint32_t dst_pitch, const void *src,
+	uint32_t src_pitch, uint32_t width, uint32_t height);
+
+#endif
@@ -0,0 +1,163 @@
+/*
+ * Standalone benchmark for the Xv plane copy.
+ *
+ * Times xv_copy_plane() copying whole frames in each of the layouts
+ * the overlay handles, against a single memcpy() of the frame.  The
+ * destination is ordinary memory here; for figures representative of
+ * the overlay, run it on the target with the destination mapped
+ * write-combined.
+ *
+ * Usage: xv_copy_bench [width height [iterations]]
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "xv_copy.h"
+
+#define ALIGN(v, a)	(((v) + (a) - 1) & ~((a) - 1))
+
+struct bench_layout {
+	const char *name;
+	unsigned num_planes;
+	/* bytes per row and rows, per plane */
+	uint32_t width[3];
+	uint32_t height[3];
+	/* destination plane for each source plane */
+	unsigned map[3];
+	/* destination rows padded to this many bytes */
+	uint32_t dst_align;
+};
+
+static double bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static size_t bench_setup(const struct bench_layout *l, uint32_t align,
+	uint32_t *pitch, uint32_t *offset)
+{
+	size_t size = 0;
+	unsigned i;
+
+	for (i = 0; i < l->num_planes; i++) {
+		pitch[i] = ALIGN(l->width[i], align);
+		offset[i] = size;
+		size += ALIGN(pitch[i] * l->height[i], 8);
+	}
+
+	return size;
+}
+
+static void bench_run(const struct bench_layout *l, unsigned iterations)
+{
+	uint32_t src_pitch[3], src_offset[3], dst_pitch[3], dst_offset[3];
+	size_t src_size, dst_size;
+	double start, t_memcpy, t_copy;
+	uint8_t *src, *dst;
+	unsigned n, i;
+
+	src_size = bench_setup(l, 1, src_pitch, src_offset);
+	dst_size = bench_setup(l, l->dst_align, dst_pitch, dst_offset);
+
+	src = malloc(src_size);
+	dst = malloc(dst_size > src_size ? dst_size : src_size);
+	if (!src || !dst) {
+		fprintf(stderr, "%s: out of memory\n", l->name);
+		exit(1);
+	}
+
+	for (i = 0; i < src_size; i++)
+		src[i] = i * 7;
+	memset(dst, 0, dst_size);
+
+	start = bench_now();
+	for (n = 0; n < iterations; n++)
+		memcpy(dst, src, src_size);
+	t_memcpy = bench_now() - start;
+
+	start = bench_now();
+	for (n = 0; n < iterations; n++)
+		for (i = 0; i < l->num_planes; i++) {
+			unsigned j = l->map[i];
+
+			xv_copy_plane(dst + dst_offset[j], dst_pitch[j],
+				      src + src_offset[i], src_pitch[i],
+				      l->width[i], l->height[i]);
+		}
+	t_copy = bench_now() - start;
+
+	/* Check that the last copy put each row where it belongs */
+	for (i = 0; i < l->num_planes; i++) {
+		unsigned j = l->map[i], y;
+
+		for (y = 0; y < l->height[i]; y++)
+			if (memcmp(dst + dst_offset[j] + y * dst_pitch[j],
+				   src + src_offset[i] + y * src_pitch[i],
+				   l->width[i])) {
+				fprintf(stderr, "%s: plane %u row %u differs\n",
+					l->name, i, y);
+				exit(1);
+			}
+	}
+
+	printf("%-24s memcpy %8.1f MB/s  xv_copy_plane %8.1f MB/s\n",
+	       l->name,
+	       src_size * (double)iterations / t_memcpy / 1e6,
+	       src_size * (double)iterations / t_copy / 1e6);
+
+	free(dst);
+	free(src);
+}
+
+int main(int argc, char *argv[])
+{
+	uint32_t w = 1920, h = 1080;
+	unsigned iterations = 200, i;
+
+	if (argc >= 3) {
+		w = strtoul(argv[1], NULL, 0) & ~1;
+		h = strtoul(argv[2], NULL, 0) & ~1;
+	}
+	if (argc >= 4)
+		iterations = strtoul(argv[3], NULL, 0);
+	if (!w || !h || !iterations) {
+		fprintf(stderr, "Usage: %s [width height [iterations]]\n",
+			argv[0]);
+		return 1;
+	}
+
+	{
+		const struct bench_layout layouts[] = {
+			{ "YV12", 3, { w, w / 2, w / 2 },
+			  { h, h / 2, h / 2 }, { 0, 1, 2 }, 1 },
+			{ "I420 -> YV12", 3, { w, w / 2, w / 2 },
+			  { h, h / 2, h / 2 }, { 0, 2, 1 }, 1 },
+			{ "I420 -> YV12, pitch 64", 3, { w, w / 2, w / 2 },
+			  { h, h / 2, h / 2 }, { 0, 2, 1 }, 64 },
+			{ "NV12", 2, { w, w }, { h, h / 2 }, { 0, 1 }, 1 },
+			{ "NV12, pitch 64", 2, { w, w }, { h, h / 2 },
+			  { 0, 1 }, 64 },
+			{ "YUY2/UYVY", 1, { w * 2 }, { h }, { 0 }, 1 },
+			{ "YUY2/UYVY, pitch 64", 1, { w * 2 }, { h }, { 0 },
+			  64 },
+		};
+
+		printf("%ux%u, %u iterations\n", w, h, iterations);
+
+		for (i = 0; i < sizeof(layouts) / sizeof(layouts[0]); i++)
+			bench_run(&layouts[i], iterations);
+	}
+
+	return 0;
+}
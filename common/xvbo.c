@@ -0,0 +1,40 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdint.h>
+
+#include "dix.h"
+#include "pixmapstr.h"
+#include "resource.h"
+
+#include "xvbo.h"
+
+/*
+ * Look up the pixmap passed in an XVBP buffer.  PutImage does not give
+ * us the requesting client, so the client owning the destination
+ * drawable stands in for it: the lookup is made on its behalf so that
+ * access control hooks apply, and the pixmap must belong to the same
+ * client and screen as the drawable.
+ */
+PixmapPtr xvbo_get_pixmap(DrawablePtr pDraw, const unsigned char *buf)
+{
+	PixmapPtr pixmap;
+	ClientPtr client;
+	XID id = ((const uint32_t *)buf)[1];
+	int rc;
+
+	if (CLIENT_ID(id) != CLIENT_ID(pDraw->id))
+		return NULL;
+
+	client = clients[CLIENT_ID(pDraw->id)];
+	if (!client || client == serverClient)
+		return NULL;
+
+	rc = dixLookupResourceByType((pointer *)&pixmap, id, RT_PIXMAP,
+				     client, DixReadAccess);
+	if (rc != Success || pixmap->drawable.pScreen != pDraw->pScreen)
+		return NULL;
+
+	return pixmap;
+}
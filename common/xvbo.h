@@ -1,6 +1,9 @@
 #ifndef XVBO_H
 #define XVBO_H
 
+#include "pixmap.h"
+#include "screenint.h"
+
 /*
  * This is a special Xv image format used to pass DRM named buffers
  * via the Xv protocol to the backend, allowing for zero copy display.
@@ -14,8 +17,26 @@
  * running on the local machine.
  */
 #define FOURCC_XVBO 0x4f425658
-#define XVIMAGE_XVBO { \
-	FOURCC_XVBO, \
+#define XVIMAGE_XVBO __XVIMAGE_XVBO(FOURCC_XVBO)
+
+/*
+ * A variant of XVBO which passes a pixmap rather than a DRM name.
+ * Global names are insecure, and need DRM authentication, so a client
+ * instead imports its buffer (eg, a DMA-BUF from a hardware decoder)
+ * as a pixmap using DRI3 PixmapFromBuffer, and passes the pixmap.
+ *
+ * The format of the passed buffer is:
+ *  word 0: fourcc of the data contained in the pixmap's buffer
+ *  word 1: XID of the pixmap
+ *
+ * The same size and endian rules apply as for XVBO.  The pixmap must
+ * not be freed until a later frame has been displayed.
+ */
+#define FOURCC_XVBP 0x50425658
+#define XVIMAGE_XVBP __XVIMAGE_XVBO(FOURCC_XVBP)
+
+#define __XVIMAGE_XVBO(fourcc) { \
+	fourcc, \
 	XvYUV, \
 	LSBFirst, \
 	{ 0 }, \
@@ -30,4 +51,6 @@
 	XvTopToBottom, \
 }
 
+PixmapPtr xvbo_get_pixmap(DrawablePtr pDraw, const unsigned char *buf);
+
 #endif
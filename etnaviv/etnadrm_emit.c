@@ -7,6 +7,7 @@
 
 #include "etnaviv_accel.h"
 #include "etnaviv_op.h"
+#include "etnaviv_stats.h"
 #include "etnadrm.h"
 
 void etnaviv_emit(struct etnaviv *etnaviv)
@@ -15,6 +16,9 @@ void etnaviv_emit(struct etnaviv *etnaviv)
 	struct etnaviv_reloc *r;
 	unsigned int i;
 
+	/* Account every emission, including those at the high watermark */
+	etnaviv_stats_bytes(etnaviv, etnaviv->batch_size * 4);
+
 	etna_reserve(ctx, etnaviv->batch_size);
 	memcpy(&ctx->buf[ctx->offset], etnaviv->batch, etnaviv->batch_size * 4);
 	for (i = 0, r = etnaviv->reloc; i < etnaviv->reloc_size; i++, r++) {
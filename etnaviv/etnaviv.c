@@ -42,21 +42,31 @@
 #include "etnaviv_dri2.h"
 #include "etnaviv_dri3.h"
 #include "etnaviv_render.h"
+#include "etnaviv_stats.h"
 #include "etnaviv_utils.h"
 #include "etnaviv_xv.h"
 
+#ifdef MITSHM
+#include "shmint.h"
+#endif
+
 etnaviv_Key etnaviv_pixmap_index;
 etnaviv_Key etnaviv_screen_index;
+etnaviv_Key etnaviv_gc_index;
 int etnaviv_private_index = -1;
 
 enum {
 	OPTION_DRI2,
 	OPTION_DRI3,
+	OPTION_ACCEL_STATS,
+	OPTION_RESOLVE_FILL,
 };
 
 const OptionInfoRec etnaviv_options[] = {
 	{ OPTION_DRI2,		"DRI",		OPTV_BOOLEAN, {0}, TRUE },
 	{ OPTION_DRI3,		"DRI3",		OPTV_BOOLEAN, {0}, TRUE },
+	{ OPTION_ACCEL_STATS,	"AccelStats",	OPTV_BOOLEAN, {0}, FALSE },
+	{ OPTION_RESOLVE_FILL,	"ResolveFill",	OPTV_BOOLEAN, {0}, FALSE },
 	{ -1,			NULL,		OPTV_NONE,    {0}, FALSE }
 };
 
@@ -129,6 +139,30 @@ static void etnaviv_free_usermem(struct etnaviv *etnaviv)
 	}
 }
 
+/*
+ * Wait for the GPU to finish reading client memory.  The client may
+ * reuse a MIT-SHM segment as soon as it sees a response to the request
+ * which used it, so this must be done before any output is delivered.
+ */
+static void etnaviv_finish_shm(struct etnaviv *etnaviv)
+{
+	struct etnaviv_usermem_node *i, *n;
+	int ret;
+
+	xorg_list_for_each_entry_safe(i, n, &etnaviv->shm_busy_list, node) {
+		if (VIV_FENCE_BEFORE(etnaviv->last_fence, i->fence)) {
+			ret = viv_fence_finish(etnaviv->conn, i->fence,
+					       VIV_WAIT_INDEFINITE);
+			if (ret != VIV_STATUS_OK)
+				etnaviv_error(etnaviv, "fence finish", ret);
+			etnaviv_finish_fences(etnaviv, i->fence);
+		}
+		xorg_list_del(&i->node);
+		etna_bo_del(etnaviv->conn, i->bo, NULL);
+		free(i);
+	}
+}
+
 static CARD32 etnaviv_cache_expire(OsTimerPtr timer, CARD32 time, pointer arg)
 {
 	return 0;
@@ -190,6 +224,9 @@ static void etnaviv_flush_callback(CallbackListPtr *list, pointer user_data,
 
 	if (pScrn->vtSema && !xorg_list_is_empty(&etnaviv->batch_head))
 		etnaviv_commit(etnaviv, FALSE, &fence);
+
+	if (!xorg_list_is_empty(&etnaviv->shm_busy_list))
+		etnaviv_finish_shm(etnaviv);
 }
 
 static struct etnaviv_pixmap *etnaviv_alloc_pixmap(PixmapPtr pixmap,
@@ -240,11 +277,27 @@ static Bool etnaviv_GCfill_can_accel(GCPtr pGC, DrawablePtr pDrawable)
 		 * the tile matches the size of the drawable and the tile
 		 * offsets are zero (iow, it's a plain copy.)
 		 */
-		return FALSE;
+		break;
 
 	default:
-		return FALSE;
+		break;
 	}
+
+	etnaviv_stats_reason(etnaviv_get_screen_priv(pDrawable->pScreen),
+			     FB_GC);
+	return FALSE;
+}
+
+/* Only solid zero-width lines are accelerated */
+static Bool etnaviv_GCline_can_accel(GCPtr pGC, DrawablePtr pDrawable)
+{
+	if (pGC->lineWidth == 0 && pGC->lineStyle == LineSolid &&
+	    pGC->fillStyle == FillSolid)
+		return TRUE;
+
+	etnaviv_stats_reason(etnaviv_get_screen_priv(pDrawable->pScreen),
+			     FB_GC);
+	return FALSE;
 }
 
 
@@ -253,13 +306,19 @@ etnaviv_FillSpans(DrawablePtr pDrawable, GCPtr pGC, int n, DDXPointPtr ppt,
 	int *pwidth, int fSorted)
 {
 	struct etnaviv *etnaviv = etnaviv_get_screen_priv(pDrawable->pScreen);
+	struct etnaviv_stat_mark mark;
 
 	assert(etnaviv_GC_can_accel(pGC, pDrawable));
 
+	mark = etnaviv_stats_start(etnaviv, STAT_FILLSPANS);
 	if (etnaviv->force_fallback ||
 	    !etnaviv_GCfill_can_accel(pGC, pDrawable) ||
-	    !etnaviv_accel_FillSpans(pDrawable, pGC, n, ppt, pwidth, fSorted))
+	    !etnaviv_accel_FillSpans(pDrawable, pGC, n, ppt, pwidth, fSorted)) {
+		etnaviv_stats_end(etnaviv, mark, FALSE);
 		unaccel_FillSpans(pDrawable, pGC, n, ppt, pwidth, fSorted);
+	} else {
+		etnaviv_stats_end(etnaviv, mark, TRUE);
+	}
 }
 
 static void
@@ -267,14 +326,21 @@ etnaviv_PutImage(DrawablePtr pDrawable, GCPtr pGC, int depth, int x, int y,
 	int w, int h, int leftPad, int format, char *bits)
 {
 	struct etnaviv *etnaviv = etnaviv_get_screen_priv(pDrawable->pScreen);
+	struct etnaviv_stat_mark mark;
 
-	assert(etnaviv_GC_can_accel(pGC, pDrawable));
+	/* Also used with a partial planemask, see etnaviv_planemask_GCOps */
+	assert(etnaviv_drawable(pDrawable));
 
+	mark = etnaviv_stats_start(etnaviv, STAT_PUTIMAGE);
 	if (etnaviv->force_fallback ||
 	    !etnaviv_accel_PutImage(pDrawable, pGC, depth, x, y, w, h, leftPad,
-				    format, bits))
+				    format, bits)) {
+		etnaviv_stats_end(etnaviv, mark, FALSE);
 		unaccel_PutImage(pDrawable, pGC, depth, x, y, w, h, leftPad,
 					 format, bits);
+	} else {
+		etnaviv_stats_end(etnaviv, mark, TRUE);
+	}
 }
 
 static RegionPtr
@@ -283,7 +349,8 @@ etnaviv_CopyArea(DrawablePtr pSrc, DrawablePtr pDst, GCPtr pGC,
 {
 	struct etnaviv *etnaviv = etnaviv_get_screen_priv(pDst->pScreen);
 
-	assert(etnaviv_GC_can_accel(pGC, pDst));
+	/* Also used with a partial planemask, see etnaviv_planemask_GCOps */
+	assert(etnaviv_drawable(pDst));
 
 	if (etnaviv->force_fallback)
 		return unaccel_CopyArea(pSrc, pDst, pGC, srcx, srcy, w, h,
@@ -298,13 +365,19 @@ etnaviv_PolyPoint(DrawablePtr pDrawable, GCPtr pGC, int mode, int npt,
 	DDXPointPtr ppt)
 {
 	struct etnaviv *etnaviv = etnaviv_get_screen_priv(pDrawable->pScreen);
+	struct etnaviv_stat_mark mark;
 
 	assert(etnaviv_GC_can_accel(pGC, pDrawable));
 
+	mark = etnaviv_stats_start(etnaviv, STAT_POLYPOINT);
 	if (etnaviv->force_fallback ||
 	    !etnaviv_GCfill_can_accel(pGC, pDrawable) ||
-	    !etnaviv_accel_PolyPoint(pDrawable, pGC, mode, npt, ppt))
+	    !etnaviv_accel_PolyPoint(pDrawable, pGC, mode, npt, ppt)) {
+		etnaviv_stats_end(etnaviv, mark, FALSE);
 		unaccel_PolyPoint(pDrawable, pGC, mode, npt, ppt);
+	} else {
+		etnaviv_stats_end(etnaviv, mark, TRUE);
+	}
 }
 
 static void
@@ -312,28 +385,77 @@ etnaviv_PolyLines(DrawablePtr pDrawable, GCPtr pGC, int mode, int npt,
 	DDXPointPtr ppt)
 {
 	struct etnaviv *etnaviv = etnaviv_get_screen_priv(pDrawable->pScreen);
+	struct etnaviv_stat_mark mark;
 
 	assert(etnaviv_GC_can_accel(pGC, pDrawable));
 
+	mark = etnaviv_stats_start(etnaviv, STAT_POLYLINES);
 	if (etnaviv->force_fallback ||
-	    pGC->lineWidth != 0 || pGC->lineStyle != LineSolid ||
-	    pGC->fillStyle != FillSolid ||
-	    !etnaviv_accel_PolyLines(pDrawable, pGC, mode, npt, ppt))
+	    !etnaviv_GCline_can_accel(pGC, pDrawable) ||
+	    !etnaviv_accel_PolyLines(pDrawable, pGC, mode, npt, ppt)) {
+		etnaviv_stats_end(etnaviv, mark, FALSE);
 		unaccel_PolyLines(pDrawable, pGC, mode, npt, ppt);
+	} else {
+		etnaviv_stats_end(etnaviv, mark, TRUE);
+	}
 }
 
 static void
 etnaviv_PolySegment(DrawablePtr pDrawable, GCPtr pGC, int nseg, xSegment *pSeg)
 {
 	struct etnaviv *etnaviv = etnaviv_get_screen_priv(pDrawable->pScreen);
+	struct etnaviv_stat_mark mark;
 
 	assert(etnaviv_GC_can_accel(pGC, pDrawable));
 
+	mark = etnaviv_stats_start(etnaviv, STAT_POLYSEGMENT);
 	if (etnaviv->force_fallback ||
-	    pGC->lineWidth != 0 || pGC->lineStyle != LineSolid ||
-	    pGC->fillStyle != FillSolid ||
-	    !etnaviv_accel_PolySegment(pDrawable, pGC, nseg, pSeg))
+	    !etnaviv_GCline_can_accel(pGC, pDrawable) ||
+	    !etnaviv_accel_PolySegment(pDrawable, pGC, nseg, pSeg)) {
+		etnaviv_stats_end(etnaviv, mark, FALSE);
 		unaccel_PolySegment(pDrawable, pGC, nseg, pSeg);
+	} else {
+		etnaviv_stats_end(etnaviv, mark, TRUE);
+	}
+}
+
+static Bool etnaviv_poly_fill_rect(DrawablePtr pDrawable, GCPtr pGC,
+	int nrect, xRectangle * prect)
+{
+	struct etnaviv *etnaviv = etnaviv_get_screen_priv(pDrawable->pScreen);
+	PixmapPtr pPix = drawable_pixmap(pDrawable);
+
+	if (etnaviv->force_fallback)
+		return FALSE;
+
+	if (pPix->drawable.width == 1 && pPix->drawable.height == 1) {
+		etnaviv_stats_reason(etnaviv, FB_GEOMETRY);
+		return FALSE;
+	}
+
+	assert(etnaviv_drawable(pDrawable));
+
+	if (!fb_full_planemask(pDrawable, pGC->planemask)) {
+		if (pGC->fillStyle == FillSolid)
+			return etnaviv_accel_PolyFillRectPlanemask(pDrawable,
+							pGC, nrect, prect);
+
+		etnaviv_stats_reason(etnaviv, FB_GC);
+		return FALSE;
+	}
+
+	if (etnaviv_GCfill_can_accel(pGC, pDrawable))
+		return etnaviv_accel_PolyFillRectSolid(pDrawable, pGC, nrect,
+						       prect);
+	else if (pGC->fillStyle == FillTiled)
+		return etnaviv_accel_PolyFillRectTiled(pDrawable, pGC, nrect,
+						       prect);
+	else if (pGC->fillStyle == FillStippled ||
+		 pGC->fillStyle == FillOpaqueStippled)
+		return etnaviv_accel_PolyFillRectStippled(pDrawable, pGC,
+							  nrect, prect);
+
+	return FALSE;
 }
 
 static void
@@ -341,24 +463,269 @@ etnaviv_PolyFillRect(DrawablePtr pDrawable, GCPtr pGC, int nrect,
 	xRectangle * prect)
 {
 	struct etnaviv *etnaviv = etnaviv_get_screen_priv(pDrawable->pScreen);
-	PixmapPtr pPix = drawable_pixmap(pDrawable);
+	struct etnaviv_stat_mark mark;
+
+	mark = etnaviv_stats_start(etnaviv, STAT_POLYFILLRECT);
+	if (!etnaviv_poly_fill_rect(pDrawable, pGC, nrect, prect)) {
+		etnaviv_stats_end(etnaviv, mark, FALSE);
+		unaccel_PolyFillRect(pDrawable, pGC, nrect, prect);
+	} else {
+		etnaviv_stats_end(etnaviv, mark, TRUE);
+	}
+}
+
+/*
+ * The mi polygon and arc code hands its spans to FillSpans a few at a
+ * time.  Rather than clipping and filling each batch, collect them,
+ * merging vertically adjacent spans of equal extent into rectangles,
+ * and fill the rectangles with the PolyFillRect paths.  The GC must not
+ * change while spans are collected.
+ */
+#define SPAN_RECTS	512
+#define SPAN_MERGE	16
+
+struct etnaviv_spans {
+	DrawablePtr pDrawable;
+	GCPtr pGC;
+	GCOps *ops;
+	Bool fallback;
+	unsigned int n;
+	xRectangle rects[SPAN_RECTS];
+};
+
+static GCOps etnaviv_span_GCOps;
+
+static void etnaviv_spans_flush(struct etnaviv_spans *spans)
+{
+	if (spans->n &&
+	    !etnaviv_poly_fill_rect(spans->pDrawable, spans->pGC, spans->n,
+				    spans->rects)) {
+		unaccel_PolyFillRect(spans->pDrawable, spans->pGC, spans->n,
+				     spans->rects);
+		spans->fallback = TRUE;
+	}
+	spans->n = 0;
+}
 
+/* Add a span in drawable coordinates */
+static void etnaviv_spans_add(struct etnaviv_spans *spans, int x, int y,
+	int w)
+{
+	xRectangle *r;
+	unsigned int i;
+
+	for (i = spans->n, r = spans->rects + i; i && spans->n - i < SPAN_MERGE;
+	     i--) {
+		r--;
+		if (r->x == x && r->width == w && r->y + r->height == y) {
+			r->height++;
+			return;
+		}
+	}
+
+	if (spans->n == SPAN_RECTS)
+		etnaviv_spans_flush(spans);
+
+	r = &spans->rects[spans->n++];
+	r->x = x;
+	r->y = y;
+	r->width = w;
+	r->height = 1;
+}
+
+static void
+etnaviv_span_FillSpans(DrawablePtr pDrawable, GCPtr pGC, int n,
+	DDXPointPtr ppt, int *pwidth, int fSorted)
+{
+	struct etnaviv *etnaviv = etnaviv_get_screen_priv(pDrawable->pScreen);
+	struct etnaviv_spans *spans = etnaviv->spans;
+
+	if (pDrawable != spans->pDrawable || pGC != spans->pGC) {
+		spans->ops->FillSpans(pDrawable, pGC, n, ppt, pwidth, fSorted);
+		return;
+	}
+
+	/* FillSpans takes screen coordinates, see miTranslate */
+	for (; n--; ppt++, pwidth++)
+		if (*pwidth > 0)
+			etnaviv_spans_add(spans, ppt->x - pDrawable->x,
+					  ppt->y - pDrawable->y, *pwidth);
+}
+
+static void
+etnaviv_span_PolyPoint(DrawablePtr pDrawable, GCPtr pGC, int mode, int npt,
+	DDXPointPtr ppt)
+{
+	struct etnaviv *etnaviv = etnaviv_get_screen_priv(pDrawable->pScreen);
+	struct etnaviv_spans *spans = etnaviv->spans;
+	int x = 0, y = 0;
+
+	if (pDrawable != spans->pDrawable || pGC != spans->pGC) {
+		spans->ops->PolyPoint(pDrawable, pGC, mode, npt, ppt);
+		return;
+	}
+
+	for (; npt--; ppt++) {
+		if (mode == CoordModePrevious) {
+			x += ppt->x;
+			y += ppt->y;
+		} else {
+			x = ppt->x;
+			y = ppt->y;
+		}
+		etnaviv_spans_add(spans, x, y, 1);
+	}
+}
+
+static void etnaviv_spans_start(struct etnaviv_spans *spans,
+	DrawablePtr pDrawable, GCPtr pGC)
+{
+	struct etnaviv *etnaviv = etnaviv_get_screen_priv(pDrawable->pScreen);
+
+	spans->pDrawable = pDrawable;
+	spans->pGC = pGC;
+	spans->ops = pGC->ops;
+	spans->fallback = FALSE;
+	spans->n = 0;
+
+	etnaviv->spans = spans;
+	pGC->ops = &etnaviv_span_GCOps;
+}
+
+static Bool etnaviv_spans_end(struct etnaviv_spans *spans)
+{
+	struct etnaviv *etnaviv =
+		etnaviv_get_screen_priv(spans->pDrawable->pScreen);
+
+	spans->pGC->ops = spans->ops;
+	etnaviv->spans = NULL;
+
+	etnaviv_spans_flush(spans);
+
+	return !spans->fallback;
+}
+
+static void
+etnaviv_PolyArc(DrawablePtr pDrawable, GCPtr pGC, int narcs, xArc *parcs)
+{
+	struct etnaviv *etnaviv = etnaviv_get_screen_priv(pDrawable->pScreen);
+	struct etnaviv_stat_mark mark;
+	struct etnaviv_spans spans;
+
+	mark = etnaviv_stats_start(etnaviv, STAT_POLYARC);
+
+	/* Dashed arcs change the GC foreground as they are drawn */
+	if (etnaviv->force_fallback || pGC->lineStyle != LineSolid) {
+		if (!etnaviv->force_fallback)
+			etnaviv_stats_reason(etnaviv, FB_GC);
+		etnaviv_stats_end(etnaviv, mark, FALSE);
+		miPolyArc(pDrawable, pGC, narcs, parcs);
+		return;
+	}
+
+	etnaviv_spans_start(&spans, pDrawable, pGC);
+	miPolyArc(pDrawable, pGC, narcs, parcs);
+	etnaviv_stats_end(etnaviv, mark, etnaviv_spans_end(&spans));
+}
+
+static void
+etnaviv_FillPolygon(DrawablePtr pDrawable, GCPtr pGC, int shape, int mode,
+	int count, DDXPointPtr pPts)
+{
+	struct etnaviv *etnaviv = etnaviv_get_screen_priv(pDrawable->pScreen);
+	struct etnaviv_stat_mark mark;
+	struct etnaviv_spans spans;
+
+	mark = etnaviv_stats_start(etnaviv, STAT_FILLPOLYGON);
+	if (etnaviv->force_fallback) {
+		etnaviv_stats_end(etnaviv, mark, FALSE);
+		miFillPolygon(pDrawable, pGC, shape, mode, count, pPts);
+		return;
+	}
+
+	etnaviv_spans_start(&spans, pDrawable, pGC);
+	miFillPolygon(pDrawable, pGC, shape, mode, count, pPts);
+	etnaviv_stats_end(etnaviv, mark, etnaviv_spans_end(&spans));
+}
+
+static void
+etnaviv_PolyFillArc(DrawablePtr pDrawable, GCPtr pGC, int narcs, xArc *parcs)
+{
+	struct etnaviv *etnaviv = etnaviv_get_screen_priv(pDrawable->pScreen);
+	struct etnaviv_stat_mark mark;
+	struct etnaviv_spans spans;
+
+	mark = etnaviv_stats_start(etnaviv, STAT_POLYFILLARC);
+	if (etnaviv->force_fallback) {
+		etnaviv_stats_end(etnaviv, mark, FALSE);
+		miPolyFillArc(pDrawable, pGC, narcs, parcs);
+		return;
+	}
+
+	etnaviv_spans_start(&spans, pDrawable, pGC);
+	miPolyFillArc(pDrawable, pGC, narcs, parcs);
+	etnaviv_stats_end(etnaviv, mark, etnaviv_spans_end(&spans));
+}
+
+static void
+etnaviv_ImageGlyphBlt(DrawablePtr pDrawable, GCPtr pGC, int x, int y,
+	unsigned int nglyph, CharInfoPtr *ppci, pointer pglyphBase)
+{
+	struct etnaviv *etnaviv = etnaviv_get_screen_priv(pDrawable->pScreen);
+	struct etnaviv_stat_mark mark;
+
+	assert(etnaviv_GC_can_accel(pGC, pDrawable));
+
+	mark = etnaviv_stats_start(etnaviv, STAT_IMAGEGLYPHBLT);
 	if (etnaviv->force_fallback ||
-	    (pPix->drawable.width == 1 && pPix->drawable.height == 1))
-		goto fallback;
+	    !etnaviv_accel_ImageGlyphBlt(pDrawable, pGC, x, y, nglyph, ppci)) {
+		etnaviv_stats_end(etnaviv, mark, FALSE);
+		unaccel_ImageGlyphBlt(pDrawable, pGC, x, y, nglyph, ppci,
+				      pglyphBase);
+	} else {
+		etnaviv_stats_end(etnaviv, mark, TRUE);
+	}
+}
+
+static void
+etnaviv_PolyGlyphBlt(DrawablePtr pDrawable, GCPtr pGC, int x, int y,
+	unsigned int nglyph, CharInfoPtr *ppci, pointer pglyphBase)
+{
+	struct etnaviv *etnaviv = etnaviv_get_screen_priv(pDrawable->pScreen);
+	struct etnaviv_stat_mark mark;
 
 	assert(etnaviv_GC_can_accel(pGC, pDrawable));
 
-	if (etnaviv_GCfill_can_accel(pGC, pDrawable)) {
-		if (etnaviv_accel_PolyFillRectSolid(pDrawable, pGC, nrect, prect))
-			return;
-	} else if (pGC->fillStyle == FillTiled) {
-		if (etnaviv_accel_PolyFillRectTiled(pDrawable, pGC, nrect, prect))
-			return;
+	mark = etnaviv_stats_start(etnaviv, STAT_POLYGLYPHBLT);
+	if (etnaviv->force_fallback ||
+	    !etnaviv_GCfill_can_accel(pGC, pDrawable) ||
+	    !etnaviv_accel_PolyGlyphBlt(pDrawable, pGC, x, y, nglyph, ppci)) {
+		etnaviv_stats_end(etnaviv, mark, FALSE);
+		unaccel_PolyGlyphBlt(pDrawable, pGC, x, y, nglyph, ppci,
+				     pglyphBase);
+	} else {
+		etnaviv_stats_end(etnaviv, mark, TRUE);
 	}
+}
 
- fallback:
-	unaccel_PolyFillRect(pDrawable, pGC, nrect, prect);
+static void
+etnaviv_PushPixels(GCPtr pGC, PixmapPtr pBitmap, DrawablePtr pDrawable,
+	int w, int h, int x, int y)
+{
+	struct etnaviv *etnaviv = etnaviv_get_screen_priv(pDrawable->pScreen);
+	struct etnaviv_stat_mark mark;
+
+	assert(etnaviv_GC_can_accel(pGC, pDrawable));
+
+	mark = etnaviv_stats_start(etnaviv, STAT_PUSHPIXELS);
+	if (etnaviv->force_fallback ||
+	    !etnaviv_GCfill_can_accel(pGC, pDrawable) ||
+	    !etnaviv_accel_PushPixels(pGC, pBitmap, pDrawable, w, h, x, y)) {
+		etnaviv_stats_end(etnaviv, mark, FALSE);
+		unaccel_PushPixels(pGC, pBitmap, pDrawable, w, h, x, y);
+	} else {
+		etnaviv_stats_end(etnaviv, mark, TRUE);
+	}
 }
 
 static GCOps etnaviv_GCOps = {
@@ -371,6 +738,57 @@ static GCOps etnaviv_GCOps = {
 	etnaviv_PolyLines,
 	etnaviv_PolySegment,
 	miPolyRectangle,
+	etnaviv_PolyArc,
+	etnaviv_FillPolygon,
+	etnaviv_PolyFillRect,
+	etnaviv_PolyFillArc,
+	miPolyText8,
+	miPolyText16,
+	miImageText8,
+	miImageText16,
+	etnaviv_ImageGlyphBlt,
+	etnaviv_PolyGlyphBlt,
+	etnaviv_PushPixels
+};
+
+/* Used while collecting spans, see etnaviv_spans_start() */
+static GCOps etnaviv_span_GCOps = {
+	etnaviv_span_FillSpans,
+	unaccel_SetSpans,
+	etnaviv_PutImage,
+	etnaviv_CopyArea,
+	unaccel_CopyPlane,
+	etnaviv_span_PolyPoint,
+	etnaviv_PolyLines,
+	etnaviv_PolySegment,
+	miPolyRectangle,
+	miPolyArc,
+	miFillPolygon,
+	etnaviv_PolyFillRect,
+	miPolyFillArc,
+	miPolyText8,
+	miPolyText16,
+	miImageText8,
+	miImageText16,
+	unaccel_ImageGlyphBlt,
+	unaccel_PolyGlyphBlt,
+	unaccel_PushPixels
+};
+
+/*
+ * Used with a partial planemask.  Copies and solid fills apply the
+ * planemask on the GPU, everything else is drawn by fb.
+ */
+static GCOps etnaviv_planemask_GCOps = {
+	unaccel_FillSpans,
+	unaccel_SetSpans,
+	etnaviv_PutImage,
+	etnaviv_CopyArea,
+	unaccel_CopyPlane,
+	unaccel_PolyPoint,
+	unaccel_PolyLines,
+	unaccel_PolySegment,
+	miPolyRectangle,
 	miPolyArc,
 	miFillPolygon,
 	etnaviv_PolyFillRect,
@@ -449,6 +867,18 @@ etnaviv_ValidateGC(GCPtr pGC, unsigned long changes, DrawablePtr pDrawable)
 		/* mask out gctile changes now that we've done the work */
 		changes &= ~GCTile;
 	}
+	/*
+	 * Discard the clip band index if fbValidateGC() is going to
+	 * recompute the composite clip.  It is rebuilt when next needed.
+	 */
+	if (changes & (GCClipXOrigin | GCClipYOrigin | GCClipMask |
+		       GCSubwindowMode) ||
+	    pDrawable->serialNumber !=
+	    (pGC->serialNumber & DRAWABLE_SERIAL_BITS)) {
+		free(etnaviv_get_gc_priv(pGC));
+		etnaviv_set_gc_priv(pGC, NULL);
+	}
+
 	if (changes & GCStipple && pGC->stipple) {
 		prepare_cpu_drawable(&pGC->stipple->drawable, CPU_ACCESS_RW);
 		fbValidateGC(pGC, changes, pDrawable);
@@ -461,17 +891,26 @@ etnaviv_ValidateGC(GCPtr pGC, unsigned long changes, DrawablePtr pDrawable)
 	 * Select the GC ops depending on whether we have any
 	 * chance to accelerate with this GC.
 	 */
-	if (!etnaviv->force_fallback && etnaviv_GC_can_accel(pGC, pDrawable))
+	if (etnaviv->force_fallback || !etnaviv_drawable(pDrawable))
+		pGC->ops = &etnaviv_unaccel_GCOps;
+	else if (etnaviv_GC_can_accel(pGC, pDrawable))
 		pGC->ops = &etnaviv_GCOps;
 	else
-		pGC->ops = &etnaviv_unaccel_GCOps;
+		pGC->ops = &etnaviv_planemask_GCOps;
+}
+
+static void etnaviv_DestroyGC(GCPtr pGC)
+{
+	free(etnaviv_get_gc_priv(pGC));
+	etnaviv_set_gc_priv(pGC, NULL);
+	miDestroyGC(pGC);
 }
 
 static GCFuncs etnaviv_GCFuncs = {
 	etnaviv_ValidateGC,
 	miChangeGC,
 	miCopyGC,
-	miDestroyGC,
+	etnaviv_DestroyGC,
 	miChangeClip,
 	miDestroyClip,
 	miCopyClip
@@ -485,8 +924,16 @@ static Bool etnaviv_CloseScreen(CLOSE_SCREEN_ARGS_DECL)
 	PixmapPtr pixmap;
 
 	DeleteCallback(&FlushCallback, etnaviv_flush_callback, pScrn);
+	etnaviv_finish_shm(etnaviv);
+
+	etnaviv_stats_dump(etnaviv);
 
 	etnaviv_render_close_screen(pScreen);
+	etnaviv_tile_cache_free(pScreen);
+	etnaviv_stipple_cache_free(pScreen);
+	etnaviv_glyph_atlas_free(pScreen);
+	etnaviv_bitmap_cache_free(pScreen);
+	etnaviv_mask_pool_free(pScreen);
 
 	pScreen->CloseScreen = etnaviv->CloseScreen;
 	pScreen->GetImage = etnaviv->GetImage;
@@ -497,6 +944,7 @@ static Bool etnaviv_CloseScreen(CLOSE_SCREEN_ARGS_DECL)
 	pScreen->DestroyPixmap = etnaviv->DestroyPixmap;
 	pScreen->CreateGC = etnaviv->CreateGC;
 	pScreen->BitmapToRegion = etnaviv->BitmapToRegion;
+	pScreen->UnrealizeFont = etnaviv->UnrealizeFont;
 	pScreen->BlockHandler = etnaviv->BlockHandler;
 
 #ifdef HAVE_DRI2
@@ -511,16 +959,96 @@ static Bool etnaviv_CloseScreen(CLOSE_SCREEN_ARGS_DECL)
 	return pScreen->CloseScreen(CLOSE_SCREEN_ARGS);
 }
 
+#ifdef MITSHM
+/* This is what the server does when no ShmPutImage hook is registered */
+static void unaccel_ShmPutImage(DrawablePtr pDrawable, GCPtr pGC, int depth,
+	unsigned int format, int w, int h, int sx, int sy, int sw, int sh,
+	int dx, int dy, char *data)
+{
+	ScreenPtr pScreen = pDrawable->pScreen;
+	PixmapPtr pPixmap;
+	GCPtr putGC;
+
+	if (format == ZPixmap || (format == XYPixmap && depth == 1)) {
+		pPixmap = GetScratchPixmapHeader(pScreen, w, h, depth,
+						 BitsPerPixel(depth),
+						 PixmapBytePad(w, depth), data);
+		if (!pPixmap)
+			return;
+
+		pGC->ops->CopyArea(&pPixmap->drawable, pDrawable, pGC,
+				   sx, sy, sw, sh, dx, dy);
+		FreeScratchPixmapHeader(pPixmap);
+		return;
+	}
+
+	putGC = GetScratchGC(depth, pScreen);
+	if (!putGC)
+		return;
+
+	pPixmap = pScreen->CreatePixmap(pScreen, sw, sh, depth,
+					CREATE_PIXMAP_USAGE_SCRATCH);
+	if (!pPixmap) {
+		FreeScratchGC(putGC);
+		return;
+	}
+
+	ValidateGC(&pPixmap->drawable, putGC);
+	putGC->ops->PutImage(&pPixmap->drawable, putGC, depth, -sx, -sy,
+			     w, h, 0, format == XYPixmap ? XYPixmap : ZPixmap,
+			     data);
+	FreeScratchGC(putGC);
+
+	if (format == XYBitmap)
+		pGC->ops->CopyPlane(&pPixmap->drawable, pDrawable, pGC,
+				    0, 0, sw, sh, dx, dy, 1L);
+	else
+		pGC->ops->CopyArea(&pPixmap->drawable, pDrawable, pGC,
+				   0, 0, sw, sh, dx, dy);
+	pScreen->DestroyPixmap(pPixmap);
+}
+
+static void etnaviv_ShmPutImage(DrawablePtr pDrawable, GCPtr pGC, int depth,
+	unsigned int format, int w, int h, int sx, int sy, int sw, int sh,
+	int dx, int dy, char *data)
+{
+	struct etnaviv *etnaviv = etnaviv_get_screen_priv(pDrawable->pScreen);
+	struct etnaviv_stat_mark mark;
+
+	mark = etnaviv_stats_start(etnaviv, STAT_SHMPUTIMAGE);
+	if (etnaviv->force_fallback ||
+	    !etnaviv_GC_can_accel(pGC, pDrawable) ||
+	    !etnaviv_accel_ShmPutImage(pDrawable, pGC, depth, format, w, h,
+				       sx, sy, sw, sh, dx, dy, data)) {
+		etnaviv_stats_end(etnaviv, mark, FALSE);
+		unaccel_ShmPutImage(pDrawable, pGC, depth, format, w, h,
+				    sx, sy, sw, sh, dx, dy, data);
+	} else {
+		etnaviv_stats_end(etnaviv, mark, TRUE);
+	}
+}
+
+static ShmFuncs etnaviv_shm_funcs = {
+	.PutImage = etnaviv_ShmPutImage,
+};
+#endif
+
 static void
 etnaviv_GetImage(DrawablePtr pDrawable, int x, int y, int w, int h,
 	unsigned int format, unsigned long planeMask, char *d)
 {
 	struct etnaviv *etnaviv = etnaviv_get_screen_priv(pDrawable->pScreen);
+	struct etnaviv_stat_mark mark;
 
+	mark = etnaviv_stats_start(etnaviv, STAT_GETIMAGE);
 	if (etnaviv->force_fallback ||
 	    !etnaviv_accel_GetImage(pDrawable, x, y, w, h, format, planeMask,
-				    d))
+				    d)) {
+		etnaviv_stats_end(etnaviv, mark, FALSE);
 		unaccel_GetImage(pDrawable, x, y, w, h, format, planeMask, d);
+	} else {
+		etnaviv_stats_end(etnaviv, mark, TRUE);
+	}
 }
 
 static void
@@ -557,6 +1085,11 @@ Bool etnaviv_pixmap_flink(PixmapPtr pixmap, uint32_t *name)
 	if (!vpix)
 		return FALSE;
 
+	/* Other users expect a linear layout */
+	if (!etnaviv_pixmap_detile(etnaviv_get_screen_priv(pixmap->drawable.pScreen),
+				   pixmap))
+		return FALSE;
+
 	if (vpix->name) {
 		*name = vpix->name;
 		ret = TRUE;
@@ -707,26 +1240,50 @@ static Bool etnaviv_alloc_etna_bo(ScreenPtr pScreen, struct etnaviv *etnaviv,
 	return FALSE;
 }
 
+/*
+ * Tiled pixmaps must be able to be converted back to a linear layout,
+ * which we only do for pixmaps backed solely by an etna bo.  A8 is not
+ * tiled, and we only trust tiled targets on PE2.0.
+ */
+static Bool etnaviv_pixmap_can_tile(struct etnaviv *etnaviv,
+	struct etnaviv_format fmt)
+{
+	return !etnaviv->bufmgr && fmt.format != DE_FORMAT_A8 &&
+	       VIV_FEATURE(etnaviv->conn, chipMinorFeatures0, 2DPE20);
+}
+
 static PixmapPtr etnaviv_CreatePixmap(ScreenPtr pScreen, int w, int h,
 	int depth, unsigned usage_hint)
 {
 	struct etnaviv *etnaviv = etnaviv_get_screen_priv(pScreen);
 	struct etnaviv_format fmt = { .swizzle = DE_SWIZZLE_ARGB, };
+	struct etnaviv_stat_mark mark;
 	PixmapPtr pixmap;
 
 	if (w > 32768 || h > 32768)
 		return NullPixmap;
 
-	if (depth == 1 || etnaviv->force_fallback)
+	mark = etnaviv_stats_start(etnaviv, STAT_CREATEPIXMAP);
+
+	if (etnaviv->force_fallback)
 		goto fallback;
 
+	if (depth == 1) {
+		etnaviv_stats_reason(etnaviv, FB_FORMAT);
+		goto fallback;
+	}
+
 	if (usage_hint == CREATE_PIXMAP_USAGE_GLYPH_PICTURE &&
-	    w <= 32 && h <= 32)
+	    w <= 32 && h <= 32) {
+		etnaviv_stats_reason(etnaviv, FB_GEOMETRY);
 		goto fallback;
+	}
 
 	pixmap = etnaviv->CreatePixmap(pScreen, 0, 0, depth, usage_hint);
-	if (pixmap == NullPixmap || w == 0 || h == 0)
+	if (pixmap == NullPixmap || w == 0 || h == 0) {
+		etnaviv_stats_end(etnaviv, mark, pixmap != NullPixmap);
 		return pixmap;
+	}
 
 	/* Create the appropriate format for this pixmap */
 	switch (pixmap->drawable.bitsPerPixel) {
@@ -735,6 +1292,7 @@ static PixmapPtr etnaviv_CreatePixmap(ScreenPtr pScreen, int w, int h,
 			fmt.format = DE_FORMAT_A8;
 			break;
 		}
+		etnaviv_stats_reason(etnaviv, FB_FORMAT);
 		goto fallback_free_pix;
 
 	case 16:
@@ -749,9 +1307,22 @@ static PixmapPtr etnaviv_CreatePixmap(ScreenPtr pScreen, int w, int h,
 		break;
 
 	default:
+		etnaviv_stats_reason(etnaviv, FB_FORMAT);
 		goto fallback_free_pix;
 	}
 
+	/*
+	 * Composite backing pixmaps are normally only rendered to and
+	 * read by the GPU, so lay them out in tiles for better locality
+	 * in the PE.  Tiled pixmaps are converted to linear on their
+	 * first CPU access, see etnaviv_pixmap_detile().
+	 */
+	if (usage_hint == CREATE_PIXMAP_USAGE_BACKING_PIXMAP)
+		usage_hint |= CREATE_PIXMAP_USAGE_TILE;
+	if (!etnaviv_pixmap_can_tile(etnaviv, fmt))
+		usage_hint &= ~CREATE_PIXMAP_USAGE_TILE;
+
+	etnaviv_stats_reason(etnaviv, FB_ALLOC);
 	if (etnaviv->bufmgr) {
 		if (!etnaviv_alloc_armada_bo(pScreen, etnaviv, pixmap,
 					     w, h, fmt, usage_hint))
@@ -761,11 +1332,14 @@ static PixmapPtr etnaviv_CreatePixmap(ScreenPtr pScreen, int w, int h,
 					   w, h, fmt, usage_hint))
 			goto fallback_free_pix;
 	}
+	etnaviv_stats_end(etnaviv, mark, TRUE);
 	goto out;
 
  fallback_free_pix:
 	etnaviv->DestroyPixmap(pixmap);
  fallback:
+	etnaviv_stats_end(etnaviv, mark, FALSE);
+
 	/* GPU pixmaps must fail rather than fall back */
 	if (usage_hint & CREATE_PIXMAP_USAGE_GPU)
 		return NULL;
@@ -788,11 +1362,22 @@ static Bool etnaviv_DestroyPixmap(PixmapPtr pixmap)
 #ifdef DEBUG_PIXMAP
 		dbg("Destroying pixmap %p\n", pixmap);
 #endif
+		etnaviv_tile_cache_forget(pixmap->drawable.pScreen, pixmap);
 		etnaviv_free_pixmap(pixmap);
 	}
 	return etnaviv->DestroyPixmap(pixmap);
 }
 
+/* Cached core font glyphs are keyed by CharInfo, which is about to go */
+static Bool etnaviv_UnrealizeFont(ScreenPtr pScreen, FontPtr pFont)
+{
+	struct etnaviv *etnaviv = etnaviv_get_screen_priv(pScreen);
+
+	etnaviv_glyph_atlas_empty(pScreen);
+
+	return etnaviv->UnrealizeFont(pScreen, pFont);
+}
+
 static Bool etnaviv_CreateGC(GCPtr pGC)
 {
 	struct etnaviv *etnaviv = etnaviv_get_screen_priv(pGC->pScreen);
@@ -849,6 +1434,8 @@ static void etnaviv_BlockHandler(BLOCKHANDLER_ARGS_DECL)
 	 */
 	if (!xorg_list_is_empty(&etnaviv->usermem_free_list))
 		etnaviv_free_usermem(etnaviv);
+
+	etnaviv_stats_block_handler(etnaviv);
 }
 
 static Bool etnaviv_pre_init(ScrnInfoPtr pScrn, int drm_fd)
@@ -883,6 +1470,20 @@ static Bool etnaviv_pre_init(ScrnInfoPtr pScrn, int drm_fd)
 						     FALSE);
 #endif
 
+	if (xf86ReturnOptValBool(options, OPTION_ACCEL_STATS, FALSE)) {
+		etnaviv->stats = etnaviv_stats_alloc();
+		if (etnaviv->stats)
+			xf86DrvMsg(pScrn->scrnIndex, X_CONFIG,
+				   "accel statistics enabled, dump with SIGUSR2\n");
+	}
+
+	/*
+	 * Solid fills through the 3D resolve engine have not yet been
+	 * tested on hardware, so they are off unless asked for.
+	 */
+	etnaviv->rs_fill = xf86ReturnOptValBool(options, OPTION_RESOLVE_FILL,
+						FALSE);
+
 	etnaviv->scrnIndex = pScrn->scrnIndex;
 
 	if (etnaviv_private_index == -1)
@@ -901,7 +1502,8 @@ static Bool etnaviv_ScreenInit(ScreenPtr pScreen, struct drm_armada_bufmgr *mgr)
 	struct etnaviv *etnaviv = pScrn->privates[etnaviv_private_index].ptr;
 
 	if (!etnaviv_CreateKey(&etnaviv_pixmap_index, PRIVATE_PIXMAP) ||
-	    !etnaviv_CreateKey(&etnaviv_screen_index, PRIVATE_SCREEN))
+	    !etnaviv_CreateKey(&etnaviv_screen_index, PRIVATE_SCREEN) ||
+	    !etnaviv_CreateKey(&etnaviv_gc_index, PRIVATE_GC))
 		return FALSE;
 
 	etnaviv->bufmgr = mgr;
@@ -913,6 +1515,7 @@ static Bool etnaviv_ScreenInit(ScreenPtr pScreen, struct drm_armada_bufmgr *mgr)
 	xorg_list_init(&etnaviv->fence_head);
 	xorg_list_init(&etnaviv->busy_free_list);
 	xorg_list_init(&etnaviv->usermem_free_list);
+	xorg_list_init(&etnaviv->shm_busy_list);
 
 	etnaviv_set_screen_priv(pScreen, etnaviv);
 
@@ -989,14 +1592,20 @@ static Bool etnaviv_ScreenInit(ScreenPtr pScreen, struct drm_armada_bufmgr *mgr)
 	pScreen->CreateGC = etnaviv_CreateGC;
 	etnaviv->BitmapToRegion = pScreen->BitmapToRegion;
 	pScreen->BitmapToRegion = unaccel_BitmapToRegion;
+	etnaviv->UnrealizeFont = pScreen->UnrealizeFont;
+	pScreen->UnrealizeFont = etnaviv_UnrealizeFont;
 	etnaviv->BlockHandler = pScreen->BlockHandler;
 	pScreen->BlockHandler = etnaviv_BlockHandler;
+#ifdef MITSHM
+	ShmRegisterFuncs(pScreen, &etnaviv_shm_funcs);
+#endif
 
 	etnaviv_render_screen_init(pScreen);
 
 	return TRUE;
 
 fail_accel:
+	etnaviv_stats_free(etnaviv->stats);
 	free(etnaviv);
 	return FALSE;
 }
@@ -1154,6 +1763,37 @@ static int etnaviv_export_name(ScreenPtr pScreen, uint32_t name)
 	return fd;
 }
 
+/*
+ * Export a pixmap's buffer for scanout.  The overlay does not take
+ * part in our fencing, so wait for any outstanding GPU operations.
+ */
+static int etnaviv_export_pixmap(ScreenPtr pScreen, PixmapPtr pixmap)
+{
+	struct etnaviv *etnaviv = etnaviv_get_screen_priv(pScreen);
+	struct etnaviv_pixmap *vPix = etnaviv_get_pixmap_priv(pixmap);
+	int fd;
+
+	/* Only pixmaps the client imported via DRI3 may be exported */
+	if (!vPix || !vPix->etna_bo || !(vPix->state & ST_DMABUF))
+		return -1;
+
+	/* The overlay expects a linear layout */
+	if (!etnaviv_pixmap_detile(etnaviv, pixmap))
+		return -1;
+
+	etnaviv_batch_wait_commit(etnaviv, vPix);
+
+	fd = etna_bo_to_dmabuf(etnaviv->conn, vPix->etna_bo);
+	if (fd < 0) {
+		xf86DrvMsg(etnaviv->scrnIndex, X_ERROR,
+			   "etna_bo_to_dmabuf failed: %s\n",
+			   strerror(errno));
+		return -1;
+	}
+
+	return fd;
+}
+
 const struct armada_accel_ops etnaviv_ops = {
 	.pre_init	= etnaviv_pre_init,
 	.screen_init	= etnaviv_ScreenInit,
@@ -1163,4 +1803,5 @@ const struct armada_accel_ops etnaviv_ops = {
 	.free_pixmap	= etnaviv_free_pixmap,
 	.xv_init	= etnaviv_xv_init,
 	.export_name	= etnaviv_export_name,
+	.export_pixmap	= etnaviv_export_pixmap,
 };
@@ -14,16 +14,21 @@
 #endif
 
 #include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
 #ifdef HAVE_DIX_CONFIG_H
 #include "dix-config.h"
 #endif
+#include "dixfontstr.h"
 #include "fb.h"
 #include "gcstruct.h"
 #include "xf86.h"
 
 #include "boxutil.h"
+#include "fbutil.h"
 #include "pixmaputil.h"
 #include "prefetch.h"
 #include "unaccel.h"
@@ -32,6 +37,7 @@
 #include "etnaviv_accel.h"
 #include "etnaviv_op.h"
 #include "etnaviv_render.h"
+#include "etnaviv_stats.h"
 #include "etnaviv_utils.h"
 
 #include <etnaviv/etna.h>
@@ -74,7 +80,7 @@ void etnaviv_batch_wait_commit(struct etnaviv *etnaviv,
 	}
 }
 
-static void etnaviv_batch_add(struct etnaviv *etnaviv,
+void etnaviv_batch_add(struct etnaviv *etnaviv,
 	struct etnaviv_pixmap *vPix)
 {
 	switch (vPix->batch_state) {
@@ -92,14 +98,166 @@ static void etnaviv_batch_add(struct etnaviv *etnaviv,
 void etnaviv_batch_start(struct etnaviv *etnaviv,
 	const struct etnaviv_de_op *op)
 {
+	/* Any deferred composite must be emitted before this operation */
+	etnaviv_render_flush(etnaviv);
+
 	if (op->src.pixmap)
 		etnaviv_batch_add(etnaviv, op->src.pixmap);
-
-	etnaviv_batch_add(etnaviv, op->dst.pixmap);
+	if (op->dst.pixmap)
+		etnaviv_batch_add(etnaviv, op->dst.pixmap);
 
 	etnaviv_de_start(etnaviv, op);
 }
 
+/*
+ * Convert a tiled pixmap to a linear layout, so that the CPU or another
+ * process can access it.  The GPU copies the contents into a new linear
+ * bo, which then replaces the tiled bo.  This is a one-way conversion:
+ * a pixmap which has been accessed by the CPU once is likely to be
+ * accessed again.  If the GPU has never written the pixmap, there is
+ * nothing to copy, so just swap in the linear bo.
+ */
+Bool etnaviv_pixmap_detile(struct etnaviv *etnaviv, PixmapPtr pixmap)
+{
+	struct etnaviv_pixmap *vPix = etnaviv_get_pixmap_priv(pixmap);
+	struct etnaviv_format fmt;
+	struct etnaviv_de_op op;
+	struct etna_bo *etna_bo;
+	unsigned pitch;
+	BoxRec box;
+
+	if (!vPix || !vPix->format.tile)
+		return TRUE;
+
+	/* Only pixmaps solely backed by an etna bo can be converted */
+	if (vPix->bo || vPix->state & ST_DMABUF)
+		return FALSE;
+
+	fmt = vPix->format;
+	fmt.tile = 0;
+
+	pitch = etnaviv_pitch(vPix->width, pixmap->drawable.bitsPerPixel);
+	etna_bo = etna_bo_new(etnaviv->conn, pitch * vPix->height,
+			DRM_ETNA_GEM_TYPE_BMP | DRM_ETNA_GEM_CACHE_WBACK);
+	if (!etna_bo)
+		return FALSE;
+
+	if (!(vPix->state & ST_GPU_WRITTEN))
+		goto swap;
+
+	if (!etnaviv_map_gpu(etnaviv, vPix, GPU_ACCESS_RW)) {
+		etna_bo_del(etnaviv->conn, etna_bo, NULL);
+		return FALSE;
+	}
+
+	box.x1 = 0;
+	box.y1 = 0;
+	box.x2 = vPix->width;
+	box.y2 = vPix->height;
+
+	op.src = INIT_BLIT_PIX(vPix, vPix->format, ZERO_OFFSET);
+	op.dst = INIT_BLIT_BUF(fmt, vPix, etna_bo, pitch, ZERO_OFFSET);
+	op.blend_op = NULL;
+	op.clip = &box;
+	op.src_origin_mode = SRC_ORIGIN_RELATIVE;
+	op.rop = 0xcc;
+	op.cmd = VIVS_DE_DEST_CONFIG_COMMAND_BIT_BLT;
+	op.brush = FALSE;
+
+	etnaviv_batch_start(etnaviv, &op);
+	etnaviv_de_op(etnaviv, &op, &box, 1);
+	etnaviv_de_end(etnaviv);
+
+ swap:
+	/*
+	 * The tiled bo must not be released until the copy, or any
+	 * other GPU use of it, has completed.
+	 */
+	etnaviv_batch_wait_commit(etnaviv, vPix);
+	etna_bo_del(etnaviv->conn, vPix->etna_bo, NULL);
+
+	vPix->etna_bo = etna_bo;
+	vPix->pitch = pitch;
+	vPix->format = fmt;
+	vPix->pict_format.tile = 0;
+
+	pixmap->drawable.pScreen->ModifyPixmapHeader(pixmap, 0, 0, 0, 0,
+						     pitch, NULL);
+
+	return TRUE;
+}
+
+/* Don't keep pool masks larger than this around */
+#define MASK_POOL_MAX_AREA	(1024 * 1024)
+
+static Bool etnaviv_pixmap_idle(struct etnaviv *etnaviv, PixmapPtr pixmap)
+{
+	struct etnaviv_pixmap *vPix = etnaviv_get_pixmap_priv(pixmap);
+
+	return vPix->batch_state == B_NONE ||
+	       (vPix->batch_state == B_FENCED &&
+		VIV_FENCE_BEFORE_EQ(vPix->fence, etnaviv->last_fence));
+}
+
+/*
+ * Get an A8 pixmap for a trapezoid or triangle mask, or a monochrome
+ * source.  The pixmap is written by the CPU, so we can only re-use a
+ * pool entry once the GPU has finished reading from it; otherwise we
+ * would stall waiting for the GPU.  Busy entries are replaced rather
+ * than waited upon.
+ */
+PixmapPtr etnaviv_mask_pool_get(ScreenPtr pScreen, int width,
+	int height)
+{
+	struct etnaviv *etnaviv = etnaviv_get_screen_priv(pScreen);
+	PixmapPtr pixmap;
+	unsigned i;
+
+	if (width * height > MASK_POOL_MAX_AREA)
+		return pScreen->CreatePixmap(pScreen, width, height, 8,
+					     CREATE_PIXMAP_USAGE_GPU);
+
+	for (i = 0; i < ETNAVIV_MASK_POOL; i++) {
+		pixmap = etnaviv->mask_pool[i];
+		if (pixmap &&
+		    pixmap->drawable.width >= width &&
+		    pixmap->drawable.height >= height &&
+		    etnaviv_pixmap_idle(etnaviv, pixmap)) {
+			pixmap->refcnt++;
+			return pixmap;
+		}
+	}
+
+	/* Round the size up so the entry is more likely to be re-used */
+	pixmap = pScreen->CreatePixmap(pScreen, ALIGN(width, 64),
+				       ALIGN(height, 16), 8,
+				       CREATE_PIXMAP_USAGE_GPU);
+	if (!pixmap)
+		return NULL;
+
+	i = etnaviv->mask_pool_next;
+	etnaviv->mask_pool_next = (i + 1) % ETNAVIV_MASK_POOL;
+	if (etnaviv->mask_pool[i])
+		pScreen->DestroyPixmap(etnaviv->mask_pool[i]);
+	etnaviv->mask_pool[i] = pixmap;
+
+	pixmap->refcnt++;
+	return pixmap;
+}
+
+void etnaviv_mask_pool_free(ScreenPtr pScreen)
+{
+	struct etnaviv *etnaviv = etnaviv_get_screen_priv(pScreen);
+	unsigned i;
+
+	for (i = 0; i < ETNAVIV_MASK_POOL; i++) {
+		if (etnaviv->mask_pool[i]) {
+			pScreen->DestroyPixmap(etnaviv->mask_pool[i]);
+			etnaviv->mask_pool[i] = NULL;
+		}
+	}
+}
+
 static void etnaviv_blit_clipped(struct etnaviv *etnaviv,
 	struct etnaviv_de_op *op, const BoxRec *pbox, size_t nbox)
 {
@@ -121,18 +279,124 @@ static void etnaviv_blit_clipped(struct etnaviv *etnaviv,
 		etnaviv_de_op(etnaviv, op, boxes, n);
 }
 
+static inline void etnaviv_blit_add(struct etnaviv *etnaviv,
+	const struct etnaviv_de_op *op, BoxRec *boxes, size_t *n,
+	int x1, int y1, int x2, int y2)
+{
+	BoxRec *b = &boxes[(*n)++];
+
+	b->x1 = x1;
+	b->y1 = y1;
+	b->x2 = x2;
+	b->y2 = y2;
+
+	if (*n >= VIVANTE_MAX_2D_RECTS) {
+		etnaviv_de_op(etnaviv, op, boxes, *n);
+		*n = 0;
+	}
+}
+
+/*
+ * Copy boxes within one pixmap, where the source and destination of a
+ * box may overlap.  The engine does not define the order in which it
+ * reads and writes the pixels of a rectangle, so split overlapping
+ * boxes into strips no larger than the copy distance, and emit them in
+ * the order which reads each strip's source before it is overwritten.
+ * The boxes themselves are already ordered by miCopyRegion().
+ */
+static void etnaviv_blit_overlap(struct etnaviv *etnaviv,
+	struct etnaviv_de_op *op, const BoxRec *pbox, size_t nbox)
+{
+	const BoxRec *clip = op->clip;
+	BoxRec boxes[VIVANTE_MAX_2D_RECTS], b;
+	int sx = op->src.offset.x;
+	int sy = op->src.offset.y;
+	size_t n = 0;
+	int i;
+
+	for (; nbox; nbox--, pbox++) {
+		if (__box_intersect(&b, clip, pbox))
+			continue;
+
+		if (abs(sx) >= b.x2 - b.x1 || abs(sy) >= b.y2 - b.y1) {
+			etnaviv_blit_add(etnaviv, op, boxes, &n,
+					 b.x1, b.y1, b.x2, b.y2);
+		} else if (sy > 0) {
+			/* Source below the destination: top to bottom */
+			for (i = b.y1; i < b.y2; i += sy)
+				etnaviv_blit_add(etnaviv, op, boxes, &n,
+						 b.x1, i, b.x2,
+						 mint(i + sy, (int)b.y2));
+		} else if (sy < 0) {
+			/* Source above the destination: bottom to top */
+			for (i = b.y2; i > b.y1; i += sy)
+				etnaviv_blit_add(etnaviv, op, boxes, &n,
+						 b.x1, maxt(i + sy, (int)b.y1),
+						 b.x2, i);
+		} else if (sx > 0) {
+			/* Source to the right: left to right */
+			for (i = b.x1; i < b.x2; i += sx)
+				etnaviv_blit_add(etnaviv, op, boxes, &n,
+						 i, b.y1,
+						 mint(i + sx, (int)b.x2), b.y2);
+		} else if (sx < 0) {
+			/* Source to the left: right to left */
+			for (i = b.x2; i > b.x1; i += sx)
+				etnaviv_blit_add(etnaviv, op, boxes, &n,
+						 maxt(i + sx, (int)b.x1), b.y1,
+						 i, b.y2);
+		} else {
+			/* Each pixel is its own source */
+			etnaviv_blit_add(etnaviv, op, boxes, &n,
+					 b.x1, b.y1, b.x2, b.y2);
+		}
+	}
+
+	if (n)
+		etnaviv_de_op(etnaviv, op, boxes, n);
+}
+
+/*
+ * Return the band index of the GC composite clip, building it if the
+ * clip has changed since it was last used.
+ */
+static const struct box_bands *etnaviv_clip_bands(struct etnaviv *etnaviv,
+	GCPtr pGC)
+{
+	RegionPtr clip = fbGetCompositeClip(pGC);
+	struct box_bands *bands = etnaviv_get_gc_priv(pGC);
+
+	if (!bands || bands->boxes != RegionRects(clip) ||
+	    bands->nbox != RegionNumRects(clip)) {
+		free(bands);
+		bands = box_bands_create(RegionRects(clip),
+					 RegionNumRects(clip));
+		etnaviv_set_gc_priv(pGC, bands);
+		if (!bands)
+			etnaviv_stats_reason(etnaviv, FB_ALLOC);
+	}
+
+	return bands;
+}
+
 static Bool etnaviv_init_dst_drawable(struct etnaviv *etnaviv,
 	struct etnaviv_de_op *op, DrawablePtr pDrawable)
 {
 	op->dst.pixmap = etnaviv_drawable_offset(pDrawable, &op->dst.offset);
-	if (!op->dst.pixmap)
+	if (!op->dst.pixmap) {
+		etnaviv_stats_reason(etnaviv, FB_DRAWABLE);
 		return FALSE;
+	}
 
-	if (!etnaviv_dst_format_valid(etnaviv, op->dst.pixmap->format))
+	if (!etnaviv_dst_format_valid(etnaviv, op->dst.pixmap->format)) {
+		etnaviv_stats_reason(etnaviv, FB_FORMAT);
 		return FALSE;
+	}
 
-	if (!etnaviv_map_gpu(etnaviv, op->dst.pixmap, GPU_ACCESS_RW))
+	if (!etnaviv_map_gpu(etnaviv, op->dst.pixmap, GPU_ACCESS_RW)) {
+		etnaviv_stats_reason(etnaviv, FB_MAP);
 		return FALSE;
+	}
 
 	op->dst.bo = op->dst.pixmap->etna_bo;
 	op->dst.pitch = op->dst.pixmap->pitch;
@@ -146,16 +410,22 @@ static Bool etnaviv_init_dstsrc_drawable(struct etnaviv *etnaviv,
 {
 	op->dst.pixmap = etnaviv_drawable_offset(pDst, &op->dst.offset);
 	op->src.pixmap = etnaviv_drawable_offset(pSrc, &op->src.offset);
-	if (!op->dst.pixmap || !op->src.pixmap)
+	if (!op->dst.pixmap || !op->src.pixmap) {
+		etnaviv_stats_reason(etnaviv, FB_DRAWABLE);
 		return FALSE;
+	}
 
 	if (!etnaviv_src_format_valid(etnaviv, op->src.pixmap->format) ||
-	    !etnaviv_dst_format_valid(etnaviv, op->dst.pixmap->format))
+	    !etnaviv_dst_format_valid(etnaviv, op->dst.pixmap->format)) {
+		etnaviv_stats_reason(etnaviv, FB_FORMAT);
 		return FALSE;
+	}
 
 	if (!etnaviv_map_gpu(etnaviv, op->dst.pixmap, GPU_ACCESS_RW) ||
-	    !etnaviv_map_gpu(etnaviv, op->src.pixmap, GPU_ACCESS_RO))
+	    !etnaviv_map_gpu(etnaviv, op->src.pixmap, GPU_ACCESS_RO)) {
+		etnaviv_stats_reason(etnaviv, FB_MAP);
 		return FALSE;
+	}
 
 	op->dst.bo = op->dst.pixmap->etna_bo;
 	op->dst.pitch = op->dst.pixmap->pitch;
@@ -171,14 +441,20 @@ static Bool etnaviv_init_src_pixmap(struct etnaviv *etnaviv,
 	struct etnaviv_de_op *op, PixmapPtr pix)
 {
 	op->src.pixmap = etnaviv_get_pixmap_priv(pix);
-	if (!op->src.pixmap)
+	if (!op->src.pixmap) {
+		etnaviv_stats_reason(etnaviv, FB_DRAWABLE);
 		return FALSE;
+	}
 
-	if (!etnaviv_src_format_valid(etnaviv, op->src.pixmap->format))
+	if (!etnaviv_src_format_valid(etnaviv, op->src.pixmap->format)) {
+		etnaviv_stats_reason(etnaviv, FB_FORMAT);
 		return FALSE;
+	}
 
-	if (!etnaviv_map_gpu(etnaviv, op->src.pixmap, GPU_ACCESS_RO))
+	if (!etnaviv_map_gpu(etnaviv, op->src.pixmap, GPU_ACCESS_RO)) {
+		etnaviv_stats_reason(etnaviv, FB_MAP);
 		return FALSE;
+	}
 
 	op->src.bo = op->src.pixmap->etna_bo;
 	op->src.pitch = op->src.pixmap->pitch;
@@ -198,7 +474,17 @@ void etnaviv_commit(struct etnaviv *etnaviv, Bool stall, uint32_t *fence)
 	if (!fence && stall)
 		fence = &tmp_fence;
 
+	etnaviv_render_flush(etnaviv);
+
 	ret = etna_flush(ctx, fence);
+
+	/*
+	 * GPU state is not preserved between submissions: another
+	 * client may reprogram the 2D core, or the GPU may be recovered
+	 * after a failure.  Reload the Xv filter kernel in the next one.
+	 */
+	etnaviv->xv_kernel = NULL;
+
 	if (ret) {
 		etnaviv_error(etnaviv, "etna_flush", ret);
 		return;
@@ -281,7 +567,9 @@ void etnaviv_commit(struct etnaviv *etnaviv, Bool stall, uint32_t *fence)
  *
  * fgrop: used when mask bit is 1
  * bgrop: used when mask bit is 0
- * mask (in brush): is an 8x8 mask: LSB is top line, LS bit righthand-most
+ * With a ROP4, the mask is the monochrome source, see etnaviv_de_start().
+ * mask (in brush): is an 8x8 mask selecting the brush foreground (1) or
+ * background (0) colour: LSB is top line, LS bit righthand-most
  */
 static const uint8_t etnaviv_fill_rop[] = {
 	/* GXclear        */  0x00,		// ROP_BLACK,
@@ -302,15 +590,10 @@ static const uint8_t etnaviv_fill_rop[] = {
 	/* GXset          */  0xff		// ROP_WHITE
 };
 
-static uint32_t etnaviv_fg_col(struct etnaviv *etnaviv, GCPtr pGC)
+static uint32_t etnaviv_pixel_col(struct etnaviv *etnaviv, GCPtr pGC,
+	uint32_t pixel)
 {
-	uint32_t pixel, colour;
-
-	if (pGC->fillStyle == FillTiled)
-		pixel = pGC->tileIsPixel ? pGC->tile.pixel :
-			get_first_pixel(&pGC->tile.pixmap->drawable);
-	else
-		pixel = pGC->fgPixel;
+	uint32_t colour;
 
 	/* With PE1.0, this is the pixel value, but PE2.0, it must be ARGB */
 	if (!VIV_FEATURE(etnaviv->conn, chipMinorFeatures0, 2DPE20))
@@ -343,6 +626,20 @@ static uint32_t etnaviv_fg_col(struct etnaviv *etnaviv, GCPtr pGC)
 	return colour;
 }
 
+static Pixel etnaviv_fg_pixel(GCPtr pGC)
+{
+	if (pGC->fillStyle == FillTiled)
+		return pGC->tileIsPixel ? pGC->tile.pixel :
+			get_first_pixel(&pGC->tile.pixmap->drawable);
+
+	return pGC->fgPixel;
+}
+
+static uint32_t etnaviv_fg_col(struct etnaviv *etnaviv, GCPtr pGC)
+{
+	return etnaviv_pixel_col(etnaviv, pGC, etnaviv_fg_pixel(pGC));
+}
+
 static void etnaviv_init_fill(struct etnaviv *etnaviv,
 	struct etnaviv_de_op *op, GCPtr pGC)
 {
@@ -350,10 +647,26 @@ static void etnaviv_init_fill(struct etnaviv *etnaviv,
 	op->blend_op = NULL;
 	op->src_origin_mode = SRC_ORIGIN_NONE;
 	op->rop = etnaviv_fill_rop[pGC->alu];
-	op->brush = TRUE;
+	op->brush = BRUSH_SOLID;
 	op->fg_colour = etnaviv_fg_col(etnaviv, pGC);
 }
 
+/*
+ * The DE has no write mask.  A partial planemask is applied by loading
+ * it into the brush, and extending the ROP to leave the destination
+ * unchanged where the brush bits are clear.
+ */
+static void etnaviv_init_planemask(struct etnaviv *etnaviv,
+	struct etnaviv_de_op *op, GCPtr pGC, DrawablePtr pDrawable)
+{
+	if (pGC && !fb_full_planemask(pDrawable, pGC->planemask)) {
+		op->rop = (op->rop & 0xf0) | 0x0a;
+		op->brush = BRUSH_SOLID;
+		op->fg_colour = etnaviv_pixel_col(etnaviv, pGC,
+				pGC->planemask & FbFullMask(pDrawable->depth));
+	}
+}
+
 static const uint8_t etnaviv_copy_rop[] = {
 	/* GXclear        */  0x00,		// ROP_BLACK,
 	/* GXand          */  0x88,		// ROP_DST_AND_SRC,
@@ -379,15 +692,20 @@ Bool etnaviv_accel_FillSpans(DrawablePtr pDrawable, GCPtr pGC, int n,
 	struct etnaviv *etnaviv = etnaviv_get_screen_priv(pDrawable->pScreen);
 	struct etnaviv_de_op op;
 	RegionPtr clip = fbGetCompositeClip(pGC);
-	int nclip;
-	BoxRec *boxes, *b;
-	size_t sz;
+	const struct box_bands *bands;
+	const struct box_band *band;
+	BoxRec boxes[VIVANTE_MAX_2D_RECTS], *b;
+	Bool started = FALSE;
 
 	assert(pGC->miTranslate);
 
 	if (RegionNumRects(clip) == 0)
 		return TRUE;
 
+	bands = etnaviv_clip_bands(etnaviv, pGC);
+	if (!bands)
+		return FALSE;
+
 	if (!etnaviv_init_dst_drawable(etnaviv, &op, pDrawable))
 		return FALSE;
 
@@ -395,17 +713,6 @@ Bool etnaviv_accel_FillSpans(DrawablePtr pDrawable, GCPtr pGC, int n,
 	op.clip = RegionExtents(clip);
 	op.cmd = VIVS_DE_DEST_CONFIG_COMMAND_LINE;
 
-	nclip = RegionNumRects(clip);
-	sz = sizeof(BoxRec) * n * nclip;
-
-	/* If we overflow, fallback.  We could do better here. */
-	if (sz / nclip != sizeof(BoxRec) * n)
-		return FALSE;
-
-	boxes = malloc(sz);
-	if (!boxes)
-		return FALSE;
-
 	prefetch(ppt);
 	prefetch(ppt + 8);
 	prefetch(pwidth);
@@ -414,50 +721,51 @@ Bool etnaviv_accel_FillSpans(DrawablePtr pDrawable, GCPtr pGC, int n,
 	b = boxes;
 
 	while (n--) {
-		BoxPtr pBox;
-		int nBox, x, y, w;
+		const BoxRec *pBox, *pEnd;
+		int x, y, w;
 
 		prefetch(ppt + 16);
 		prefetch(pwidth + 16);
 
-		nBox = nclip;
-		pBox = RegionRects(clip);
-
 		y = ppt->y;
 		x = ppt->x;
 		w = *pwidth++;
+		ppt++;
 
-		do {
-			if (pBox->y1 <= y && pBox->y2 > y) {
-				int l, r;
-
-				l = x;
-				if (l < pBox->x1)
-					l = pBox->x1;
-				r = x + w;
-				if (r > pBox->x2)
-					r = pBox->x2;
-
-				if (l < r) {
-					b->x1 = l;
-					b->y1 = y;
-					b->x2 = r;
-					b->y2 = y;
-					b++;
+		/* Only one band can contain this span */
+		band = box_bands_find(bands, y);
+		if (band == box_bands_end(bands) || band->y1 > y)
+			continue;
+
+		pEnd = bands->boxes + band->end;
+		for (pBox = box_band_find(bands, band, x);
+		     pBox < pEnd && pBox->x1 < x + w; pBox++) {
+			b->x1 = maxt(x, pBox->x1);
+			b->y1 = y;
+			b->x2 = mint(x + w, pBox->x2);
+			b->y2 = y;
+
+			if (++b == boxes + VIVANTE_MAX_2D_RECTS) {
+				if (!started) {
+					etnaviv_batch_start(etnaviv, &op);
+					started = TRUE;
 				}
+				etnaviv_de_op(etnaviv, &op, boxes, b - boxes);
+				b = boxes;
 			}
-			pBox++;
-		} while (--nBox);
-		ppt++;
+		}
 	}
 
+	/* Only emit an op if a span was visible */
 	if (b != boxes) {
-		etnaviv_batch_start(etnaviv, &op);
+		if (!started) {
+			etnaviv_batch_start(etnaviv, &op);
+			started = TRUE;
+		}
 		etnaviv_de_op(etnaviv, &op, boxes, b - boxes);
-		etnaviv_de_end(etnaviv);
 	}
-
-	free(boxes);
+	if (started)
+		etnaviv_de_end(etnaviv);
 
 	return TRUE;
 }
@@ -466,22 +774,29 @@ Bool etnaviv_accel_PutImage(DrawablePtr pDrawable, GCPtr pGC, int depth,
 	int x, int y, int w, int h, int leftPad, int format, char *bits)
 {
 	ScreenPtr pScreen = pDrawable->pScreen;
+	struct etnaviv *etnaviv = etnaviv_get_screen_priv(pScreen);
 	struct etnaviv_pixmap *vPix;
 	PixmapPtr pPix, pTemp;
 	GCPtr gc;
 
-	if (format != ZPixmap)
+	if (format != ZPixmap) {
+		etnaviv_stats_reason(etnaviv, FB_FORMAT);
 		return FALSE;
+	}
 
 	pPix = drawable_pixmap(pDrawable);
 	vPix = etnaviv_get_pixmap_priv(pPix);
-	if (!(vPix->state & ST_GPU_RW))
+	if (!(vPix->state & ST_GPU_RW)) {
+		etnaviv_stats_reason(etnaviv, FB_DRAWABLE);
 		return FALSE;
+	}
 
 	pTemp = pScreen->CreatePixmap(pScreen, w, h, pPix->drawable.depth,
 				      CREATE_PIXMAP_USAGE_GPU);
-	if (!pTemp)
+	if (!pTemp) {
+		etnaviv_stats_reason(etnaviv, FB_ALLOC);
 		return FALSE;
+	}
 
 	gc = GetScratchGC(pTemp->drawable.depth, pScreen);
 	if (!gc) {
@@ -500,10 +815,189 @@ Bool etnaviv_accel_PutImage(DrawablePtr pDrawable, GCPtr pGC, int depth,
 	return TRUE;
 }
 
+/*
+ * MIT-SHM images live in a client supplied segment, so rather than
+ * copying the image into a temporary pixmap, map the segment for the
+ * GPU and blit directly from it.  The client may reuse the segment
+ * once it sees a response, so the blit is submitted immediately, and
+ * the flush callback waits for it to complete before any response is
+ * delivered.
+ */
+Bool etnaviv_accel_ShmPutImage(DrawablePtr pDrawable, GCPtr pGC, int depth,
+	unsigned int format, int w, int h, int sx, int sy, int sw, int sh,
+	int dx, int dy, char *data)
+{
+	struct etnaviv *etnaviv = etnaviv_get_screen_priv(pDrawable->pScreen);
+	struct etnaviv_usermem_node *unode;
+	struct etnaviv_format fmt;
+	struct etnaviv_de_op op;
+	struct etna_bo *usr;
+	unsigned int cpp, stride, xoff;
+	RegionPtr clip;
+	BoxRec box;
+	char *ptr;
+
+	if (format != ZPixmap || depth != pDrawable->depth ||
+	    pDrawable->bitsPerPixel < 8) {
+		etnaviv_stats_reason(etnaviv, FB_FORMAT);
+		return FALSE;
+	}
+
+	cpp = pDrawable->bitsPerPixel / 8;
+	stride = PixmapBytePad(w, depth);
+
+	/* Start the mapping at the first line of the sub-image */
+	ptr = data + sy * stride;
+	xoff = (uintptr_t)ptr & VIVANTE_ALIGN_MASK;
+
+	/* The 2D engine requires the source pitch to be aligned */
+	if (stride & 15 || xoff % cpp) {
+		etnaviv_stats_reason(etnaviv, FB_GEOMETRY);
+		return FALSE;
+	}
+
+	if (!etnaviv_init_dst_drawable(etnaviv, &op, pDrawable))
+		return FALSE;
+
+	box.x1 = pDrawable->x + dx;
+	box.y1 = pDrawable->y + dy;
+	box.x2 = box.x1 + sw;
+	box.y2 = box.y1 + sh;
+
+	clip = fbGetCompositeClip(pGC);
+	if (__box_intersect(&box, &box, RegionExtents(clip)))
+		return TRUE;
+
+	usr = etna_bo_from_usermem_prot(etnaviv->conn, ptr - xoff,
+					stride * sh + xoff, PROT_READ);
+	if (!usr) {
+		etnaviv_stats_reason(etnaviv, FB_MAP);
+		return FALSE;
+	}
+
+	/* The image is in the same format as the drawable, but linear */
+	fmt = op.dst.pixmap->format;
+	fmt.tile = 0;
+
+	op.src = INIT_BLIT_BO(usr, stride, fmt, ZERO_OFFSET);
+	op.src.offset.x = sx + xoff / cpp - pDrawable->x - dx - op.dst.offset.x;
+	op.src.offset.y = -pDrawable->y - dy - op.dst.offset.y;
+	op.src_origin_mode = SRC_ORIGIN_RELATIVE;
+	op.blend_op = NULL;
+	op.clip = &box;
+	op.rop = etnaviv_copy_rop[pGC->alu];
+	op.cmd = VIVS_DE_DEST_CONFIG_COMMAND_BIT_BLT;
+	op.brush = FALSE;
+
+	etnaviv_batch_start(etnaviv, &op);
+	etnaviv_blit_clipped(etnaviv, &op, RegionRects(clip),
+			     RegionNumRects(clip));
+	etnaviv_de_end(etnaviv);
+
+	unode = malloc(sizeof(*unode));
+	if (!unode) {
+		etnaviv_commit(etnaviv, TRUE, NULL);
+		etna_bo_del(etnaviv->conn, usr, NULL);
+		return TRUE;
+	}
+
+	unode->dst = op.dst.pixmap;
+	unode->bo = usr;
+	unode->mem = NULL;
+	unode->fence = etnaviv->last_fence;
+
+	etnaviv_commit(etnaviv, FALSE, &unode->fence);
+	xorg_list_append(&unode->node, &etnaviv->shm_busy_list);
+
+	return TRUE;
+}
+
+/*
+ * Read back directly into the destination buffer, which for ShmGetImage
+ * is the client's SHM segment.  This avoids the temporary pixmap and
+ * the CPU copy out of it, leaving only the wait for the blit itself.
+ */
+static Bool etnaviv_GetImage_direct(struct etnaviv *etnaviv,
+	struct etnaviv_pixmap *vPix, int bpp, int depth,
+	int x, int y, int w, int h, char *d)
+{
+	struct etnaviv_format fmt;
+	struct etnaviv_de_op op;
+	struct etna_bo *usr;
+	unsigned int cpp, stride, xoff;
+	uint32_t fence;
+	BoxRec box;
+	int ret;
+
+	cpp = bpp / 8;
+	stride = PixmapBytePad(w, depth);
+	xoff = (uintptr_t)d & VIVANTE_ALIGN_MASK;
+
+	/* The 2D engine requires the destination pitch to be aligned */
+	if (bpp < 8 || stride & 15 || xoff % cpp)
+		return FALSE;
+
+	if (!etnaviv_map_gpu(etnaviv, vPix, GPU_ACCESS_RO))
+		return FALSE;
+
+	usr = etna_bo_from_usermem_prot(etnaviv->conn, d - xoff,
+					stride * h + xoff,
+					PROT_READ | PROT_WRITE);
+	if (!usr)
+		return FALSE;
+
+	fmt = vPix->format;
+	fmt.tile = 0;
+
+	box.x1 = 0;
+	box.y1 = 0;
+	box.x2 = w;
+	box.y2 = h;
+
+	op.dst = INIT_BLIT_BO(usr, stride, fmt, ZERO_OFFSET);
+	op.dst.offset.x = xoff / cpp;
+	op.src = INIT_BLIT_PIX(vPix, vPix->format, ZERO_OFFSET);
+	op.src.offset.x = x - op.dst.offset.x;
+	op.src.offset.y = y;
+	op.src_origin_mode = SRC_ORIGIN_RELATIVE;
+	op.blend_op = NULL;
+	op.clip = &box;
+	op.rop = 0xcc;
+	op.cmd = VIVS_DE_DEST_CONFIG_COMMAND_BIT_BLT;
+	op.brush = FALSE;
+
+	etnaviv_batch_start(etnaviv, &op);
+	etnaviv_de_op(etnaviv, &op, &box, 1);
+	etnaviv_de_end(etnaviv);
+
+	/*
+	 * Only wait for the blit itself, rather than draining every
+	 * batch which has been submitted.
+	 */
+	fence = etnaviv->last_fence;
+	etnaviv_commit(etnaviv, FALSE, &fence);
+	if (!VIV_FENCE_BEFORE_EQ(fence, etnaviv->last_fence)) {
+		ret = viv_fence_finish(etnaviv->conn, fence,
+				       VIV_WAIT_INDEFINITE);
+		if (ret != VIV_STATUS_OK)
+			etnaviv_error(etnaviv, "fence finish", ret);
+
+		etnaviv_finish_fences(etnaviv, fence);
+	}
+
+	/* Make the GPU writes visible to the CPU */
+	etna_bo_cpu_prep(usr, NULL, DRM_ETNA_PREP_READ);
+	etna_bo_cpu_fini(usr);
+	etna_bo_del(etnaviv->conn, usr, NULL);
+
+	return TRUE;
+}
+
 Bool etnaviv_accel_GetImage(DrawablePtr pDrawable, int x, int y, int w, int h,
 	unsigned int format, unsigned long planeMask, char *d)
 {
 	ScreenPtr pScreen = pDrawable->pScreen;
+	struct etnaviv *etnaviv = etnaviv_get_screen_priv(pScreen);
 	struct etnaviv_pixmap *vPix;
 	PixmapPtr pPix, pTemp;
 	GCPtr gc;
@@ -511,16 +1005,25 @@ Bool etnaviv_accel_GetImage(DrawablePtr pDrawable, int x, int y, int w, int h,
 
 	pPix = drawable_pixmap_offset(pDrawable, &src_offset);
 	vPix = etnaviv_get_pixmap_priv(pPix);
-	if (!vPix || !(vPix->state & ST_GPU_R))
+	if (!vPix || !(vPix->state & ST_GPU_R)) {
+		etnaviv_stats_reason(etnaviv, FB_DRAWABLE);
 		return FALSE;
+	}
 
 	x += pDrawable->x + src_offset.x;
 	y += pDrawable->y + src_offset.y;
 
+	if (format == ZPixmap && fb_full_planemask(pDrawable, planeMask) &&
+	    etnaviv_GetImage_direct(etnaviv, vPix, pPix->drawable.bitsPerPixel,
+				    pPix->drawable.depth, x, y, w, h, d))
+		return TRUE;
+
 	pTemp = pScreen->CreatePixmap(pScreen, w, h, pPix->drawable.depth,
 				      CREATE_PIXMAP_USAGE_GPU);
-	if (!pTemp)
+	if (!pTemp) {
+		etnaviv_stats_reason(etnaviv, FB_ALLOC);
 		return FALSE;
+	}
 
 	/*
 	 * Copy to the temporary pixmap first using the GPU so that the
@@ -548,12 +1051,14 @@ void etnaviv_accel_CopyNtoN(DrawablePtr pSrc, DrawablePtr pDst,
 	Bool upsidedown, Pixel bitPlane, void *closure)
 {
 	struct etnaviv *etnaviv = etnaviv_get_screen_priv(pDst->pScreen);
+	struct etnaviv_stat_mark mark;
 	struct etnaviv_de_op op;
 	BoxRec extent, *clip;
 
 	if (!nBox)
 		return;
 
+	mark = etnaviv_stats_start(etnaviv, STAT_COPYNTON);
 	if (etnaviv->force_fallback)
 		goto fallback;
 
@@ -575,8 +1080,10 @@ void etnaviv_accel_CopyNtoN(DrawablePtr pSrc, DrawablePtr pDst,
 
 	if (pGC) {
 		clip = RegionExtents(fbGetCompositeClip(pGC));
-		if (__box_intersect(&extent, &extent, clip))
+		if (__box_intersect(&extent, &extent, clip)) {
+			etnaviv_stats_end(etnaviv, mark, TRUE);
 			return;
+		}
 	} else {
 		if (extent.x1 < 0)
 			extent.x1 = 0;
@@ -589,14 +1096,20 @@ void etnaviv_accel_CopyNtoN(DrawablePtr pSrc, DrawablePtr pDst,
 	op.rop = etnaviv_copy_rop[pGC ? pGC->alu : GXcopy];
 	op.cmd = VIVS_DE_DEST_CONFIG_COMMAND_BIT_BLT;
 	op.brush = FALSE;
+	etnaviv_init_planemask(etnaviv, &op, pGC, pDst);
 
 	etnaviv_batch_start(etnaviv, &op);
-	etnaviv_blit_clipped(etnaviv, &op, pBox, nBox);
+	if (op.src.pixmap == op.dst.pixmap)
+		etnaviv_blit_overlap(etnaviv, &op, pBox, nBox);
+	else
+		etnaviv_blit_clipped(etnaviv, &op, pBox, nBox);
 	etnaviv_de_end(etnaviv);
 
+	etnaviv_stats_end(etnaviv, mark, TRUE);
 	return;
 
  fallback:
+	etnaviv_stats_end(etnaviv, mark, FALSE);
 	unaccel_CopyNtoN(pSrc, pDst, pGC, pBox, nBox, dx, dy, reverse,
 		upsidedown, bitPlane, closure);
 }
@@ -665,328 +1178,1797 @@ Bool etnaviv_accel_PolyPoint(DrawablePtr pDrawable, GCPtr pGC, int mode,
 	return TRUE;
 }
 
-Bool etnaviv_accel_PolyLines(DrawablePtr pDrawable, GCPtr pGC, int mode,
-	int npt, DDXPointPtr ppt)
+/*
+ * Zero-width lines are drawn by the DE line engine, which omits the last
+ * pixel of each line.  Lines are never shortened to fit a clip box, as
+ * that would change the pixels chosen along the line; instead, each
+ * clip box is loaded as the hardware clip rectangle, and only the lines
+ * which may touch it are drawn.
+ */
+#define LINE_COORD_MAX	0x7fff
+
+/* Append a line in drawable coordinates, if the DE can draw it */
+static Bool etnaviv_line_append(struct etnaviv *etnaviv, xSegment **segp,
+	DrawablePtr pDrawable, xPoint offset, int x1, int y1, int x2, int y2)
+{
+	xSegment *seg;
+	int x, y;
+
+	x1 += pDrawable->x;
+	y1 += pDrawable->y;
+	x2 += pDrawable->x;
+	y2 += pDrawable->y;
+
+	/* The DE takes unsigned pixmap coordinates */
+	x = mint(x1, x2) + offset.x;
+	y = mint(y1, y2) + offset.y;
+	if (x < 0 || y < 0 ||
+	    maxt(x1, x2) + offset.x > LINE_COORD_MAX ||
+	    maxt(y1, y2) + offset.y > LINE_COORD_MAX) {
+		etnaviv_stats_reason(etnaviv, FB_GEOMETRY);
+		return FALSE;
+	}
+
+	seg = (*segp)++;
+	seg->x1 = x1;
+	seg->y1 = y1;
+	seg->x2 = x2;
+	seg->y2 = y2;
+
+	return TRUE;
+}
+
+static Bool etnaviv_draw_lines(struct etnaviv *etnaviv, GCPtr pGC,
+	struct etnaviv_de_op *op, const xSegment *segs, int nseg)
 {
-	struct etnaviv *etnaviv = etnaviv_get_screen_priv(pDrawable->pScreen);
-	struct etnaviv_de_op op;
 	RegionPtr clip = fbGetCompositeClip(pGC);
 	const BoxRec *box;
-	int nclip, i;
 	BoxRec *boxes, *b;
-	xSegment seg;
-
-	assert(pGC->miTranslate);
+	int nclip, i;
 
-	if (RegionNumRects(clip) == 0)
+	if (nseg == 0)
 		return TRUE;
 
-	if (!etnaviv_init_dst_drawable(etnaviv, &op, pDrawable))
+	boxes = malloc(sizeof(BoxRec) * nseg);
+	if (!boxes) {
+		etnaviv_stats_reason(etnaviv, FB_ALLOC);
 		return FALSE;
+	}
 
-	etnaviv_init_fill(etnaviv, &op, pGC);
-	op.cmd = VIVS_DE_DEST_CONFIG_COMMAND_LINE;
-
-	boxes = malloc(sizeof(BoxRec) * npt);
-	if (!boxes)
-		return FALSE;
+	etnaviv_init_fill(etnaviv, op, pGC);
+	op->cmd = VIVS_DE_DEST_CONFIG_COMMAND_LINE;
 
 	nclip = RegionNumRects(clip);
 	for (box = RegionRects(clip); nclip; nclip--, box++) {
-		seg.x1 = ppt[0].x;
-		seg.y1 = ppt[0].y;
-
-		for (b = boxes, i = 1; i < npt; i++) {
-			seg.x2 = ppt[i].x;
-			seg.y2 = ppt[i].y;
+		for (b = boxes, i = 0; i < nseg; i++) {
+			if (!box_intersect_line(box, &segs[i]))
+				continue;
+
+			b->x1 = segs[i].x1;
+			b->y1 = segs[i].y1;
+			b->x2 = segs[i].x2;
+			b->y2 = segs[i].y2;
+			b++;
+		}
+
+		if (b != boxes) {
+			op->clip = box;
+			etnaviv_batch_start(etnaviv, op);
+			etnaviv_de_op(etnaviv, op, boxes, b - boxes);
+			etnaviv_de_end(etnaviv);
+		}
+	}
+
+	free(boxes);
+
+	return TRUE;
+}
+
+Bool etnaviv_accel_PolyLines(DrawablePtr pDrawable, GCPtr pGC, int mode,
+	int npt, DDXPointPtr ppt)
+{
+	struct etnaviv *etnaviv = etnaviv_get_screen_priv(pDrawable->pScreen);
+	struct etnaviv_de_op op;
+	xSegment *segs, *seg;
+	int i, x1, y1, x2, y2;
+	Bool ret = FALSE;
+
+	assert(pGC->miTranslate);
+
+	if (RegionNumRects(fbGetCompositeClip(pGC)) == 0)
+		return TRUE;
+
+	if (npt < 2) {
+		etnaviv_stats_reason(etnaviv, FB_GEOMETRY);
+		return FALSE;
+	}
+
+	if (!etnaviv_init_dst_drawable(etnaviv, &op, pDrawable))
+		return FALSE;
+
+	/* One line for each pair of points, and one for the cap */
+	segs = malloc(sizeof(xSegment) * npt);
+	if (!segs) {
+		etnaviv_stats_reason(etnaviv, FB_ALLOC);
+		return FALSE;
+	}
+
+	seg = segs;
+	x2 = ppt[0].x;
+	y2 = ppt[0].y;
+	for (i = 1; i < npt; i++) {
+		x1 = x2;
+		y1 = y2;
+		x2 = ppt[i].x;
+		y2 = ppt[i].y;
+
+		if (mode == CoordModePrevious) {
+			x2 += x1;
+			y2 += y1;
+		}
+
+		/* Each joint is drawn as the first pixel of the next line */
+		if (x1 == x2 && y1 == y2)
+			continue;
+
+		if (!etnaviv_line_append(etnaviv, &seg, pDrawable,
+					 op.dst.offset, x1, y1, x2, y2))
+			goto out;
+	}
+
+	/*
+	 * Draw the final point unless the cap style is CapNotLast, or
+	 * the polyline is closed and the point has already been drawn.
+	 * If every point was the same, no line has drawn it.
+	 */
+	if (pGC->capStyle != CapNotLast &&
+	    (x2 != ppt[0].x || y2 != ppt[0].y || seg == segs) &&
+	    !etnaviv_line_append(etnaviv, &seg, pDrawable, op.dst.offset,
+				 x2, y2, x2 + 1, y2))
+		goto out;
+
+	ret = etnaviv_draw_lines(etnaviv, pGC, &op, segs, seg - segs);
+
+ out:
+	free(segs);
+
+	return ret;
+}
+
+Bool etnaviv_accel_PolySegment(DrawablePtr pDrawable, GCPtr pGC, int nseg,
+	xSegment *pSeg)
+{
+	struct etnaviv *etnaviv = etnaviv_get_screen_priv(pDrawable->pScreen);
+	struct etnaviv_de_op op;
+	xSegment *segs, *seg;
+	Bool last, ret = FALSE;
+	int i;
+
+	assert(pGC->miTranslate);
+
+	if (RegionNumRects(fbGetCompositeClip(pGC)) == 0)
+		return TRUE;
+
+	if (!etnaviv_init_dst_drawable(etnaviv, &op, pDrawable))
+		return FALSE;
+
+	last = pGC->capStyle != CapNotLast;
+
+	segs = malloc(sizeof(xSegment) * nseg * (1 + last));
+	if (!segs) {
+		etnaviv_stats_reason(etnaviv, FB_ALLOC);
+		return FALSE;
+	}
+
+	for (seg = segs, i = 0; i < nseg; i++) {
+		const xSegment *s = &pSeg[i];
+
+		if ((s->x1 != s->x2 || s->y1 != s->y2) &&
+		    !etnaviv_line_append(etnaviv, &seg, pDrawable,
+					 op.dst.offset, s->x1, s->y1,
+					 s->x2, s->y2))
+			goto out;
+
+		/*
+		 * Draw a one pixel long line to light the last pixel
+		 * on the line.
+		 */
+		if (last &&
+		    !etnaviv_line_append(etnaviv, &seg, pDrawable,
+					 op.dst.offset, s->x2, s->y2,
+					 s->x2 + 1, s->y2))
+			goto out;
+	}
+
+	ret = etnaviv_draw_lines(etnaviv, pGC, &op, segs, seg - segs);
+
+ out:
+	free(segs);
+
+	return ret;
+}
+
+/*
+ * The resolve engine writes linear destinations in blocks: the start
+ * address must be 64-byte aligned, the width a multiple of 16 pixels,
+ * and the height a multiple of the 3D tile height.  Filling through it
+ * costs a pipe switch, so only boxes large enough to repay that are
+ * considered.
+ */
+#define RS_FILL_MIN_AREA	(256 * 256)
+
+static Bool etnaviv_init_rs_fill(struct etnaviv *etnaviv,
+	struct etnaviv_rs_op *rs, const struct etnaviv_de_op *op, GCPtr pGC)
+{
+	Pixel pixel;
+
+	if (!etnaviv->rs_fill || op->dst.format.tile || op->dst.pitch & 63)
+		return FALSE;
+
+	switch (pGC->alu) {
+	case GXclear:
+		pixel = 0;
+		break;
+	case GXcopy:
+		pixel = etnaviv_fg_pixel(pGC);
+		break;
+	case GXset:
+		pixel = ~0;
+		break;
+	default:
+		return FALSE;
+	}
+
+	switch (op->dst.format.format) {
+	case DE_FORMAT_A8R8G8B8:
+	case DE_FORMAT_X8R8G8B8:
+		rs->format = RS_FORMAT_A8R8G8B8;
+		rs->cpp = 4;
+		rs->fill = pixel;
+		break;
+	case DE_FORMAT_R5G6B5:
+		rs->format = RS_FORMAT_R5G6B5;
+		rs->cpp = 2;
+		rs->fill = (pixel & 0xffff) * 0x00010001;
+		break;
+	case DE_FORMAT_A1R5G5B5:
+	case DE_FORMAT_X1R5G5B5:
+		rs->format = RS_FORMAT_A1R5G5B5;
+		rs->cpp = 2;
+		rs->fill = (pixel & 0xffff) * 0x00010001;
+		break;
+	default:
+		return FALSE;
+	}
+
+	rs->dst = op->dst;
+
+	return TRUE;
+}
+
+/* Calculate the part of the box which the resolve engine can fill */
+static Bool etnaviv_rs_box(const struct etnaviv_rs_op *rs, BoxPtr rs_box,
+	const BoxRec *box)
+{
+	int xoff = rs->dst.offset.x, yoff = rs->dst.offset.y;
+
+	if ((box->x2 - box->x1) * (box->y2 - box->y1) < RS_FILL_MIN_AREA)
+		return FALSE;
+
+	rs_box->x1 = ALIGN(box->x1 + xoff, 64 / rs->cpp) - xoff;
+	rs_box->x2 = ((box->x2 + xoff) & ~(ETNAVIV_3D_WIDTH_ALIGN - 1)) - xoff;
+	rs_box->y1 = ALIGN(box->y1 + yoff, ETNAVIV_3D_HEIGHT_ALIGN) - yoff;
+	rs_box->y2 = ((box->y2 + yoff) & ~(ETNAVIV_3D_HEIGHT_ALIGN - 1)) - yoff;
+
+	return rs_box->x1 < rs_box->x2 && rs_box->y1 < rs_box->y2;
+}
+
+/* Add the parts of the box outside rs_box, returning the new count */
+static int etnaviv_rs_edges(BoxPtr boxes, const BoxRec *box,
+	const BoxRec *rs_box)
+{
+	BoxPtr b = boxes;
+
+	if (box->y1 < rs_box->y1)
+		*b++ = (BoxRec){ box->x1, box->y1, box->x2, rs_box->y1 };
+	if (box->x1 < rs_box->x1)
+		*b++ = (BoxRec){ box->x1, rs_box->y1, rs_box->x1, rs_box->y2 };
+	if (rs_box->x2 < box->x2)
+		*b++ = (BoxRec){ rs_box->x2, rs_box->y1, box->x2, rs_box->y2 };
+	if (rs_box->y2 < box->y2)
+		*b++ = (BoxRec){ box->x1, rs_box->y2, box->x2, box->y2 };
+
+	return b - boxes;
+}
+
+/*
+ * Fill the rectangles, clipped to the GC composite clip, using a brush
+ * based operation.  Each rectangle is only intersected with the clip
+ * boxes in the bands it overlaps.  If rs is non-NULL, the aligned
+ * interior of large boxes is handed to the resolve engine once the
+ * queued 2D work has been submitted, and the edges are drawn by the
+ * 2D engine.  This relies on the fill being independent of the order in
+ * which the pixels are written, which etnaviv_init_rs_fill() ensures.
+ */
+static void __etnaviv_fill_rects(struct etnaviv *etnaviv,
+	struct etnaviv_de_op *op, const struct etnaviv_rs_op *rs,
+	DrawablePtr pDrawable, const struct box_bands *bands, int n,
+	xRectangle *prect)
+{
+	const struct box_band *band, *band_end = box_bands_end(bands);
+	BoxRec boxes[VIVANTE_MAX_2D_RECTS], rs_boxes[MAX_RELOC_SIZE];
+	const BoxRec *box;
+	int nb, nrs, chunk;
+
+	prefetch(prect);
+	prefetch(prect + 4);
+
+	op->cmd = VIVS_DE_DEST_CONFIG_COMMAND_BIT_BLT;
+
+	etnaviv_batch_start(etnaviv, op);
+
+	/* Leave room for the edges of a box filled by the resolve engine */
+	chunk = rs ? VIVANTE_MAX_2D_RECTS - 4 : VIVANTE_MAX_2D_RECTS;
+	nb = nrs = 0;
+	while (n--) {
+		BoxRec full_rect;
+
+		prefetch (prect + 8);
+
+		full_rect.x1 = prect->x + pDrawable->x;
+		full_rect.y1 = prect->y + pDrawable->y;
+		full_rect.x2 = full_rect.x1 + prect->width;
+		full_rect.y2 = full_rect.y1 + prect->height;
+
+		prect++;
+
+		for (band = box_bands_find(bands, full_rect.y1);
+		     band < band_end && band->y1 < full_rect.y2; band++) {
+			const BoxRec *end = bands->boxes + band->end;
+
+			for (box = box_band_find(bands, band, full_rect.x1);
+			     box < end && box->x1 < full_rect.x2; box++) {
+				if (__box_intersect(&boxes[nb], &full_rect, box))
+					continue;
+
+				if (rs && etnaviv_rs_box(rs, &rs_boxes[nrs],
+							 &boxes[nb])) {
+					BoxRec b = boxes[nb];
+
+					nb += etnaviv_rs_edges(&boxes[nb], &b,
+							       &rs_boxes[nrs]);
+
+					if (++nrs >= MAX_RELOC_SIZE) {
+						if (nb)
+							etnaviv_de_op(etnaviv,
+								op, boxes, nb);
+						etnaviv_de_end(etnaviv);
+						etnaviv_rs_clear(etnaviv, rs,
+								 rs_boxes, nrs);
+						etnaviv_batch_start(etnaviv,
+								    op);
+						nb = nrs = 0;
+					}
+				} else {
+					nb++;
+				}
+
+				if (nb >= chunk) {
+					etnaviv_de_op(etnaviv, op, boxes, nb);
+					nb = 0;
+				}
+			}
+		}
+	}
+	if (nb)
+		etnaviv_de_op(etnaviv, op, boxes, nb);
+	etnaviv_de_end(etnaviv);
+
+	if (nrs)
+		etnaviv_rs_clear(etnaviv, rs, rs_boxes, nrs);
+}
+
+static void etnaviv_fill_rects(struct etnaviv *etnaviv,
+	struct etnaviv_de_op *op, DrawablePtr pDrawable,
+	const struct box_bands *bands, int n, xRectangle *prect)
+{
+	__etnaviv_fill_rects(etnaviv, op, NULL, pDrawable, bands, n, prect);
+}
+
+Bool etnaviv_accel_PolyFillRectSolid(DrawablePtr pDrawable, GCPtr pGC, int n,
+	xRectangle * prect)
+{
+	struct etnaviv *etnaviv = etnaviv_get_screen_priv(pDrawable->pScreen);
+	struct etnaviv_de_op op;
+	struct etnaviv_rs_op rs;
+	RegionPtr clip = fbGetCompositeClip(pGC);
+	const struct box_bands *bands;
+
+	if (RegionNumRects(clip) == 0)
+		return TRUE;
+
+	bands = etnaviv_clip_bands(etnaviv, pGC);
+	if (!bands)
+		return FALSE;
+
+	if (!etnaviv_init_dst_drawable(etnaviv, &op, pDrawable))
+		return FALSE;
+
+	etnaviv_init_fill(etnaviv, &op, pGC);
+	op.clip = RegionExtents(clip);
+
+	if (etnaviv_init_rs_fill(etnaviv, &rs, &op, pGC))
+		__etnaviv_fill_rects(etnaviv, &op, &rs, pDrawable, bands,
+				     n, prect);
+	else
+		etnaviv_fill_rects(etnaviv, &op, pDrawable, bands, n, prect);
+
+	return TRUE;
+}
+
+/*
+ * Solid fills through a partial planemask combine the destination with
+ * the and and xor values computed by fb, in two passes.  A pixel must
+ * not see the xor pass twice, so when both passes are needed, each
+ * rectangle is completed before the next is started.
+ */
+Bool etnaviv_accel_PolyFillRectPlanemask(DrawablePtr pDrawable, GCPtr pGC,
+	int n, xRectangle * prect)
+{
+	struct etnaviv *etnaviv = etnaviv_get_screen_priv(pDrawable->pScreen);
+	FbGCPrivPtr pPriv = fbGetGCPrivate(pGC);
+	FbBits mask = FbFullMask(pDrawable->depth);
+	RegionPtr clip = fbGetCompositeClip(pGC);
+	const struct box_bands *bands;
+	struct etnaviv_de_op and_op, xor_op;
+	Bool and, xor;
+
+	if (RegionNumRects(clip) == 0)
+		return TRUE;
+
+	bands = etnaviv_clip_bands(etnaviv, pGC);
+	if (!bands)
+		return FALSE;
+
+	if (!etnaviv_init_dst_drawable(etnaviv, &and_op, pDrawable))
+		return FALSE;
+
+	and_op.src = INIT_BLIT_NULL;
+	and_op.blend_op = NULL;
+	and_op.clip = RegionExtents(clip);
+	and_op.src_origin_mode = SRC_ORIGIN_NONE;
+	and_op.brush = BRUSH_SOLID;
+	xor_op = and_op;
+
+	/* Bits outside the depth, such as alpha, are preserved */
+	and_op.rop = 0xa0;	/* ROP_DST_AND_BRUSH */
+	and_op.fg_colour = etnaviv_pixel_col(etnaviv, pGC,
+					     pPriv->and | ~mask);
+	xor_op.rop = 0x5a;	/* ROP_DST_XOR_BRUSH */
+	xor_op.fg_colour = etnaviv_pixel_col(etnaviv, pGC,
+					     pPriv->xor & mask);
+
+	and = (pPriv->and & mask) != mask;
+	xor = (pPriv->xor & mask) != 0;
+
+	if (and && xor) {
+		for (; n; n--, prect++) {
+			etnaviv_fill_rects(etnaviv, &and_op, pDrawable,
+					   bands, 1, prect);
+			etnaviv_fill_rects(etnaviv, &xor_op, pDrawable,
+					   bands, 1, prect);
+		}
+	} else if (and) {
+		etnaviv_fill_rects(etnaviv, &and_op, pDrawable, bands,
+				   n, prect);
+	} else if (xor) {
+		etnaviv_fill_rects(etnaviv, &xor_op, pDrawable, bands,
+				   n, prect);
+	}
+
+	return TRUE;
+}
+
+/*
+ * Blit the op's source, a tile of tile_w x tile_h pixels, repeatedly
+ * across the box.  The tile is aligned to tile_off_x, tile_off_y.
+ */
+static void etnaviv_tile_box(struct etnaviv *etnaviv,
+	const struct etnaviv_de_op *op, const BoxRec *pBox,
+	int tile_w, int tile_h, int tile_off_x, int tile_off_y)
+{
+	xPoint tile_origin;
+	int dst_y, height, tile_y;
+
+	dst_y = pBox->y1;
+	height = pBox->y2 - dst_y;
+	modulus(dst_y - tile_off_y, tile_h, tile_y);
+
+	tile_origin.y = tile_y;
+
+	while (height > 0) {
+		int dst_x, width, tile_x, h;
+
+		dst_x = pBox->x1;
+		width = pBox->x2 - dst_x;
+		modulus(dst_x - tile_off_x, tile_w, tile_x);
+
+		tile_origin.x = tile_x;
+
+		h = tile_h - tile_origin.y;
+		if (h > height)
+			h = height;
+		height -= h;
+
+		while (width > 0) {
+			BoxRec dst;
+			int w;
+
+			w = tile_w - tile_origin.x;
+			if (w > width)
+				w = width;
+			width -= w;
+
+			dst.x1 = dst_x;
+			dst.x2 = dst_x + w;
+			dst.y1 = dst_y;
+			dst.y2 = dst_y + h;
+			etnaviv_de_op_src_origin(etnaviv, op, tile_origin,
+						 &dst);
+
+			dst_x += w;
+			tile_origin.x = 0;
+		}
+		dst_y += h;
+		tile_origin.y = 0;
+	}
+}
+
+/*
+ * Fill the rectangles by repeating the op's source, which is a tile of
+ * tile_w x tile_h pixels aligned to the GC pattern origin.
+ */
+static void etnaviv_fill_rects_tiled(struct etnaviv *etnaviv,
+	struct etnaviv_de_op *op, DrawablePtr pDrawable, GCPtr pGC,
+	int n, xRectangle *prect, int tile_w, int tile_h)
+{
+	RegionPtr rects;
+	int nbox;
+
+	/* Convert the rectangles to a region */
+	rects = RegionFromRects(n, prect, CT_UNSORTED);
+
+	/* Translate them for the drawable position */
+	RegionTranslate(rects, pDrawable->x, pDrawable->y);
+
+	/* Intersect them with the clipping region */
+	RegionIntersect(rects, rects, fbGetCompositeClip(pGC));
+
+	nbox = RegionNumRects(rects);
+	if (nbox) {
+		int tile_off_x, tile_off_y;
+		BoxPtr pBox;
+
+		/* Calculate the tile offset from the rect coords */
+		tile_off_x = pDrawable->x + pGC->patOrg.x;
+		tile_off_y = pDrawable->y + pGC->patOrg.y;
+
+		pBox = RegionRects(rects);
+		while (nbox--) {
+			op->clip = pBox;
+
+			etnaviv_batch_start(etnaviv, op);
+			etnaviv_tile_box(etnaviv, op, pBox, tile_w, tile_h,
+					 tile_off_x, tile_off_y);
+			etnaviv_de_end(etnaviv);
+
+			pBox++;
+		}
+	}
+
+	RegionUninit(rects);
+	RegionDestroy(rects);
+}
+
+static Pixel etnaviv_pixmap_pixel(PixmapPtr pPix, int x, int y)
+{
+	const uint8_t *row = pPix->devPrivate.ptr;
+
+	row += y * pPix->devKind;
+
+	switch (pPix->drawable.bitsPerPixel) {
+	case 32:
+		return ((const uint32_t *)row)[x];
+	case 16:
+		return ((const uint16_t *)row)[x];
+	default:
+		return row[x];
+	}
+}
+
+/*
+ * A tile which repeats within 8x8 and contains no more than two
+ * colours can be drawn as a monochrome brush.  The pattern is built
+ * with the tile origin at the top left.
+ */
+static Bool etnaviv_tile_pattern(PixmapPtr pTile, struct etnaviv_tile *t)
+{
+	int tw = pTile->drawable.width;
+	int th = pTile->drawable.height;
+	Bool have_bg = FALSE;
+	int x, y;
+
+	if (8 % tw || 8 % th)
+		return FALSE;
+
+	prepare_cpu_drawable(&pTile->drawable, CPU_ACCESS_RO);
+
+	t->fg = t->bg = etnaviv_pixmap_pixel(pTile, 0, 0);
+	t->pattern = 0;
+
+	for (y = 0; y < 8; y++) {
+		for (x = 0; x < 8; x++) {
+			Pixel p = etnaviv_pixmap_pixel(pTile, x % tw, y % th);
+
+			if (p == t->fg) {
+				t->pattern |= 1ULL << (y * 8 + 7 - x);
+			} else if (!have_bg) {
+				t->bg = p;
+				have_bg = TRUE;
+			} else if (p != t->bg) {
+				finish_cpu_drawable(&pTile->drawable,
+						    CPU_ACCESS_RO);
+				return FALSE;
+			}
+		}
+	}
+
+	finish_cpu_drawable(&pTile->drawable, CPU_ACCESS_RO);
+
+	return TRUE;
+}
+
+/* Rotate an 8x8 brush pattern right by dx, and down by dy */
+static uint64_t etnaviv_pattern_rotate(uint64_t pattern, int dx, int dy)
+{
+	uint64_t out = 0;
+	int y;
+
+	dx &= 7;
+	dy &= 7;
+
+	for (y = 0; y < 8; y++) {
+		uint8_t row = pattern >> (((y - dy) & 7) * 8);
+
+		/* The most significant bit is the leftmost pixel */
+		row = row >> dx | row << (8 - dx);
+		out |= (uint64_t)row << (y * 8);
+	}
+
+	return out;
+}
+
+/*
+ * Replicate a small tile into a GPU pixmap of at least TILE_CACHE_SIZE
+ * square, so that fills need few blits.  The tile is first repeated
+ * across a strip, which is then repeated down the expanded pixmap.
+ */
+#define TILE_CACHE_SIZE	256
+
+static PixmapPtr etnaviv_tile_expand(struct etnaviv *etnaviv, PixmapPtr pTile)
+{
+	ScreenPtr pScreen = pTile->drawable.pScreen;
+	struct etnaviv_pixmap *vTile = etnaviv_get_pixmap_priv(pTile);
+	struct etnaviv_pixmap *vStrip, *vPix;
+	int tw = pTile->drawable.width;
+	int th = pTile->drawable.height;
+	int depth = pTile->drawable.depth;
+	PixmapPtr pStrip, pPix;
+	struct etnaviv_de_op op;
+	BoxRec box;
+	int w, h;
+
+	w = tw * ((TILE_CACHE_SIZE + tw - 1) / tw);
+	h = th * ((TILE_CACHE_SIZE + th - 1) / th);
+
+	pStrip = pScreen->CreatePixmap(pScreen, w, th, depth,
+				       CREATE_PIXMAP_USAGE_GPU);
+	if (!pStrip)
+		return NULL;
+
+	pPix = pScreen->CreatePixmap(pScreen, w, h, depth,
+				     CREATE_PIXMAP_USAGE_GPU);
+	if (!pPix) {
+		pScreen->DestroyPixmap(pStrip);
+		return NULL;
+	}
+
+	vStrip = etnaviv_get_pixmap_priv(pStrip);
+	vPix = etnaviv_get_pixmap_priv(pPix);
+	if (!vStrip || !vPix ||
+	    !etnaviv_dst_format_valid(etnaviv, vPix->format) ||
+	    !etnaviv_map_gpu(etnaviv, vTile, GPU_ACCESS_RO) ||
+	    !etnaviv_map_gpu(etnaviv, vStrip, GPU_ACCESS_RW) ||
+	    !etnaviv_map_gpu(etnaviv, vPix, GPU_ACCESS_RW)) {
+		pScreen->DestroyPixmap(pStrip);
+		pScreen->DestroyPixmap(pPix);
+		return NULL;
+	}
+
+	op.blend_op = NULL;
+	op.src_origin_mode = SRC_ORIGIN_NONE;
+	op.rop = 0xcc;
+	op.cmd = VIVS_DE_DEST_CONFIG_COMMAND_BIT_BLT;
+	op.brush = FALSE;
+	op.clip = &box;
+
+	box.x1 = 0;
+	box.y1 = 0;
+	box.x2 = w;
+	box.y2 = th;
+
+	op.src = INIT_BLIT_PIX(vTile, vTile->format, ZERO_OFFSET);
+	op.dst = INIT_BLIT_PIX(vStrip, vStrip->format, ZERO_OFFSET);
+	etnaviv_batch_start(etnaviv, &op);
+	etnaviv_tile_box(etnaviv, &op, &box, tw, th, 0, 0);
+	etnaviv_de_end(etnaviv);
+
+	box.y2 = h;
+
+	op.src = INIT_BLIT_PIX(vStrip, vStrip->format, ZERO_OFFSET);
+	op.dst = INIT_BLIT_PIX(vPix, vPix->format, ZERO_OFFSET);
+	etnaviv_batch_start(etnaviv, &op);
+	etnaviv_tile_box(etnaviv, &op, &box, w, th, 0, 0);
+	etnaviv_de_end(etnaviv);
+
+	/* The strip is released once the GPU has finished with it */
+	pScreen->DestroyPixmap(pStrip);
+
+	return pPix;
+}
+
+static void etnaviv_tile_release(ScreenPtr pScreen, struct etnaviv_tile *t)
+{
+	if (t->pixmap)
+		pScreen->DestroyPixmap(t->pixmap);
+	memset(t, 0, sizeof(*t));
+}
+
+/*
+ * Find the cached form of a tile, creating it if the tile has not been
+ * seen, or its contents have changed.  Entries are dropped when their
+ * tile is destroyed, otherwise the least recently used is replaced.
+ */
+static const struct etnaviv_tile *etnaviv_tile_lookup(
+	struct etnaviv *etnaviv, PixmapPtr pTile)
+{
+	struct etnaviv_pixmap *vTile = etnaviv_get_pixmap_priv(pTile);
+	struct etnaviv_tile *t, *victim = NULL;
+	unsigned i;
+
+	for (i = 0; i < ETNAVIV_TILE_CACHE; i++) {
+		t = &etnaviv->tile_cache[i];
+		if (t->tile == pTile &&
+		    t->serial == pTile->drawable.serialNumber &&
+		    t->generation == vTile->generation) {
+			t->lru = ++etnaviv->tile_cache_lru;
+			return t;
+		}
+
+		/* Prefer an empty slot, otherwise the least recently used */
+		if (!victim || (victim->tile &&
+				(!t->tile || t->lru < victim->lru)))
+			victim = t;
+	}
+
+	t = victim;
+	etnaviv_tile_release(pTile->drawable.pScreen, t);
+
+	t->tile = pTile;
+	t->serial = pTile->drawable.serialNumber;
+	t->generation = vTile->generation;
+	t->mono = etnaviv_tile_pattern(pTile, t);
+
+	if (!t->mono && (pTile->drawable.width < TILE_CACHE_SIZE ||
+			 pTile->drawable.height < TILE_CACHE_SIZE))
+		t->pixmap = etnaviv_tile_expand(etnaviv, pTile);
+
+	t->lru = ++etnaviv->tile_cache_lru;
+
+	return t;
+}
+
+/* Drop the cached forms of a tile which is being destroyed */
+void etnaviv_tile_cache_forget(ScreenPtr pScreen, PixmapPtr pTile)
+{
+	struct etnaviv *etnaviv = etnaviv_get_screen_priv(pScreen);
+	unsigned i;
+
+	for (i = 0; i < ETNAVIV_TILE_CACHE; i++)
+		if (etnaviv->tile_cache[i].tile == pTile)
+			etnaviv_tile_release(pScreen, &etnaviv->tile_cache[i]);
+}
+
+void etnaviv_tile_cache_free(ScreenPtr pScreen)
+{
+	struct etnaviv *etnaviv = etnaviv_get_screen_priv(pScreen);
+	unsigned i;
+
+	for (i = 0; i < ETNAVIV_TILE_CACHE; i++)
+		etnaviv_tile_release(pScreen, &etnaviv->tile_cache[i]);
+}
+
+Bool etnaviv_accel_PolyFillRectTiled(DrawablePtr pDrawable, GCPtr pGC, int n,
+	xRectangle * prect)
+{
+	struct etnaviv *etnaviv = etnaviv_get_screen_priv(pDrawable->pScreen);
+	struct etnaviv_de_op op;
+	PixmapPtr pTile = pGC->tile.pixmap;
+	struct etnaviv_pixmap *vTile = etnaviv_get_pixmap_priv(pTile);
+	const struct etnaviv_tile *t = NULL;
+
+	if (!etnaviv_init_dst_drawable(etnaviv, &op, pDrawable))
+		return FALSE;
+
+	/* The contents of imported buffers may change behind our back */
+	if (vTile && !(vTile->state & ST_DMABUF))
+		t = etnaviv_tile_lookup(etnaviv, pTile);
+
+	if (t && t->mono) {
+		RegionPtr clip = fbGetCompositeClip(pGC);
+		const struct box_bands *bands;
+
+		if (RegionNumRects(clip) == 0)
+			return TRUE;
+
+		bands = etnaviv_clip_bands(etnaviv, pGC);
+		if (!bands)
+			return FALSE;
+
+		op.src = INIT_BLIT_NULL;
+		op.blend_op = NULL;
+		op.src_origin_mode = SRC_ORIGIN_NONE;
+		op.rop = etnaviv_fill_rop[pGC->alu];
+		op.brush = BRUSH_MONO;
+		op.fg_colour = etnaviv_pixel_col(etnaviv, pGC, t->fg);
+		op.bg_colour = etnaviv_pixel_col(etnaviv, pGC, t->bg);
+		op.pattern = etnaviv_pattern_rotate(t->pattern,
+				op.dst.offset.x + pDrawable->x + pGC->patOrg.x,
+				op.dst.offset.y + pDrawable->y + pGC->patOrg.y);
+		op.clip = RegionExtents(clip);
+
+		etnaviv_fill_rects(etnaviv, &op, pDrawable, bands, n, prect);
+
+		return TRUE;
+	}
+
+	if (t && t->pixmap)
+		pTile = t->pixmap;
+
+	if (!etnaviv_init_src_pixmap(etnaviv, &op, pTile))
+		return FALSE;
+
+	op.blend_op = NULL;
+	op.src_origin_mode = SRC_ORIGIN_NONE;
+	op.rop = etnaviv_copy_rop[pGC ? pGC->alu : GXcopy];
+	op.cmd = VIVS_DE_DEST_CONFIG_COMMAND_BIT_BLT;
+	op.brush = FALSE;
+
+	etnaviv_fill_rects_tiled(etnaviv, &op, pDrawable, pGC, n, prect,
+				 pTile->drawable.width,
+				 pTile->drawable.height);
+
+	return TRUE;
+}
+
+static inline Bool etnaviv_stipple_bit(const uint8_t *row, int x)
+{
+#if BITMAP_BIT_ORDER == MSBFirst
+	return !!(row[x >> 3] & (0x80 >> (x & 7)));
+#else
+	return !!(row[x >> 3] & (1 << (x & 7)));
+#endif
+}
+
+/*
+ * Build the 8x8 brush mask for a stipple whose dimensions divide eight.
+ * The brush is aligned to the destination pixmap, so rotate the stipple
+ * by the pattern origin in pixmap coordinates.  See the mask layout in
+ * the ROP description above.
+ */
+static uint64_t etnaviv_stipple_pattern(PixmapPtr pStip, int off_x, int off_y)
+{
+	const uint8_t *bits = pStip->devPrivate.ptr;
+	int sw = pStip->drawable.width;
+	int sh = pStip->drawable.height;
+	uint64_t pattern = 0;
+	int x, y, sx, sy;
+
+	for (y = 0; y < 8; y++) {
+		modulus(y - off_y, sh, sy);
+		for (x = 0; x < 8; x++) {
+			modulus(x - off_x, sw, sx);
+			if (etnaviv_stipple_bit(bits + sy * pStip->devKind, sx))
+				pattern |= 1ULL << (y * 8 + 7 - x);
+		}
+	}
+
+	return pattern;
+}
+
+/*
+ * Expand a stipple into a GPU pixmap holding a monochrome bitmap, most
+ * significant bit leftmost.  Small stipples are replicated so that each
+ * blit covers a reasonable area.
+ */
+#define STIPPLE_MIN_SIZE	64
+
+static PixmapPtr etnaviv_stipple_source(ScreenPtr pScreen, PixmapPtr pStip,
+	int *tile_w, int *tile_h)
+{
+	int sw = pStip->drawable.width;
+	int sh = pStip->drawable.height;
+	int tw, th, x, y;
+	const uint8_t *bits;
+	uint8_t *dst;
+	PixmapPtr pPix;
+
+	tw = sw < STIPPLE_MIN_SIZE ? sw * (STIPPLE_MIN_SIZE / sw) : sw;
+	th = sh < STIPPLE_MIN_SIZE ? sh * (STIPPLE_MIN_SIZE / sh) : sh;
+
+	pPix = pScreen->CreatePixmap(pScreen, (tw + 7) / 8, th, 8,
+				     CREATE_PIXMAP_USAGE_GPU);
+	if (!pPix)
+		return NULL;
+
+	prepare_cpu_drawable(&pStip->drawable, CPU_ACCESS_RO);
+	prepare_cpu_drawable(&pPix->drawable, CPU_ACCESS_RW);
+
+	bits = pStip->devPrivate.ptr;
+	dst = pPix->devPrivate.ptr;
+
+	for (y = 0; y < th; y++, dst += pPix->devKind) {
+		const uint8_t *row = bits + (y % sh) * pStip->devKind;
+
+		memset(dst, 0, pPix->devKind);
+		for (x = 0; x < tw; x++)
+			if (etnaviv_stipple_bit(row, x % sw))
+				dst[x >> 3] |= 0x80 >> (x & 7);
+	}
+
+	finish_cpu_drawable(&pPix->drawable, CPU_ACCESS_RW);
+	finish_cpu_drawable(&pStip->drawable, CPU_ACCESS_RO);
+
+	*tile_w = tw;
+	*tile_h = th;
+
+	return pPix;
+}
+
+static void etnaviv_stipple_release(ScreenPtr pScreen,
+	struct etnaviv_stipple *s)
+{
+	if (s->pixmap)
+		pScreen->DestroyPixmap(s->pixmap);
+	free(s->bits);
+	memset(s, 0, sizeof(*s));
+}
+
+/*
+ * Find the expanded form of a stipple, creating it if the stipple has
+ * not been seen, or its contents have changed.  Stipples are bitmaps
+ * without a GPU backing, so their contents are compared against the
+ * copy taken when they were expanded.
+ */
+static const struct etnaviv_stipple *etnaviv_stipple_lookup(
+	struct etnaviv *etnaviv, PixmapPtr pStip)
+{
+	ScreenPtr pScreen = pStip->drawable.pScreen;
+	size_t size = pStip->devKind * pStip->drawable.height;
+	struct etnaviv_stipple *s;
+	unsigned i;
+
+	prepare_cpu_drawable(&pStip->drawable, CPU_ACCESS_RO);
+	for (i = 0; i < ETNAVIV_STIPPLE_CACHE; i++) {
+		s = &etnaviv->stipple_cache[i];
+		if (s->stipple == pStip &&
+		    s->serial == pStip->drawable.serialNumber &&
+		    s->size == size &&
+		    memcmp(s->bits, pStip->devPrivate.ptr, size) == 0) {
+			finish_cpu_drawable(&pStip->drawable, CPU_ACCESS_RO);
+			return s;
+		}
+	}
+
+	i = etnaviv->stipple_cache_next;
+	etnaviv->stipple_cache_next = (i + 1) % ETNAVIV_STIPPLE_CACHE;
+
+	s = &etnaviv->stipple_cache[i];
+	etnaviv_stipple_release(pScreen, s);
+
+	s->bits = malloc(size);
+	if (s->bits)
+		memcpy(s->bits, pStip->devPrivate.ptr, size);
+	finish_cpu_drawable(&pStip->drawable, CPU_ACCESS_RO);
+	if (!s->bits)
+		return NULL;
+
+	s->pixmap = etnaviv_stipple_source(pScreen, pStip, &s->tile_w,
+					   &s->tile_h);
+	if (!s->pixmap) {
+		etnaviv_stipple_release(pScreen, s);
+		return NULL;
+	}
+
+	s->stipple = pStip;
+	s->serial = pStip->drawable.serialNumber;
+	s->size = size;
+
+	return s;
+}
+
+void etnaviv_stipple_cache_free(ScreenPtr pScreen)
+{
+	struct etnaviv *etnaviv = etnaviv_get_screen_priv(pScreen);
+	unsigned i;
+
+	for (i = 0; i < ETNAVIV_STIPPLE_CACHE; i++)
+		etnaviv_stipple_release(pScreen, &etnaviv->stipple_cache[i]);
+}
+
+Bool etnaviv_accel_PolyFillRectStippled(DrawablePtr pDrawable, GCPtr pGC,
+	int n, xRectangle * prect)
+{
+	struct etnaviv *etnaviv = etnaviv_get_screen_priv(pDrawable->pScreen);
+	RegionPtr clip = fbGetCompositeClip(pGC);
+	PixmapPtr pStip = pGC->stipple;
+	const struct etnaviv_stipple *s;
+	struct etnaviv_pixmap *vPix;
+	struct etnaviv_de_op op;
+
+	if (RegionNumRects(clip) == 0)
+		return TRUE;
+
+	if (!etnaviv_init_dst_drawable(etnaviv, &op, pDrawable))
+		return FALSE;
+
+	op.blend_op = NULL;
+	op.src_origin_mode = SRC_ORIGIN_NONE;
+	op.fg_colour = etnaviv_pixel_col(etnaviv, pGC, pGC->fgPixel);
+	op.bg_colour = etnaviv_pixel_col(etnaviv, pGC, pGC->bgPixel);
+
+	/*
+	 * Opaque stipples which repeat within 8x8 fit in the brush, which
+	 * avoids splitting the rectangles at each stipple boundary.  The
+	 * brush mask only selects the brush colour; the background ROP is
+	 * selected by a monochrome source, so transparent stipples always
+	 * use a monochrome source below.
+	 */
+	if (pGC->fillStyle == FillOpaqueStippled &&
+	    8 % pStip->drawable.width == 0 &&
+	    8 % pStip->drawable.height == 0) {
+		const struct box_bands *bands = etnaviv_clip_bands(etnaviv,
+								   pGC);
+
+		if (!bands)
+			return FALSE;
+
+		prepare_cpu_drawable(&pStip->drawable, CPU_ACCESS_RO);
+		op.pattern = etnaviv_stipple_pattern(pStip,
+				op.dst.offset.x + pDrawable->x + pGC->patOrg.x,
+				op.dst.offset.y + pDrawable->y + pGC->patOrg.y);
+		finish_cpu_drawable(&pStip->drawable, CPU_ACCESS_RO);
+
+		op.src = INIT_BLIT_NULL;
+		op.rop = etnaviv_fill_rop[pGC->alu];
+		op.brush = BRUSH_MONO;
+		op.clip = RegionExtents(clip);
+
+		etnaviv_fill_rects(etnaviv, &op, pDrawable, bands, n, prect);
+
+		return TRUE;
+	}
+
+	s = etnaviv_stipple_lookup(etnaviv, pStip);
+	if (!s) {
+		etnaviv_stats_reason(etnaviv, FB_ALLOC);
+		return FALSE;
+	}
 
-			if (mode == CoordModePrevious) {
-				seg.x2 += seg.x1;
-				seg.y2 += seg.y1;
-			}
+	vPix = etnaviv_get_pixmap_priv(s->pixmap);
+	if (!vPix || !etnaviv_map_gpu(etnaviv, vPix, GPU_ACCESS_RO)) {
+		etnaviv_stats_reason(etnaviv, FB_MAP);
+		return FALSE;
+	}
 
-			if (seg.x1 != seg.x2 && seg.y1 != seg.y2) {
-				free(boxes);
-				return FALSE;
-			}
+	/*
+	 * Set source bits take the foreground ROP and colour, clear bits
+	 * the background.  For a transparent stipple, the background ROP
+	 * leaves the destination untouched.
+	 */
+	op.src = INIT_BLIT_PIX(vPix, ((struct etnaviv_format){
+				.format = DE_FORMAT_MONOCHROME,
+			   }), ZERO_OFFSET);
+	op.rop = etnaviv_copy_rop[pGC->alu];
+	op.bg_rop = pGC->fillStyle == FillOpaqueStippled ? op.rop : 0xaa;
+	op.cmd = VIVS_DE_DEST_CONFIG_COMMAND_BIT_BLT;
+	op.brush = BRUSH_NONE;
 
-			/* We have to add the drawable position into the offset */
-			seg.x1 += pDrawable->x;
-			seg.x2 += pDrawable->x;
-			seg.y1 += pDrawable->y;
-			seg.y2 += pDrawable->y;
+	etnaviv_fill_rects_tiled(etnaviv, &op, pDrawable, pGC, n, prect,
+				 s->tile_w, s->tile_h);
 
-			if (!box_intersect_line_rough(box, &seg))
-				continue;
+	return TRUE;
+}
 
-			if (i == npt - 1 && pGC->capStyle != CapNotLast) {
-				if (seg.x1 < seg.x2)
-					seg.x2 += 1;
-				else if (seg.x1 > seg.x2)
-					seg.x2 -= 1;
-				if (seg.y1 < seg.y2)
-					seg.y2 += 1;
-				else if (seg.y1 > seg.y2)
-					seg.y2 -= 1;
-			}
+/*
+ * Blit the op's source to the box, clipped to the bands.  The source
+ * origin corresponds with the top left corner of the box.
+ */
+static void etnaviv_blit_bands(struct etnaviv *etnaviv,
+	const struct etnaviv_de_op *op, const struct box_bands *bands,
+	const BoxRec *pBox, xPoint origin)
+{
+	const struct box_band *band, *band_end = box_bands_end(bands);
 
-			b->x1 = seg.x1;
-			b->y1 = seg.y1;
-			b->x2 = seg.x2;
-			b->y2 = seg.y2;
-			b++;
+	for (band = box_bands_find(bands, pBox->y1);
+	     band < band_end && band->y1 < pBox->y2; band++) {
+		const BoxRec *box, *end = bands->boxes + band->end;
 
-			seg.x1 = ppt[i].x;
-			seg.y1 = ppt[i].y;
-		}
+		for (box = box_band_find(bands, band, pBox->x1);
+		     box < end && box->x1 < pBox->x2; box++) {
+			xPoint src;
+			BoxRec dst;
 
-		if (b != boxes) {
-			op.clip = box;
-			etnaviv_batch_start(etnaviv, &op);
-			etnaviv_de_op(etnaviv, &op, boxes, b - boxes);
-			etnaviv_de_end(etnaviv);
+			if (__box_intersect(&dst, pBox, box))
+				continue;
+
+			src.x = origin.x + dst.x1 - pBox->x1;
+			src.y = origin.y + dst.y1 - pBox->y1;
+			etnaviv_de_op_src_origin(etnaviv, op, src, &dst);
 		}
 	}
+}
 
-	free(boxes);
+/*
+ * Core font glyphs are cached in a monochrome atlas shared between all
+ * fonts, and drawn using monochrome source expansion.  Glyphs are keyed
+ * by their CharInfo, which is stable while the font is realized, so the
+ * atlas is emptied whenever a font is unrealized.  Glyphs are packed in
+ * shelves, each starting on a byte boundary.
+ */
+#define GLYPH_ATLAS_WIDTH	1024
+#define GLYPH_ATLAS_HEIGHT	512
 
-	return FALSE;
+static inline uint8_t etnaviv_mono_byte(uint8_t b)
+{
+#if BITMAP_BIT_ORDER == LSBFirst
+	b = (b & 0xf0) >> 4 | (b & 0x0f) << 4;
+	b = (b & 0xcc) >> 2 | (b & 0x33) << 2;
+	b = (b & 0xaa) >> 1 | (b & 0x55) << 1;
+#endif
+	return b;
 }
 
-Bool etnaviv_accel_PolySegment(DrawablePtr pDrawable, GCPtr pGC, int nseg,
-	xSegment *pSeg)
+static struct etnaviv_glyph_slot *etnaviv_glyph_slot(
+	struct etnaviv_glyph_atlas *atlas, const void *key)
 {
-	struct etnaviv *etnaviv = etnaviv_get_screen_priv(pDrawable->pScreen);
-	struct etnaviv_de_op op;
-	RegionPtr clip = fbGetCompositeClip(pGC);
-	const BoxRec *box;
-	int nclip, i;
-	BoxRec *boxes, *b;
-	bool last;
+	unsigned int i;
 
-	assert(pGC->miTranslate);
+	i = ((uint32_t)((uintptr_t)key >> 3) * 2654435761u) &
+	    (ETNAVIV_GLYPH_HASH - 1);
 
-	if (RegionNumRects(clip) == 0)
-		return TRUE;
+	while (atlas->slot[i].key && atlas->slot[i].key != key)
+		i = (i + 1) & (ETNAVIV_GLYPH_HASH - 1);
 
-	if (!etnaviv_init_dst_drawable(etnaviv, &op, pDrawable))
+	return &atlas->slot[i];
+}
+
+static Bool etnaviv_glyph_alloc(struct etnaviv_glyph_atlas *atlas,
+	int w, int h, struct etnaviv_glyph_slot *slot)
+{
+	w = (w + 7) & ~7;
+
+	/* Keep the hash table at most three quarters full */
+	if (atlas->nglyphs >= ETNAVIV_GLYPH_HASH * 3 / 4)
 		return FALSE;
 
-	etnaviv_init_fill(etnaviv, &op, pGC);
-	op.cmd = VIVS_DE_DEST_CONFIG_COMMAND_LINE;
+	if (atlas->shelf_x + w > GLYPH_ATLAS_WIDTH) {
+		atlas->shelf_x = 0;
+		atlas->shelf_y += atlas->shelf_h;
+		atlas->shelf_h = 0;
+	}
 
-	last = pGC->capStyle != CapNotLast;
+	if (atlas->shelf_y + h > GLYPH_ATLAS_HEIGHT)
+		return FALSE;
+
+	slot->x = atlas->shelf_x;
+	slot->y = atlas->shelf_y;
+	atlas->shelf_x += w;
+	if (atlas->shelf_h < h)
+		atlas->shelf_h = h;
+	atlas->nglyphs++;
+
+	return TRUE;
+}
+
+static void __etnaviv_glyph_atlas_empty(struct etnaviv_glyph_atlas *atlas)
+{
+	memset(atlas->slot, 0, sizeof(atlas->slot));
+	atlas->shelf_x = 0;
+	atlas->shelf_y = 0;
+	atlas->shelf_h = 0;
+	atlas->nglyphs = 0;
+}
+
+static void etnaviv_glyph_write(uint8_t *dst, int stride, CharInfoPtr pci)
+{
+	const uint8_t *src = (const uint8_t *)pci->bits;
+	int w = (GLYPHWIDTHPIXELS(pci) + 7) / 8;
+	int h = GLYPHHEIGHTPIXELS(pci);
+	int x, y;
+
+	for (y = 0; y < h; y++) {
+		for (x = 0; x < w; x++)
+			dst[x] = etnaviv_mono_byte(src[x]);
+		src += GLYPHWIDTHBYTESPADDED(pci);
+		dst += stride;
+	}
+}
+
+/*
+ * Upload the glyphs newly placed in the atlas.  If the GPU has
+ * finished with the atlas, they are written directly.  Otherwise,
+ * they are written to an idle staging pixmap covering the rows they
+ * occupy, and blitted into the atlas behind the work already queued,
+ * so that the CPU never waits for the GPU here.
+ */
+static Bool etnaviv_glyph_upload(struct etnaviv *etnaviv, ScreenPtr pScreen,
+	struct etnaviv_glyph_atlas *atlas, CharInfoPtr *ppci,
+	const xPoint *pos, const unsigned int *fresh, unsigned int nfresh)
+{
+	PixmapPtr pPix = atlas->pixmap, pStage;
+	int y1 = GLYPH_ATLAS_HEIGHT, y2 = 0;
+	unsigned int i;
+	BoxPtr boxes;
+
+	if (etnaviv_pixmap_idle(etnaviv, pPix)) {
+		prepare_cpu_drawable(&pPix->drawable, CPU_ACCESS_RW);
+		for (i = 0; i < nfresh; i++) {
+			const xPoint *p = &pos[fresh[i]];
+
+			etnaviv_glyph_write((uint8_t *)pPix->devPrivate.ptr +
+					    p->y * pPix->devKind + p->x / 8,
+					    pPix->devKind, ppci[fresh[i]]);
+		}
+		finish_cpu_drawable(&pPix->drawable, CPU_ACCESS_RW);
+		return TRUE;
+	}
 
-	boxes = malloc(sizeof(BoxRec) * nseg * (1 + last));
+	boxes = malloc(nfresh * sizeof(*boxes));
 	if (!boxes)
 		return FALSE;
 
-	nclip = RegionNumRects(clip);
-	for (box = RegionRects(clip); nclip; nclip--, box++) {
-		for (b = boxes, i = 0; i < nseg; i++) {
-			xSegment seg = pSeg[i];
+	for (i = 0; i < nfresh; i++) {
+		CharInfoPtr pci = ppci[fresh[i]];
+		const xPoint *p = &pos[fresh[i]];
+
+		boxes[i].x1 = p->x / 8;
+		boxes[i].y1 = p->y;
+		boxes[i].x2 = boxes[i].x1 + (GLYPHWIDTHPIXELS(pci) + 7) / 8;
+		boxes[i].y2 = boxes[i].y1 + GLYPHHEIGHTPIXELS(pci);
+		if (y1 > boxes[i].y1)
+			y1 = boxes[i].y1;
+		if (y2 < boxes[i].y2)
+			y2 = boxes[i].y2;
+	}
 
-			/* We have to add the drawable position into the offset */
-			seg.x1 += pDrawable->x;
-			seg.x2 += pDrawable->x;
-			seg.y1 += pDrawable->y;
-			seg.y2 += pDrawable->y;
+	pStage = etnaviv_mask_pool_get(pScreen, GLYPH_ATLAS_WIDTH / 8,
+				       y2 - y1);
+	if (!pStage) {
+		free(boxes);
+		return FALSE;
+	}
 
-			if (!box_intersect_line_rough(box, &seg))
-				continue;
+	prepare_cpu_drawable(&pStage->drawable, CPU_ACCESS_RW);
+	for (i = 0; i < nfresh; i++)
+		etnaviv_glyph_write((uint8_t *)pStage->devPrivate.ptr +
+				    (boxes[i].y1 - y1) * pStage->devKind +
+				    boxes[i].x1, pStage->devKind,
+				    ppci[fresh[i]]);
+	finish_cpu_drawable(&pStage->drawable, CPU_ACCESS_RW);
 
-			b->x1 = seg.x1;
-			b->y1 = seg.y1;
-			b->x2 = seg.x2;
-			b->y2 = seg.y2;
-			b++;
+	etnaviv_accel_CopyNtoN(&pStage->drawable, &pPix->drawable, NULL,
+			       boxes, nfresh, 0, -y1, FALSE, FALSE, 0, NULL);
 
-			if (last &&
-			    seg.x2 >= box->x1 && seg.x2 < box->x2 &&
-			    seg.y2 >= box->y1 && seg.y2 < box->y2) {
-				/*
-				 * Draw a one pixel long line to light the
-				 * last pixel on the line, but only if the
-				 * point is not off the edge.
-				 */
-				b->x1 = seg.x2;
-				b->y1 = seg.y2;
-				b->x2 = seg.x2 + 1;
-				b->y2 = seg.y2;
-				b++;
-			}
+	pScreen->DestroyPixmap(pStage);
+	free(boxes);
+
+	return TRUE;
+}
+
+/*
+ * Find the atlas position of each glyph, placing those which are not
+ * already cached.  Should the atlas fill, it is emptied and the lookup
+ * restarted, so that all the glyphs are present at the same time.  The
+ * newly placed glyphs are then uploaded together.
+ */
+static struct etnaviv_glyph_atlas *etnaviv_glyph_lookup(
+	struct etnaviv *etnaviv, ScreenPtr pScreen, unsigned int nglyph,
+	CharInfoPtr *ppci, xPoint *pos)
+{
+	struct etnaviv_glyph_atlas *atlas = etnaviv->glyph_atlas;
+	unsigned int i, nfresh, *fresh = NULL;
+	Bool emptied = FALSE;
+
+	if (!atlas) {
+		atlas = calloc(1, sizeof(*atlas));
+		if (!atlas)
+			goto fail_alloc;
+
+		atlas->pixmap = pScreen->CreatePixmap(pScreen,
+						      GLYPH_ATLAS_WIDTH / 8,
+						      GLYPH_ATLAS_HEIGHT, 8,
+						      CREATE_PIXMAP_USAGE_GPU);
+		if (!atlas->pixmap) {
+			free(atlas);
+			goto fail_alloc;
 		}
 
-		if (b != boxes) {
-			op.clip = box;
-			etnaviv_batch_start(etnaviv, &op);
-			etnaviv_de_op(etnaviv, &op, boxes, b - boxes);
-			etnaviv_de_end(etnaviv);
+		etnaviv->glyph_atlas = atlas;
+	}
+
+ restart:
+	nfresh = 0;
+	for (i = 0; i < nglyph; i++) {
+		CharInfoPtr pci = ppci[i];
+		int w = GLYPHWIDTHPIXELS(pci);
+		int h = GLYPHHEIGHTPIXELS(pci);
+		struct etnaviv_glyph_slot *slot;
+
+		if (w <= 0 || h <= 0)
+			continue;
+
+		if (w > GLYPH_ATLAS_WIDTH || h > GLYPH_ATLAS_HEIGHT) {
+			etnaviv_stats_reason(etnaviv, FB_GEOMETRY);
+			goto fail;
+		}
+
+		slot = etnaviv_glyph_slot(atlas, pci);
+		if (!slot->key) {
+			if (!fresh) {
+				fresh = malloc(nglyph * sizeof(*fresh));
+				if (!fresh) {
+					etnaviv_stats_reason(etnaviv, FB_ALLOC);
+					goto fail;
+				}
+			}
+
+			if (!etnaviv_glyph_alloc(atlas, w, h, slot)) {
+				if (emptied) {
+					etnaviv_stats_reason(etnaviv,
+							     FB_GEOMETRY);
+					goto fail;
+				}
+				__etnaviv_glyph_atlas_empty(atlas);
+				emptied = TRUE;
+				goto restart;
+			}
+
+			slot->key = pci;
+			fresh[nfresh++] = i;
 		}
+
+		pos[i].x = slot->x;
+		pos[i].y = slot->y;
 	}
 
-	free(boxes);
+	if (nfresh &&
+	    !etnaviv_glyph_upload(etnaviv, pScreen, atlas, ppci, pos, fresh,
+				  nfresh)) {
+		etnaviv_stats_reason(etnaviv, FB_ALLOC);
+		goto fail;
+	}
 
-	return TRUE;
+	free(fresh);
+
+	return atlas;
+
+ fail:
+	/* Forget glyphs which were placed but never uploaded */
+	if (nfresh)
+		__etnaviv_glyph_atlas_empty(atlas);
+	free(fresh);
+	return NULL;
+
+ fail_alloc:
+	etnaviv_stats_reason(etnaviv, FB_ALLOC);
+	return NULL;
 }
 
-Bool etnaviv_accel_PolyFillRectSolid(DrawablePtr pDrawable, GCPtr pGC, int n,
-	xRectangle * prect)
+void etnaviv_glyph_atlas_empty(ScreenPtr pScreen)
+{
+	struct etnaviv *etnaviv = etnaviv_get_screen_priv(pScreen);
+
+	if (etnaviv->glyph_atlas)
+		__etnaviv_glyph_atlas_empty(etnaviv->glyph_atlas);
+}
+
+void etnaviv_glyph_atlas_free(ScreenPtr pScreen)
+{
+	struct etnaviv *etnaviv = etnaviv_get_screen_priv(pScreen);
+	struct etnaviv_glyph_atlas *atlas = etnaviv->glyph_atlas;
+
+	if (atlas) {
+		pScreen->DestroyPixmap(atlas->pixmap);
+		free(atlas);
+		etnaviv->glyph_atlas = NULL;
+	}
+}
+
+/*
+ * Draw a run of glyphs starting at the screen position x, y, clipped to
+ * the GC composite clip.  All glyphs are drawn in one batched operation.
+ */
+static Bool etnaviv_glyph_blt(DrawablePtr pDrawable, GCPtr pGC,
+	int x, int y, unsigned int nglyph, CharInfoPtr *ppci,
+	uint32_t fg, uint32_t bg, uint8_t rop, uint8_t bg_rop)
 {
 	struct etnaviv *etnaviv = etnaviv_get_screen_priv(pDrawable->pScreen);
+	const struct box_bands *bands;
+	struct etnaviv_glyph_atlas *atlas;
+	struct etnaviv_pixmap *vAtlas;
 	struct etnaviv_de_op op;
-	RegionPtr clip = fbGetCompositeClip(pGC);
-	BoxRec boxes[VIVANTE_MAX_2D_RECTS], *box;
-	int nclip, nb, chunk;
+	unsigned int i;
+	xPoint *pos;
 
-	if (RegionNumRects(clip) == 0)
+	if (nglyph == 0)
 		return TRUE;
 
-	if (!etnaviv_init_dst_drawable(etnaviv, &op, pDrawable))
+	bands = etnaviv_clip_bands(etnaviv, pGC);
+	if (!bands)
 		return FALSE;
 
-	prefetch(prect);
-	prefetch(prect + 4);
+	pos = malloc(nglyph * sizeof(*pos));
+	if (!pos) {
+		etnaviv_stats_reason(etnaviv, FB_ALLOC);
+		return FALSE;
+	}
 
-	etnaviv_init_fill(etnaviv, &op, pGC);
-	op.clip = RegionExtents(clip);
-	op.cmd = VIVS_DE_DEST_CONFIG_COMMAND_BIT_BLT;
+	atlas = etnaviv_glyph_lookup(etnaviv, pDrawable->pScreen, nglyph,
+				     ppci, pos);
+	if (!atlas) {
+		free(pos);
+		return FALSE;
+	}
 
-	etnaviv_batch_start(etnaviv, &op);
+	vAtlas = etnaviv_get_pixmap_priv(atlas->pixmap);
+	if (!vAtlas || !etnaviv_map_gpu(etnaviv, vAtlas, GPU_ACCESS_RO)) {
+		free(pos);
+		etnaviv_stats_reason(etnaviv, FB_MAP);
+		return FALSE;
+	}
 
-	chunk = VIVANTE_MAX_2D_RECTS;
-	nb = 0;
-	while (n--) {
-		BoxRec full_rect;
+	if (!etnaviv_init_dst_drawable(etnaviv, &op, pDrawable)) {
+		free(pos);
+		return FALSE;
+	}
 
-		prefetch (prect + 8);
+	op.src = INIT_BLIT_PIX(vAtlas, ((struct etnaviv_format){
+				.format = DE_FORMAT_MONOCHROME,
+			   }), ZERO_OFFSET);
+	op.blend_op = NULL;
+	op.clip = RegionExtents(fbGetCompositeClip(pGC));
+	op.src_origin_mode = SRC_ORIGIN_NONE;
+	op.rop = rop;
+	op.bg_rop = bg_rop;
+	op.cmd = VIVS_DE_DEST_CONFIG_COMMAND_BIT_BLT;
+	op.brush = BRUSH_NONE;
+	op.fg_colour = fg;
+	op.bg_colour = bg;
 
-		full_rect.x1 = prect->x + pDrawable->x;
-		full_rect.y1 = prect->y + pDrawable->y;
-		full_rect.x2 = full_rect.x1 + prect->width;
-		full_rect.y2 = full_rect.y1 + prect->height;
+	x += pDrawable->x;
+	y += pDrawable->y;
 
-		prect++;
+	etnaviv_batch_start(etnaviv, &op);
 
-		for (box = RegionRects(clip), nclip = RegionNumRects(clip);
-		     nclip; nclip--, box++) {
-			if (__box_intersect(&boxes[nb], &full_rect, box))
-				continue;
+	for (i = 0; i < nglyph; x += ppci[i]->metrics.characterWidth, i++) {
+		CharInfoPtr pci = ppci[i];
+		BoxRec glyph;
 
-			if (++nb >= chunk) {
-				etnaviv_de_op(etnaviv, &op, boxes, nb);
-				nb = 0;
-			}
-		}
+		if (GLYPHWIDTHPIXELS(pci) <= 0 || GLYPHHEIGHTPIXELS(pci) <= 0)
+			continue;
+
+		glyph.x1 = x + pci->metrics.leftSideBearing;
+		glyph.y1 = y - pci->metrics.ascent;
+		glyph.x2 = x + pci->metrics.rightSideBearing;
+		glyph.y2 = y + pci->metrics.descent;
+
+		etnaviv_blit_bands(etnaviv, &op, bands, &glyph, pos[i]);
 	}
-	if (nb)
-		etnaviv_de_op(etnaviv, &op, boxes, nb);
+
 	etnaviv_de_end(etnaviv);
 
+	free(pos);
+
 	return TRUE;
 }
 
-Bool etnaviv_accel_PolyFillRectTiled(DrawablePtr pDrawable, GCPtr pGC, int n,
-	xRectangle * prect)
+Bool etnaviv_accel_ImageGlyphBlt(DrawablePtr pDrawable, GCPtr pGC,
+	int x, int y, unsigned int nglyph, CharInfoPtr *ppci)
 {
 	struct etnaviv *etnaviv = etnaviv_get_screen_priv(pDrawable->pScreen);
+	RegionPtr clip = fbGetCompositeClip(pGC);
+	FontPtr pFont = pGC->font;
+	const struct box_bands *bands;
 	struct etnaviv_de_op op;
-	PixmapPtr pTile = pGC->tile.pixmap;
-	RegionPtr rects;
-	int nbox;
+	xRectangle back;
+	uint32_t fg, bg;
+	unsigned int i;
+	int width;
 
-	if (!etnaviv_init_dst_drawable(etnaviv, &op, pDrawable) ||
-	    !etnaviv_init_src_pixmap(etnaviv, &op, pTile))
-		return FALSE;
+	if (RegionNumRects(clip) == 0)
+		return TRUE;
 
-	op.blend_op = NULL;
-	op.src_origin_mode = SRC_ORIGIN_NONE;
-	op.rop = etnaviv_copy_rop[pGC ? pGC->alu : GXcopy];
-	op.cmd = VIVS_DE_DEST_CONFIG_COMMAND_BIT_BLT;
-	op.brush = FALSE;
+	/* ImageText ignores the GC function and fill style */
+	fg = etnaviv_pixel_col(etnaviv, pGC, pGC->fgPixel);
+	bg = etnaviv_pixel_col(etnaviv, pGC, pGC->bgPixel);
 
-	/* Convert the rectangles to a region */
-	rects = RegionFromRects(n, prect, CT_UNSORTED);
+	/*
+	 * Terminal font glyphs each cover their whole character cell, so
+	 * the background can be drawn along with the glyph.
+	 */
+	if (TERMINALFONT(pFont))
+		return etnaviv_glyph_blt(pDrawable, pGC, x, y, nglyph, ppci,
+					 fg, bg, 0xcc, 0xcc);
+
+	for (width = 0, i = 0; i < nglyph; i++)
+		width += ppci[i]->metrics.characterWidth;
+
+	back.x = width < 0 ? x + width : x;
+	back.y = y - FONTASCENT(pFont);
+	back.width = width < 0 ? -width : width;
+	back.height = FONTASCENT(pFont) + FONTDESCENT(pFont);
+
+	if (back.width && back.height) {
+		bands = etnaviv_clip_bands(etnaviv, pGC);
+		if (!bands)
+			return FALSE;
+
+		if (!etnaviv_init_dst_drawable(etnaviv, &op, pDrawable))
+			return FALSE;
+
+		op.src = INIT_BLIT_NULL;
+		op.blend_op = NULL;
+		op.clip = RegionExtents(clip);
+		op.src_origin_mode = SRC_ORIGIN_NONE;
+		op.rop = etnaviv_fill_rop[GXcopy];
+		op.brush = BRUSH_SOLID;
+		op.fg_colour = bg;
+
+		etnaviv_fill_rects(etnaviv, &op, pDrawable, bands, 1, &back);
+	}
 
-	/* Translate them for the drawable position */
-	RegionTranslate(rects, pDrawable->x, pDrawable->y);
+	return etnaviv_glyph_blt(pDrawable, pGC, x, y, nglyph, ppci,
+				 fg, bg, 0xcc, 0xaa);
+}
 
-	/* Intersect them with the clipping region */
-	RegionIntersect(rects, rects, fbGetCompositeClip(pGC));
+Bool etnaviv_accel_PolyGlyphBlt(DrawablePtr pDrawable, GCPtr pGC,
+	int x, int y, unsigned int nglyph, CharInfoPtr *ppci)
+{
+	struct etnaviv *etnaviv = etnaviv_get_screen_priv(pDrawable->pScreen);
 
-	nbox = RegionNumRects(rects);
-	if (nbox) {
-		int tile_w, tile_h, tile_off_x, tile_off_y;
-		BoxPtr pBox;
+	if (RegionNumRects(fbGetCompositeClip(pGC)) == 0)
+		return TRUE;
 
-		/* Calculate the tile offset from the rect coords */
-		tile_off_x = pDrawable->x + pGC->patOrg.x;
-		tile_off_y = pDrawable->y + pGC->patOrg.y;
+	/* Clear glyph bits leave the destination untouched */
+	return etnaviv_glyph_blt(pDrawable, pGC, x, y, nglyph, ppci,
+				 etnaviv_fg_col(etnaviv, pGC), 0,
+				 etnaviv_copy_rop[pGC->alu], 0xaa);
+}
 
-		tile_w = pTile->drawable.width;
-		tile_h = pTile->drawable.height;
+/*
+ * PushPixels bitmaps are converted to a monochrome source in a pool
+ * pixmap.  Most bitmaps are scratch pixmaps which are rewritten before
+ * each call, so they are remembered by their contents.  A bitmap seen
+ * a second time gets its own pixmap, along with a copy of its bits so
+ * that later matches can be confirmed.
+ */
+#define BITMAP_CACHE_MAX	16384
 
-		pBox = RegionRects(rects);
-		while (nbox--) {
-			xPoint tile_origin;
-			int dst_y, height, tile_y;
+static void etnaviv_bitmap_release(ScreenPtr pScreen,
+	struct etnaviv_bitmap *b)
+{
+	if (b->pixmap)
+		pScreen->DestroyPixmap(b->pixmap);
+	free(b->bits);
+	memset(b, 0, sizeof(*b));
+}
+
+static PixmapPtr etnaviv_bitmap_lookup(struct etnaviv *etnaviv,
+	PixmapPtr pBitmap, int w, int h)
+{
+	ScreenPtr pScreen = pBitmap->drawable.pScreen;
+	struct etnaviv_bitmap *b, *promote = NULL;
+	int x, y, stride = (w + 7) / 8;
+	size_t size = stride * h;
+	uint8_t *bits = NULL, *dst, last = 0xff;
+	const uint8_t *src;
+	int src_stride;
+	uint32_t hash = 0;
+	PixmapPtr pPix;
+	unsigned i;
+
+	prepare_cpu_drawable(&pBitmap->drawable, CPU_ACCESS_RO);
+
+	src = pBitmap->devPrivate.ptr;
+	src_stride = pBitmap->devKind;
+
+	if (size <= BITMAP_CACHE_MAX) {
+		/* Only the bits within the width take part in the match */
+		if (w & 7)
+#if BITMAP_BIT_ORDER == MSBFirst
+			last = 0xff << (8 - (w & 7));
+#else
+			last = 0xff >> (8 - (w & 7));
+#endif
 
-			op.clip = pBox;
+		bits = malloc(size);
+		if (!bits) {
+			finish_cpu_drawable(&pBitmap->drawable, CPU_ACCESS_RO);
+			return NULL;
+		}
 
-			etnaviv_batch_start(etnaviv, &op);
+		for (y = 0, dst = bits; y < h; y++, dst += stride) {
+			memcpy(dst, src + y * src_stride, stride);
+			dst[stride - 1] &= last;
+		}
 
-			dst_y = pBox->y1;
-			height = pBox->y2 - dst_y;
-			modulus(dst_y - tile_off_y, tile_h, tile_y);
+		finish_cpu_drawable(&pBitmap->drawable, CPU_ACCESS_RO);
 
-			tile_origin.y = tile_y;
+		hash = 2166136261u;
+		for (i = 0; i < size; i++)
+			hash = (hash ^ bits[i]) * 16777619u;
 
-			while (height > 0) {
-				int dst_x, width, tile_x, h;
+		for (i = 0; i < ETNAVIV_BITMAP_CACHE; i++) {
+			b = &etnaviv->bitmap_cache[i];
+			if (b->hash != hash || b->width != w ||
+			    b->height != h)
+				continue;
 
-				dst_x = pBox->x1;
-				width = pBox->x2 - dst_x;
-				modulus(dst_x - tile_off_x, tile_w, tile_x);
+			if (!b->pixmap) {
+				promote = b;
+				break;
+			}
 
-				tile_origin.x = tile_x;
+			if (memcmp(b->bits, bits, size) == 0) {
+				free(bits);
+				b->pixmap->refcnt++;
+				return b->pixmap;
+			}
+		}
 
-				h = tile_h - tile_origin.y;
-				if (h > height)
-					h = height;
-				height -= h;
+		src = bits;
+		src_stride = stride;
+	}
 
-				while (width > 0) {
-					BoxRec dst;
-					int w;
+	pPix = NULL;
+	if (promote)
+		pPix = pScreen->CreatePixmap(pScreen, stride, h, 8,
+					     CREATE_PIXMAP_USAGE_GPU);
+	if (!pPix) {
+		promote = NULL;
+		pPix = etnaviv_mask_pool_get(pScreen, stride, h);
+	}
+	if (!pPix) {
+		if (bits)
+			free(bits);
+		else
+			finish_cpu_drawable(&pBitmap->drawable,
+					    CPU_ACCESS_RO);
+		return NULL;
+	}
 
-					w = tile_w - tile_origin.x;
-					if (w > width)
-						w = width;
-					width -= w;
+	prepare_cpu_drawable(&pPix->drawable, CPU_ACCESS_RW);
+	dst = pPix->devPrivate.ptr;
+	for (y = 0; y < h; y++, src += src_stride, dst += pPix->devKind)
+		for (x = 0; x < stride; x++)
+			dst[x] = etnaviv_mono_byte(src[x]);
+	finish_cpu_drawable(&pPix->drawable, CPU_ACCESS_RW);
+
+	if (!bits) {
+		finish_cpu_drawable(&pBitmap->drawable, CPU_ACCESS_RO);
+	} else if (promote) {
+		free(promote->bits);
+		promote->bits = bits;
+		promote->pixmap = pPix;
+		pPix->refcnt++;
+	} else {
+		i = etnaviv->bitmap_cache_next;
+		etnaviv->bitmap_cache_next = (i + 1) % ETNAVIV_BITMAP_CACHE;
+
+		b = &etnaviv->bitmap_cache[i];
+		etnaviv_bitmap_release(pScreen, b);
+		b->hash = hash;
+		b->width = w;
+		b->height = h;
+		free(bits);
+	}
 
-					dst.x1 = dst_x;
-					dst.x2 = dst_x + w;
-					dst.y1 = dst_y;
-					dst.y2 = dst_y + h;
-					etnaviv_de_op_src_origin(etnaviv, &op,
-								 tile_origin,
-								 &dst);
+	return pPix;
+}
 
-					dst_x += w;
-					tile_origin.x = 0;
-				}
-				dst_y += h;
-				tile_origin.y = 0;
-			}
+void etnaviv_bitmap_cache_free(ScreenPtr pScreen)
+{
+	struct etnaviv *etnaviv = etnaviv_get_screen_priv(pScreen);
+	unsigned i;
 
-			etnaviv_de_end(etnaviv);
+	for (i = 0; i < ETNAVIV_BITMAP_CACHE; i++)
+		etnaviv_bitmap_release(pScreen, &etnaviv->bitmap_cache[i]);
+}
 
-			pBox++;
-		}
+Bool etnaviv_accel_PushPixels(GCPtr pGC, PixmapPtr pBitmap,
+	DrawablePtr pDrawable, int w, int h, int x, int y)
+{
+	struct etnaviv *etnaviv = etnaviv_get_screen_priv(pDrawable->pScreen);
+	ScreenPtr pScreen = pDrawable->pScreen;
+	RegionPtr clip = fbGetCompositeClip(pGC);
+	const struct box_bands *bands;
+	struct etnaviv_pixmap *vPix;
+	struct etnaviv_de_op op;
+	xPoint origin = { 0, 0 };
+	PixmapPtr pPix;
+	BoxRec box;
+
+	if (RegionNumRects(clip) == 0 || w <= 0 || h <= 0)
+		return TRUE;
+
+	bands = etnaviv_clip_bands(etnaviv, pGC);
+	if (!bands)
+		return FALSE;
+
+	pPix = etnaviv_bitmap_lookup(etnaviv, pBitmap, w, h);
+	if (!pPix) {
+		etnaviv_stats_reason(etnaviv, FB_ALLOC);
+		return FALSE;
 	}
 
-	RegionUninit(rects);
-	RegionDestroy(rects);
+	vPix = etnaviv_get_pixmap_priv(pPix);
+	if (!vPix || !etnaviv_map_gpu(etnaviv, vPix, GPU_ACCESS_RO)) {
+		pScreen->DestroyPixmap(pPix);
+		etnaviv_stats_reason(etnaviv, FB_MAP);
+		return FALSE;
+	}
+
+	if (!etnaviv_init_dst_drawable(etnaviv, &op, pDrawable)) {
+		pScreen->DestroyPixmap(pPix);
+		return FALSE;
+	}
+
+	/* Set bits are painted with the fill, clear bits are untouched */
+	op.src = INIT_BLIT_PIX(vPix, ((struct etnaviv_format){
+				.format = DE_FORMAT_MONOCHROME,
+			   }), ZERO_OFFSET);
+	op.blend_op = NULL;
+	op.clip = RegionExtents(clip);
+	op.src_origin_mode = SRC_ORIGIN_NONE;
+	op.rop = etnaviv_copy_rop[pGC->alu];
+	op.bg_rop = 0xaa;
+	op.cmd = VIVS_DE_DEST_CONFIG_COMMAND_BIT_BLT;
+	op.brush = BRUSH_NONE;
+	op.fg_colour = etnaviv_fg_col(etnaviv, pGC);
+	op.bg_colour = 0;
+
+	box.x1 = x + pDrawable->x;
+	box.y1 = y + pDrawable->y;
+	box.x2 = box.x1 + w;
+	box.y2 = box.y1 + h;
+
+	etnaviv_batch_start(etnaviv, &op);
+	etnaviv_blit_bands(etnaviv, &op, bands, &box, origin);
+	etnaviv_de_end(etnaviv);
+
+	/* The pixmap is released once the GPU has finished with it */
+	pScreen->DestroyPixmap(pPix);
 
 	return TRUE;
 }
@@ -1058,6 +3040,20 @@ Bool etnaviv_accel_init(struct etnaviv *etnaviv)
 		etnaviv_enable_bugfix(etnaviv, BUGFIX_SINGLE_BITBLT_DRAW_OP);
 	}
 
+	/*
+	 * Where the 3D pipe shares this core, and the ResolveFill option
+	 * asks for it, its resolve engine can be used for large solid
+	 * fills.  Cores with several pixel pipes split each resolve
+	 * between them, which we do not handle.
+	 */
+	if (etnaviv->rs_fill &&
+	    (!VIV_FEATURE(etnaviv->conn, chipFeatures, PIPE_3D) ||
+	     etnaviv->conn->chip.pixel_pipes > 1)) {
+		xf86DrvMsg(etnaviv->scrnIndex, X_WARNING,
+			   "etnaviv: ResolveFill not supported on this GPU\n");
+		etnaviv->rs_fill = FALSE;
+	}
+
 	return TRUE;
 }
 
@@ -1066,7 +3062,9 @@ void etnaviv_accel_shutdown(struct etnaviv *etnaviv)
 	struct etnaviv_pixmap *i, *n;
 
 	TimerFree(etnaviv->cache_timer);
+	etnaviv_render_flush(etnaviv);
 	etna_finish(etnaviv->ctx);
+	etnaviv->xv_kernel = NULL;
 	xorg_list_for_each_entry_safe(i, n, &etnaviv->batch_head,
 				      batch_node) {
 		xorg_list_del(&i->batch_node);
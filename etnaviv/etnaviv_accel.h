@@ -16,9 +16,12 @@
 #include "etnaviv_op.h"
 
 struct armada_accel_ops;
+struct box_bands;
 struct drm_armada_bo;
 struct drm_armada_bufmgr;
 struct etnaviv_dri2_info;
+struct etnaviv_spans;
+struct etnaviv_stats;
 
 #undef DEBUG
 
@@ -73,6 +76,58 @@ enum {
 /* The size of the additional blit for GC320 */
 #define BATCH_WA_GC320_SIZE	(6 + 6 + 2 + 4 + 4)
 
+/* Number of A8 pixmaps kept around for trapezoid/triangle masks */
+#define ETNAVIV_MASK_POOL	4
+
+/* Number of tiles kept in their expanded form, see etnaviv_tile_lookup() */
+#define ETNAVIV_TILE_CACHE	4
+
+struct etnaviv_tile {
+	PixmapPtr tile;
+	unsigned long serial;
+	uint32_t generation;
+	Bool mono;
+	Pixel fg, bg;
+	uint64_t pattern;
+	PixmapPtr pixmap;
+	unsigned lru;
+};
+
+/* Number of stipples kept in their expanded form, see etnaviv_stipple_lookup() */
+#define ETNAVIV_STIPPLE_CACHE	4
+
+struct etnaviv_stipple {
+	PixmapPtr stipple;
+	unsigned long serial;
+	uint8_t *bits;
+	size_t size;
+	int tile_w, tile_h;
+	PixmapPtr pixmap;
+};
+
+/* Core font glyph atlas, see etnaviv_glyph_lookup() */
+#define ETNAVIV_GLYPH_HASH	4096
+
+struct etnaviv_glyph_atlas {
+	PixmapPtr pixmap;
+	unsigned int shelf_x, shelf_y, shelf_h;
+	unsigned int nglyphs;
+	struct etnaviv_glyph_slot {
+		const void *key;
+		uint16_t x, y;
+	} slot[ETNAVIV_GLYPH_HASH];
+};
+
+/* Number of PushPixels bitmaps remembered, see etnaviv_bitmap_lookup() */
+#define ETNAVIV_BITMAP_CACHE	8
+
+struct etnaviv_bitmap {
+	uint32_t hash;
+	uint16_t width, height;
+	uint8_t *bits;
+	PixmapPtr pixmap;
+};
+
 struct etnaviv {
 	struct viv_conn *conn;
 	struct etna_ctx *ctx;
@@ -82,9 +137,16 @@ struct etnaviv {
 	struct xorg_list fence_head;
 	struct xorg_list busy_free_list;
 	struct xorg_list usermem_free_list;
+	/* client memory being read by the GPU, see etnaviv_finish_shm() */
+	struct xorg_list shm_busy_list;
 	OsTimerPtr cache_timer;
 	uint32_t last_fence;
 	Bool force_fallback;
+	/* large solid fills may use the 3D resolve engine */
+	Bool rs_fill;
+	struct etnaviv_stats *stats;
+	/* spans being collected, see etnaviv_spans_start() */
+	struct etnaviv_spans *spans;
 	struct drm_armada_bufmgr *bufmgr;
 	uint32_t bugs[1];
 	struct etnaviv_blit_buf gc320_wa_src;
@@ -122,6 +184,7 @@ struct etnaviv {
 	DestroyPixmapProcPtr DestroyPixmap;
 	CreateGCProcPtr CreateGC;
 	BitmapToRegionProcPtr BitmapToRegion;
+	UnrealizeFontProcPtr UnrealizeFont;
 	ScreenBlockHandlerProcPtr BlockHandler;
 	CreateScreenResourcesProcPtr CreateScreenResources;
 
@@ -132,9 +195,27 @@ struct etnaviv {
 	AddTrianglesProcPtr AddTriangles;
 	AddTrapsProcPtr AddTraps;
 	UnrealizeGlyphProcPtr UnrealizeGlyph;
+	PixmapPtr mask_pool[ETNAVIV_MASK_POOL];
+	unsigned mask_pool_next;
+	struct etnaviv_tile tile_cache[ETNAVIV_TILE_CACHE];
+	unsigned tile_cache_lru;
+	struct etnaviv_stipple stipple_cache[ETNAVIV_STIPPLE_CACHE];
+	unsigned stipple_cache_next;
+	struct etnaviv_glyph_atlas *glyph_atlas;
+	struct etnaviv_bitmap bitmap_cache[ETNAVIV_BITMAP_CACHE];
+	unsigned bitmap_cache_next;
+
+	/* Deferred composite operation, see etnaviv_render_flush() */
+	struct etnaviv_de_op composite_op;
+	struct etnaviv_blend_op composite_blend;
+	BoxRec composite_clip;
+	unsigned composite_nbox;
+	BoxRec composite_box[VIVANTE_MAX_2D_RECTS];
 
 	struct etnaviv_xv_priv *xv;
 	unsigned xv_ports;
+	/* filter kernel last loaded into the GPU, see etnaviv_xv.c */
+	const uint32_t *xv_kernel;
 	CloseScreenProcPtr xv_CloseScreen;
 };
 
@@ -147,6 +228,8 @@ struct etnaviv_pixmap {
 	struct xorg_list batch_node;
 	struct xorg_list busy_node;
 	uint32_t fence;
+	/* incremented whenever the pixmap is mapped for writing */
+	uint32_t generation;
 	viv_usermem_t info;
 
 	uint8_t batch_state;
@@ -162,6 +245,7 @@ struct etnaviv_pixmap {
 #define ST_GPU_W	(1 << 3)
 #define ST_GPU_RW	(3 << 2)
 #define ST_DMABUF	(1 << 4)
+#define ST_GPU_WRITTEN	(1 << 5)	/* contents written by the GPU */
 
 #ifdef DEBUG_CHECK_DRAWABLE_USE
 	int in_use;
@@ -176,6 +260,7 @@ struct etnaviv_usermem_node {
 	struct etnaviv_pixmap *dst;
 	struct etna_bo *bo;
 	void *mem;
+	uint32_t fence;
 };
 
 void etnaviv_add_freemem(struct etnaviv *etnaviv,
@@ -207,6 +292,9 @@ Bool etnaviv_accel_GetImage(DrawablePtr pDrawable, int x, int y, int w, int h,
 	unsigned int format, unsigned long planeMask, char *d);
 Bool etnaviv_accel_PutImage(DrawablePtr pDrawable, GCPtr pGC, int depth,
 	int x, int y, int w, int h, int leftPad, int format, char *bits);
+Bool etnaviv_accel_ShmPutImage(DrawablePtr pDrawable, GCPtr pGC, int depth,
+	unsigned int format, int w, int h, int sx, int sy, int sw, int sh,
+	int dx, int dy, char *data);
 void etnaviv_accel_CopyNtoN(DrawablePtr pSrc, DrawablePtr pDst,
 	GCPtr pGC, BoxPtr pBox, int nBox, int dx, int dy, Bool reverse,
 	Bool upsidedown, Pixel bitPlane, void *closure);
@@ -218,16 +306,36 @@ Bool etnaviv_accel_PolySegment(DrawablePtr pDrawable, GCPtr pGC, int nseg,
 	xSegment *pSeg);
 Bool etnaviv_accel_PolyFillRectSolid(DrawablePtr pDrawable, GCPtr pGC, int n,
 	xRectangle * prect);
+Bool etnaviv_accel_PolyFillRectPlanemask(DrawablePtr pDrawable, GCPtr pGC,
+	int n, xRectangle * prect);
 Bool etnaviv_accel_PolyFillRectTiled(DrawablePtr pDrawable, GCPtr pGC, int n,
 	xRectangle * prect);
+Bool etnaviv_accel_PolyFillRectStippled(DrawablePtr pDrawable, GCPtr pGC,
+	int n, xRectangle * prect);
+void etnaviv_tile_cache_forget(ScreenPtr pScreen, PixmapPtr pTile);
+void etnaviv_tile_cache_free(ScreenPtr pScreen);
+void etnaviv_stipple_cache_free(ScreenPtr pScreen);
+Bool etnaviv_accel_ImageGlyphBlt(DrawablePtr pDrawable, GCPtr pGC,
+	int x, int y, unsigned int nglyph, CharInfoPtr *ppci);
+Bool etnaviv_accel_PolyGlyphBlt(DrawablePtr pDrawable, GCPtr pGC,
+	int x, int y, unsigned int nglyph, CharInfoPtr *ppci);
+void etnaviv_glyph_atlas_empty(ScreenPtr pScreen);
+void etnaviv_glyph_atlas_free(ScreenPtr pScreen);
+Bool etnaviv_accel_PushPixels(GCPtr pGC, PixmapPtr pBitmap,
+	DrawablePtr pDrawable, int w, int h, int x, int y);
+void etnaviv_bitmap_cache_free(ScreenPtr pScreen);
 
 void etnaviv_commit(struct etnaviv *etnaviv, Bool stall, uint32_t *fence);
 void etnaviv_finish_fences(struct etnaviv *etnaviv, uint32_t fence);
 void etnaviv_free_busy_vpix(struct etnaviv *etnaviv);
 
 void etnaviv_batch_wait_commit(struct etnaviv *etnaviv, struct etnaviv_pixmap *vPix);
+void etnaviv_batch_add(struct etnaviv *etnaviv, struct etnaviv_pixmap *vPix);
 void etnaviv_batch_start(struct etnaviv *etnaviv,
 	const struct etnaviv_de_op *op);
+Bool etnaviv_pixmap_detile(struct etnaviv *etnaviv, PixmapPtr pixmap);
+PixmapPtr etnaviv_mask_pool_get(ScreenPtr pScreen, int width, int height);
+void etnaviv_mask_pool_free(ScreenPtr pScreen);
 
 void etnaviv_accel_shutdown(struct etnaviv *);
 Bool etnaviv_accel_init(struct etnaviv *);
@@ -257,6 +365,19 @@ static inline struct etnaviv *etnaviv_get_screen_priv(ScreenPtr pScreen)
 	return etnaviv_GetKeyPriv(&pScreen->devPrivates, &etnaviv_screen_index);
 }
 
+/* The GC private holds an index of the composite clip bands */
+static inline struct box_bands *etnaviv_get_gc_priv(GCPtr pGC)
+{
+	extern etnaviv_Key etnaviv_gc_index;
+	return etnaviv_GetKeyPriv(&pGC->devPrivates, &etnaviv_gc_index);
+}
+
+static inline void etnaviv_set_gc_priv(GCPtr pGC, struct box_bands *bands)
+{
+	extern etnaviv_Key etnaviv_gc_index;
+	dixSetPrivate(&pGC->devPrivates, &etnaviv_gc_index, bands);
+}
+
 static inline void etnaviv_set_pixmap_priv(PixmapPtr pixmap, struct etnaviv_pixmap *g)
 {
 	extern etnaviv_Key etnaviv_pixmap_index;
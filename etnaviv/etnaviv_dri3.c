@@ -87,6 +87,10 @@ static int etnaviv_dri3_fd_from_pixmap(ScreenPtr pScreen, PixmapPtr pixmap,
 	if (!vPix || !vPix->etna_bo)
 		return BadMatch;
 
+	/* Other users expect a linear layout */
+	if (!etnaviv_pixmap_detile(etnaviv, pixmap))
+		return BadMatch;
+
 	*stride = pixmap->devKind;
 	*size = etna_bo_size(vPix->etna_bo);
 
@@ -7,6 +7,7 @@
 
 #include "etnaviv_accel.h"
 #include "etnaviv_op.h"
+#include "etnaviv_stats.h"
 
 void etnaviv_emit(struct etnaviv *etnaviv)
 {
@@ -14,6 +15,9 @@ void etnaviv_emit(struct etnaviv *etnaviv)
 	struct etnaviv_reloc *r;
 	unsigned int i;
 
+	/* Account every emission, including those at the high watermark */
+	etnaviv_stats_bytes(etnaviv, etnaviv->batch_size * 4);
+
 	for (i = 0, r = etnaviv->reloc; i < etnaviv->reloc_size; i++, r++)
 		etnaviv->batch[r->batch_index] += etna_bo_gpu_address(r->bo);
 
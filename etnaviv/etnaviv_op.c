@@ -7,6 +7,7 @@
 
 #include "etnaviv_accel.h"
 #include "etnaviv_op.h"
+#include "etnaviv_stats.h"
 
 #include <etnaviv/etna.h>
 #include <etnaviv/etna_bo.h>
@@ -100,10 +101,19 @@ static inline uint32_t etnaviv_src_config(struct etnaviv_format fmt,
 	src_cfg = VIVS_DE_SRC_CONFIG_PE10_SOURCE_FORMAT(fmt.format) |
 		  VIVS_DE_SRC_CONFIG_TRANSPARENCY(0) |
 		  VIVS_DE_SRC_CONFIG_LOCATION_MEMORY |
-		  VIVS_DE_SRC_CONFIG_PACK_PACKED8 |
 		  VIVS_DE_SRC_CONFIG_SWIZZLE(fmt.swizzle) |
 		  VIVS_DE_SRC_CONFIG_SOURCE_FORMAT(fmt.format);
 
+	/*
+	 * The packing selects how monochrome source lines are laid out.
+	 * Our monochrome pixmaps have padded lines, so the source stride
+	 * must be used rather than packing the lines together.
+	 */
+	if (fmt.format == DE_FORMAT_MONOCHROME)
+		src_cfg |= VIVS_DE_SRC_CONFIG_PACK_UNPACKED;
+	else
+		src_cfg |= VIVS_DE_SRC_CONFIG_PACK_PACKED8;
+
 	if (relative)
 		src_cfg |= VIVS_DE_SRC_CONFIG_SRC_RELATIVE_RELATIVE;
 
@@ -167,13 +177,19 @@ static void etnaviv_emit_rop_clip(struct etnaviv *etnaviv, unsigned fg_rop,
 	EL_END();
 }
 
-static void etnaviv_emit_brush(struct etnaviv *etnaviv, uint32_t fg)
+/*
+ * Load the 8x8 monochrome pattern.  A solid brush is a pattern with
+ * every bit set; set bits take the foreground colour, clear bits the
+ * background colour.
+ */
+static void etnaviv_emit_brush(struct etnaviv *etnaviv, uint64_t mask,
+	uint32_t bg, uint32_t fg)
 {
 	EL_START(etnaviv, 8);
 	EL(LOADSTATE(VIVS_DE_PATTERN_MASK_LOW, 4));
-	EL(~0);
-	EL(~0);
-	EL(0);
+	EL(mask);
+	EL(mask >> 32);
+	EL(bg);
 	EL(fg);
 	EL_ALIGN();
 	EL(LOADSTATE(VIVS_DE_PATTERN_CONFIG, 1));
@@ -181,6 +197,17 @@ static void etnaviv_emit_brush(struct etnaviv *etnaviv, uint32_t fg)
 	EL_END();
 }
 
+/* Colours used to expand a monochrome source */
+static void etnaviv_emit_src_colour(struct etnaviv *etnaviv, uint32_t bg,
+	uint32_t fg)
+{
+	EL_START(etnaviv, 4);
+	EL(LOADSTATE(VIVS_DE_SRC_COLOR_BG, 2));
+	EL(bg);
+	EL(fg);
+	EL_END();
+}
+
 static void etnaviv_set_blend(struct etnaviv *etnaviv,
 	const struct etnaviv_blend_op *op)
 {
@@ -236,15 +263,31 @@ static void etnaviv_emit_2d_draw(struct etnaviv *etnaviv, const BoxRec *pbox,
 
 void etnaviv_de_start(struct etnaviv *etnaviv, const struct etnaviv_de_op *op)
 {
+	unsigned bg_rop = op->rop;
+
 	BATCH_SETUP_START(etnaviv);
 
-	if (op->src.bo)
+	if (op->src.bo) {
 		etnaviv_set_source_bo(etnaviv, &op->src, op->src_origin_mode);
+
+		/*
+		 * With a monochrome source, clear source bits select the
+		 * background ROP, which allows transparent expansion.
+		 */
+		if (op->src.format.format == DE_FORMAT_MONOCHROME) {
+			etnaviv_emit_src_colour(etnaviv, op->bg_colour,
+						op->fg_colour);
+			bg_rop = op->bg_rop;
+		}
+	}
 	etnaviv_set_dest_bo(etnaviv, &op->dst, op->cmd);
 	etnaviv_set_blend(etnaviv, op->blend_op);
-	if (op->brush)
-		etnaviv_emit_brush(etnaviv, op->fg_colour);
-	etnaviv_emit_rop_clip(etnaviv, op->rop, op->rop, op->clip,
+	if (op->brush == BRUSH_MONO)
+		etnaviv_emit_brush(etnaviv, op->pattern, op->bg_colour,
+				   op->fg_colour);
+	else if (op->brush)
+		etnaviv_emit_brush(etnaviv, ~0ULL, 0, op->fg_colour);
+	etnaviv_emit_rop_clip(etnaviv, op->rop, bg_rop, op->clip,
 			      op->dst.offset);
 
 	BATCH_SETUP_END(etnaviv);
@@ -297,6 +340,8 @@ void etnaviv_de_op_src_origin(struct etnaviv *etnaviv,
 		BATCH_OP_START(etnaviv);
 	}
 
+	etnaviv_stats_boxes(etnaviv, 1);
+
 	EL_START(etnaviv, op_size);
 	EL(LOADSTATE(VIVS_DE_SRC_ORIGIN, 1));
 	EL(VIVS_DE_SRC_ORIGIN_X(src_origin.x) |
@@ -323,6 +368,8 @@ void etnaviv_de_op(struct etnaviv *etnaviv, const struct etnaviv_de_op *op,
 
 	assert(nBox);
 
+	etnaviv_stats_boxes(etnaviv, nBox);
+
 	if (op->cmd == VIVS_DE_DEST_CONFIG_COMMAND_BIT_BLT &&
 	    etnaviv_has_bugfix(etnaviv, BUGFIX_SINGLE_BITBLT_DRAW_OP)) {
 		size_t op_size = etnaviv_size_2d_draw(etnaviv, 1) + 6;
@@ -464,12 +511,114 @@ void etnaviv_vr_op(struct etnaviv *etnaviv, struct etnaviv_vr_op *op,
 	}
 	EL_END();
 
+	etnaviv_stats_boxes(etnaviv, n);
 	etnaviv_emit(etnaviv);
 }
 
+static void etnaviv_rs_pipe(struct etnaviv *etnaviv, uint32_t flush,
+	uint32_t pipe)
+{
+	EL_START(etnaviv, 8);
+	EL(LOADSTATE(VIVS_GL_FLUSH_CACHE, 1));
+	EL(flush);
+	EL(LOADSTATE(VIVS_GL_SEMAPHORE_TOKEN, 1));
+	EL(VIVS_GL_SEMAPHORE_TOKEN_FROM(SYNC_RECIPIENT_FE) |
+	   VIVS_GL_SEMAPHORE_TOKEN_TO(SYNC_RECIPIENT_PE));
+	EL_STALL(SYNC_RECIPIENT_FE, SYNC_RECIPIENT_PE);
+	EL(LOADSTATE(VIVS_GL_PIPE_SELECT, 1));
+	EL(pipe);
+	EL_END();
+}
+
+/*
+ * Fill boxes using the resolve engine on the 3D pipe, which clears
+ * aligned blocks far faster than the 2D engine draws rectangles.  The
+ * caller must align the boxes as described in etnaviv_accel.c.  The
+ * 2D pipe is flushed before switching, and the colour cache is flushed
+ * before switching back, so the fill is ordered with respect to the
+ * surrounding 2D operations.  Each destination address needs a
+ * relocation, which limits the number of boxes per batch.
+ */
+void etnaviv_rs_clear(struct etnaviv *etnaviv, const struct etnaviv_rs_op *op,
+	const BoxRec *pBox, size_t nBox)
+{
+	etnaviv_stats_boxes(etnaviv, nBox);
+
+	while (nBox) {
+		size_t i, n = nBox > MAX_RELOC_SIZE ? MAX_RELOC_SIZE : nBox;
+
+		BATCH_SETUP_START(etnaviv);
+		etnaviv_rs_pipe(etnaviv, VIVS_GL_FLUSH_CACHE_PE2D,
+				ETNA_PIPE_3D);
+
+		EL_START(etnaviv, 12 + 8 * n);
+		EL(LOADSTATE(VIVS_RS_CONFIG, 1));
+		EL(VIVS_RS_CONFIG_SOURCE_FORMAT(op->format) |
+		   VIVS_RS_CONFIG_DEST_FORMAT(op->format));
+		EL(LOADSTATE(VIVS_RS_DITHER(0), 2));
+		EL(0xffffffff);
+		EL(0xffffffff);
+		EL_ALIGN();
+		EL(LOADSTATE(VIVS_RS_CLEAR_CONTROL, 1));
+		EL(VIVS_RS_CLEAR_CONTROL_MODE_ENABLED1 |
+		   VIVS_RS_CLEAR_CONTROL_BITS(0xffff));
+		EL(LOADSTATE(VIVS_RS_FILL_VALUE(0), 1));
+		EL(op->fill);
+		EL(LOADSTATE(VIVS_RS_EXTRA_CONFIG, 1));
+		EL(0);
+
+		for (i = 0; i < n; i++, pBox++) {
+			unsigned x = pBox->x1 + op->dst.offset.x;
+			unsigned y = pBox->y1 + op->dst.offset.y;
+
+			/* 4 */
+			EL(LOADSTATE(VIVS_RS_DEST_ADDR, 2));
+			EL_RELOC(op->dst.bo, y * op->dst.pitch + x * op->cpp,
+				 TRUE);
+			EL(op->dst.pitch);
+			EL_ALIGN();
+
+			/* 4 */
+			EL(LOADSTATE(VIVS_RS_WINDOW_SIZE, 1));
+			EL(VIVS_RS_WINDOW_SIZE_WIDTH(pBox->x2 - pBox->x1) |
+			   VIVS_RS_WINDOW_SIZE_HEIGHT(pBox->y2 - pBox->y1));
+			EL(LOADSTATE(VIVS_RS_KICKER, 1));
+			EL(0xbeebbeeb);
+		}
+		EL_END();
+
+		etnaviv_rs_pipe(etnaviv, VIVS_GL_FLUSH_CACHE_COLOR |
+				VIVS_GL_FLUSH_CACHE_DEPTH, ETNA_PIPE_2D);
+
+		etnaviv_emit(etnaviv);
+
+		nBox -= n;
+	}
+}
+
 void etnaviv_flush(struct etnaviv *etnaviv)
 {
 	struct etna_ctx *ctx = etnaviv->ctx;
 	etna_set_state(ctx, VIVS_GL_FLUSH_CACHE, VIVS_GL_FLUSH_CACHE_PE2D);
 	etna_set_state(ctx, VIVS_GL_FLUSH_CACHE, VIVS_GL_FLUSH_CACHE_PE2D);
 }
+
+/*
+ * Flush the 2D pixel engine and stall the front end until it has
+ * drained, so that state loaded afterwards can not change under an
+ * operation which is still running.
+ */
+void etnaviv_flush_stall(struct etnaviv *etnaviv)
+{
+	BATCH_SETUP_START(etnaviv);
+	EL_START(etnaviv, 6);
+	EL(LOADSTATE(VIVS_GL_FLUSH_CACHE, 1));
+	EL(VIVS_GL_FLUSH_CACHE_PE2D);
+	EL(LOADSTATE(VIVS_GL_SEMAPHORE_TOKEN, 1));
+	EL(VIVS_GL_SEMAPHORE_TOKEN_FROM(SYNC_RECIPIENT_FE) |
+	   VIVS_GL_SEMAPHORE_TOKEN_TO(SYNC_RECIPIENT_PE));
+	EL_STALL(SYNC_RECIPIENT_FE, SYNC_RECIPIENT_PE);
+	EL_END();
+
+	etnaviv_emit(etnaviv);
+}
@@ -72,10 +72,18 @@ struct etnaviv_de_op {
 	uint8_t src_origin_mode;
 	uint8_t rop;
 	unsigned cmd;
-	Bool brush;
+	uint8_t brush;
 	uint32_t fg_colour;
+	/* Background state for BRUSH_MONO and monochrome sources */
+	uint8_t bg_rop;
+	uint32_t bg_colour;
+	uint64_t pattern;
 };
 
+#define BRUSH_NONE	0
+#define BRUSH_SOLID	1
+#define BRUSH_MONO	2
+
 struct etnaviv_vr_op {
 	struct etnaviv_blit_buf dst;
 	struct etnaviv_blit_buf src;
@@ -88,6 +96,13 @@ struct etnaviv_vr_op {
 	unsigned vr_op;
 };
 
+struct etnaviv_rs_op {
+	struct etnaviv_blit_buf dst;
+	uint32_t format;	/* RS_FORMAT_* */
+	unsigned cpp;
+	uint32_t fill;		/* raw fill value, replicated to 32 bits */
+};
+
 void etnaviv_de_start(struct etnaviv *etnaviv, const struct etnaviv_de_op *op);
 void etnaviv_de_end(struct etnaviv *etnaviv);
 void etnaviv_de_op_src_origin(struct etnaviv *etnaviv,
@@ -97,7 +112,10 @@ void etnaviv_de_op(struct etnaviv *etnaviv, const struct etnaviv_de_op *op,
 void etnaviv_vr_op(struct etnaviv *etnaviv, struct etnaviv_vr_op *op,
 	const BoxRec *dst, uint32_t x1, uint32_t y1,
 	const BoxRec *boxes, size_t n);
+void etnaviv_rs_clear(struct etnaviv *etnaviv, const struct etnaviv_rs_op *op,
+	const BoxRec *pBox, size_t nBox);
 void etnaviv_emit(struct etnaviv *etnaviv);
 void etnaviv_flush(struct etnaviv *etnaviv);
+void etnaviv_flush_stall(struct etnaviv *etnaviv);
 
 #endif
@@ -28,6 +28,7 @@
 #include "mipict.h"
 #include "fbpict.h"
 
+#include "cpu_access.h"
 #include "glyph_assemble.h"
 #include "glyph_cache.h"
 #include "glyph_extents.h"
@@ -37,6 +38,7 @@
 
 #include "etnaviv_accel.h"
 #include "etnaviv_render.h"
+#include "etnaviv_stats.h"
 #include "etnaviv_utils.h"
 #include "etnaviv_compat.h"
 
@@ -173,6 +175,28 @@ static Bool etnaviv_blend_src_alpha_normal(struct etnaviv_blend_op *op)
 		VIVS_DE_ALPHA_MODES_GLOBAL_SRC_ALPHA_MODE_NORMAL;
 }
 
+/*
+ * Replace the per-pixel source alpha with a constant, for sources where
+ * every pixel carries the same alpha value.  Any existing global alpha
+ * scaling is folded into the new constant.
+ */
+static void etnaviv_blend_const_src_alpha(struct etnaviv_blend_op *op,
+	unsigned alpha)
+{
+	uint32_t mode = op->alpha_mode &
+			VIVS_DE_ALPHA_MODES_GLOBAL_SRC_ALPHA_MODE__MASK;
+
+	if (mode == VIVS_DE_ALPHA_MODES_GLOBAL_SRC_ALPHA_MODE_NORMAL)
+		op->src_alpha = alpha;
+	else if (mode == VIVS_DE_ALPHA_MODES_GLOBAL_SRC_ALPHA_MODE_SCALED)
+		op->src_alpha = (alpha * op->src_alpha + 127) / 255;
+	else
+		return;
+
+	op->alpha_mode &= ~VIVS_DE_ALPHA_MODES_GLOBAL_SRC_ALPHA_MODE__MASK;
+	op->alpha_mode |= VIVS_DE_ALPHA_MODES_GLOBAL_SRC_ALPHA_MODE_GLOBAL;
+}
+
 static Bool etnaviv_fill_single(struct etnaviv *etnaviv,
 	struct etnaviv_pixmap *vPix, const BoxRec *clip, uint32_t colour)
 {
@@ -196,6 +220,30 @@ static Bool etnaviv_fill_single(struct etnaviv *etnaviv,
 	return TRUE;
 }
 
+static Bool etnaviv_fill_region(struct etnaviv *etnaviv,
+	struct etnaviv_pixmap *vPix, RegionPtr region, xPoint offset,
+	uint32_t colour)
+{
+	struct etnaviv_de_op op = {
+		.clip = RegionExtents(region),
+		.rop = 0xf0,
+		.cmd = VIVS_DE_DEST_CONFIG_COMMAND_BIT_BLT,
+		.brush = TRUE,
+		.fg_colour = colour,
+	};
+
+	if (!etnaviv_map_gpu(etnaviv, vPix, GPU_ACCESS_RW))
+		return FALSE;
+
+	op.dst = INIT_BLIT_PIX(vPix, vPix->pict_format, offset);
+
+	etnaviv_batch_start(etnaviv, &op);
+	etnaviv_de_op(etnaviv, &op, RegionRects(region), RegionNumRects(region));
+	etnaviv_de_end(etnaviv);
+
+	return TRUE;
+}
+
 static Bool etnaviv_blend(struct etnaviv *etnaviv, const BoxRec *clip,
 	const struct etnaviv_blend_op *blend,
 	struct etnaviv_pixmap *vDst, struct etnaviv_pixmap *vSrc,
@@ -231,22 +279,32 @@ static void etnaviv_set_format(struct etnaviv_pixmap *vpix, PicturePtr pict)
 	vpix->pict_format.tile = vpix->format.tile;
 }
 
+/*
+ * Get the temporary pixmap, creating it if necessary.  Temporaries
+ * which are only accessed by the GPU are tiled; those which will be
+ * written by a software fallback are linear, to avoid detiling them.
+ */
 static struct etnaviv_pixmap *etnaviv_get_scratch_argb(ScreenPtr pScreen,
-	PixmapPtr *ppPixmap, unsigned int width, unsigned int height)
+	PixmapPtr *ppPixmap, unsigned int width, unsigned int height,
+	Bool gpu_only)
 {
 	struct etnaviv_pixmap *vpix;
 	PixmapPtr pixmap;
+	unsigned usage = CREATE_PIXMAP_USAGE_GPU;
 
 	if (*ppPixmap)
 		return etnaviv_get_pixmap_priv(*ppPixmap);
 
-	pixmap = pScreen->CreatePixmap(pScreen, width, height, 32,
-				       CREATE_PIXMAP_USAGE_GPU);
+	if (gpu_only)
+		usage |= CREATE_PIXMAP_USAGE_TILE;
+
+	pixmap = pScreen->CreatePixmap(pScreen, width, height, 32, usage);
 	if (!pixmap)
 		return NULL;
 
 	vpix = etnaviv_get_pixmap_priv(pixmap);
 	vpix->pict_format = etnaviv_pict_format(PICT_a8r8g8b8);
+	vpix->pict_format.tile = vpix->format.tile;
 
 	*ppPixmap = pixmap;
 
@@ -261,7 +319,8 @@ static Bool etnaviv_pict_solid_argb(PicturePtr pict, uint32_t *col)
 	CARD32 pixel;
 	uint32_t argb;
 
-	if (!picture_is_solid(pict, &pixel))
+	/* An alpha map replaces the alpha channel of every pixel */
+	if (pict->alphaMap || !picture_is_solid(pict, &pixel))
 		return FALSE;
 
 	pFormat = pict->pFormat;
@@ -337,36 +396,137 @@ static Bool etnaviv_composite_to_pixmap(CARD8 op, PicturePtr pSrc,
 	return TRUE;
 }
 
+/*
+ * Validate a picture's alpha map for use by the GPU.  On entry, pos is
+ * the offset from composite-relative coordinates to the picture; on
+ * exit, it is the offset to the alpha map's backing pixmap.  Pixels
+ * outside the alpha map are transparent, which we don't handle.
+ */
+static struct etnaviv_pixmap *etnaviv_acquire_alpha_map(
+	struct etnaviv *etnaviv, PicturePtr pict, const BoxRec *clip,
+	xPoint *pos)
+{
+	PicturePtr pAlpha = pict->alphaMap;
+	DrawablePtr drawable = pAlpha->pDrawable;
+	struct etnaviv_pixmap *vAlpha;
+	xPoint offset;
+	int x, y;
+
+	if (!drawable || !PICT_FORMAT_A(pAlpha->format))
+		return NULL;
+
+	x = pos->x - pict->alphaOrigin.x;
+	y = pos->y - pict->alphaOrigin.y;
+
+	if (!drawable_contains(drawable, x + clip->x1, y + clip->y1,
+			       clip->x2 - clip->x1, clip->y2 - clip->y1))
+		return NULL;
+
+	vAlpha = etnaviv_drawable_offset(drawable, &offset);
+	if (!vAlpha)
+		return NULL;
+
+	etnaviv_set_format(vAlpha, pAlpha);
+	if (!etnaviv_src_format_valid(etnaviv, vAlpha->pict_format))
+		return NULL;
+
+	pos->x = x + drawable->x + offset.x;
+	pos->y = y + drawable->y + offset.y;
+
+	return vAlpha;
+}
+
+static Bool etnaviv_blit_masked(struct etnaviv *etnaviv, const BoxRec *clip,
+	uint8_t rop, uint32_t mask, struct etnaviv_pixmap *vDst,
+	struct etnaviv_pixmap *vSrc, const BoxRec *pBox, unsigned nBox,
+	xPoint src_offset, xPoint dst_offset)
+{
+	struct etnaviv_de_op op = {
+		.clip = clip,
+		.src_origin_mode = SRC_ORIGIN_RELATIVE,
+		.rop = rop,
+		.cmd = VIVS_DE_DEST_CONFIG_COMMAND_BIT_BLT,
+		.brush = TRUE,
+		.fg_colour = mask,
+	};
+
+	if (!etnaviv_map_gpu(etnaviv, vDst, GPU_ACCESS_RW) ||
+	    !etnaviv_map_gpu(etnaviv, vSrc, GPU_ACCESS_RO))
+		return FALSE;
+
+	op.src = INIT_BLIT_PIX(vSrc, vSrc->pict_format, src_offset);
+	op.dst = INIT_BLIT_PIX(vDst, vDst->pict_format, dst_offset);
+
+	etnaviv_batch_start(etnaviv, &op);
+	etnaviv_de_op(etnaviv, &op, pBox, nBox);
+	etnaviv_de_end(etnaviv);
+
+	return TRUE;
+}
+
+/*
+ * Combine the colour channels of the source with the alpha channel of
+ * its alpha map into the ARGB temporary.  The brush is used as a channel
+ * mask for the ROP: first, the alpha channel is copied from the alpha
+ * map (S & P), and then the colour channels are merged in (D | (S & P)).
+ */
+static Bool etnaviv_merge_alpha_map(struct etnaviv *etnaviv,
+	RegionPtr region, struct etnaviv_pixmap *vTemp,
+	struct etnaviv_pixmap *vSrc, xPoint src_offset,
+	struct etnaviv_pixmap *vAlpha, xPoint alpha_offset,
+	xPoint temp_offset)
+{
+	return etnaviv_blit_masked(etnaviv, RegionExtents(region), 0xc0,
+				   0xff000000, vTemp, vAlpha,
+				   RegionRects(region), RegionNumRects(region),
+				   alpha_offset, temp_offset) &&
+	       etnaviv_blit_masked(etnaviv, RegionExtents(region), 0xea,
+				   0x00ffffff, vTemp, vSrc,
+				   RegionRects(region), RegionNumRects(region),
+				   src_offset, temp_offset);
+}
+
 /*
  * Acquire the source. If we're filling a solid surface, force it to have
  * alpha; it may be used in combination with a mask.  Otherwise, we ask
  * for the plain source format, with or without alpha, and convert later
  * when copying.  If force_vtemp is set, we ensure that the source is in
  * our temporary pixmap.
+ *
+ * The temporary pixmap only covers the extents of the composite region,
+ * with its origin at the top left of the extents, and only the boxes in
+ * the region are rendered into it.  On return, src_topleft is the offset
+ * to be added to composite-relative coordinates to locate the source.
  */
 static struct etnaviv_pixmap *etnaviv_acquire_src(ScreenPtr pScreen,
-	PicturePtr pict, const BoxRec *clip, PixmapPtr *ppPixTemp,
-	xPoint *src_topleft, Bool force_vtemp)
+	PicturePtr pict, RegionPtr region, const BoxRec *clip,
+	PixmapPtr *ppPixTemp, xPoint *src_topleft, Bool force_vtemp)
 {
 	struct etnaviv *etnaviv = etnaviv_get_screen_priv(pScreen);
-	struct etnaviv_pixmap *vSrc, *vTemp;
+	struct etnaviv_pixmap *vSrc, *vTemp, *vAlpha = NULL;
 	DrawablePtr drawable;
 	uint32_t colour;
-	xPoint src_offset;
-	int tx, ty;
+	xPoint src_offset, temp_offset, alpha_offset;
+	int tx, ty, w, h;
+
+	w = clip->x2 - clip->x1;
+	h = clip->y2 - clip->y1;
+
+	/* Offset from the region to the temporary pixmap coordinates */
+	temp_offset.x = -RegionExtents(region)->x1;
+	temp_offset.y = -RegionExtents(region)->y1;
 
 	if (etnaviv_pict_solid_argb(pict, &colour)) {
-		vTemp = etnaviv_get_scratch_argb(pScreen, ppPixTemp,
-						 clip->x2, clip->y2);
+		vTemp = etnaviv_get_scratch_argb(pScreen, ppPixTemp, w, h,
+						 TRUE);
 		if (!vTemp)
 			return NULL;
 
-		if (!etnaviv_fill_single(etnaviv, vTemp, clip, colour))
+		if (!etnaviv_fill_region(etnaviv, vTemp, region, temp_offset,
+					 colour))
 			return NULL;
 
-		src_topleft->x = 0;
-		src_topleft->y = 0;
-		return vTemp;
+		goto temp;
 	}
 
 	drawable = pict->pDrawable;
@@ -381,44 +541,66 @@ static struct etnaviv_pixmap *etnaviv_acquire_src(ScreenPtr pScreen,
 	if (!transform_is_integer_translation(pict->transform, &tx, &ty))
 		goto fallback;
 
-	if (picture_needs_repeat(pict, src_topleft->x + tx, src_topleft->y + ty,
-				 clip->x2, clip->y2))
+	if (picture_needs_repeat(pict, src_topleft->x + tx + clip->x1,
+				 src_topleft->y + ty + clip->y1, w, h))
 		goto fallback;
 
+	if (pict->alphaMap) {
+		alpha_offset.x = src_topleft->x + tx;
+		alpha_offset.y = src_topleft->y + ty;
+
+		vAlpha = etnaviv_acquire_alpha_map(etnaviv, pict, clip,
+						   &alpha_offset);
+		if (!vAlpha)
+			goto fallback;
+
+		alpha_offset.x += clip->x1;
+		alpha_offset.y += clip->y1;
+	}
+
 	src_topleft->x += drawable->x + src_offset.x + tx;
 	src_topleft->y += drawable->y + src_offset.y + ty;
-	if (force_vtemp)
+	if (force_vtemp || vAlpha)
 		goto copy_to_vtemp;
 
 	return vSrc;
 
 fallback:
-	vTemp = etnaviv_get_scratch_argb(pScreen, ppPixTemp,
-					 clip->x2, clip->y2);
+	vTemp = etnaviv_get_scratch_argb(pScreen, ppPixTemp, w, h, FALSE);
 	if (!vTemp)
 		return NULL;
 
 	if (!etnaviv_composite_to_pixmap(PictOpSrc, pict, NULL, *ppPixTemp,
-					 src_topleft->x, src_topleft->y,
-					 0, 0, clip->x2, clip->y2))
+					 src_topleft->x + clip->x1,
+					 src_topleft->y + clip->y1,
+					 0, 0, w, h))
 		return NULL;
 
-	src_topleft->x = 0;
-	src_topleft->y = 0;
-	return vTemp;
+	goto temp;
 
 copy_to_vtemp:
-	vTemp = etnaviv_get_scratch_argb(pScreen, ppPixTemp,
-					 clip->x2, clip->y2);
+	vTemp = etnaviv_get_scratch_argb(pScreen, ppPixTemp, w, h, TRUE);
 	if (!vTemp)
 		return NULL;
 
-	if (!etnaviv_blend(etnaviv, clip, NULL, vTemp, vSrc, clip, 1,
-			   *src_topleft, ZERO_OFFSET))
+	src_topleft->x += clip->x1;
+	src_topleft->y += clip->y1;
+
+	if (vAlpha) {
+		if (!etnaviv_merge_alpha_map(etnaviv, region, vTemp, vSrc,
+					     *src_topleft, vAlpha, alpha_offset,
+					     temp_offset))
+			return NULL;
+	} else if (!etnaviv_blend(etnaviv, RegionExtents(region), NULL,
+				  vTemp, vSrc, RegionRects(region),
+				  RegionNumRects(region), *src_topleft,
+				  temp_offset)) {
 		return NULL;
+	}
 
-	src_topleft->x = 0;
-	src_topleft->y = 0;
+temp:
+	src_topleft->x = -clip->x1;
+	src_topleft->y = -clip->y1;
 	return vTemp;
 }
 
@@ -515,14 +697,38 @@ static int etnaviv_accel_composite_srconly(PicturePtr pSrc, PicturePtr pDst,
 	struct etnaviv_pixmap *vDst, *vSrc;
 	BoxRec clip_temp;
 	xPoint src_topleft, dst_offset;
-
-	if (pSrc->alphaMap)
-		return FALSE;
+	uint32_t colour;
 
 	/* If the source has no drawable, and is not solid, fallback */
 	if (!pSrc->pDrawable && !picture_is_solid(pSrc, NULL))
 		return FALSE;
 
+	/*
+	 * PE2.0 takes the brush colour as ARGB, and will feed it into
+	 * the blend in place of the source pixels.  A solid source can
+	 * therefore be blended without first filling a temporary pixmap.
+	 * The source alpha is supplied via the global source alpha to
+	 * avoid depending on how the pattern alpha reaches the blender.
+	 */
+	if (VIV_FEATURE(etnaviv->conn, chipMinorFeatures0, 2DPE20) &&
+	    etnaviv_pict_solid_argb(pSrc, &colour)) {
+		vDst = etnaviv_drawable_offset(pDst->pDrawable, &dst_offset);
+
+		if (!etnaviv_map_gpu(etnaviv, vDst, GPU_ACCESS_RW))
+			return FALSE;
+
+		etnaviv_blend_const_src_alpha(final_blend, colour >> 24);
+
+		final_op->src = INIT_BLIT_NULL;
+		final_op->dst = INIT_BLIT_PIX(vDst, vDst->pict_format, dst_offset);
+		final_op->src_origin_mode = SRC_ORIGIN_NONE;
+		final_op->rop = 0xf0;
+		final_op->brush = TRUE;
+		final_op->fg_colour = colour;
+
+		return TRUE;
+	}
+
 	src_topleft.x = xSrc;
 	src_topleft.y = ySrc;
 
@@ -546,8 +752,8 @@ static int etnaviv_accel_composite_srconly(PicturePtr pSrc, PicturePtr pDst,
 	 * and vSrc->pict_format describes its format, including whether the
 	 * alpha channel is valid.
 	 */
-	vSrc = etnaviv_acquire_src(pScreen, pSrc, &clip_temp, ppPixTemp,
-				   &src_topleft, FALSE);
+	vSrc = etnaviv_acquire_src(pScreen, pSrc, region, &clip_temp,
+				   ppPixTemp, &src_topleft, FALSE);
 	if (!vSrc)
 		return FALSE;
 
@@ -591,7 +797,9 @@ static int etnaviv_accel_composite_masked(PicturePtr pSrc, PicturePtr pMask,
 	struct etnaviv_pixmap *vDst, *vSrc, *vMask, *vTemp;
 	struct etnaviv_blend_op mask_op;
 	BoxRec clip_temp;
-	xPoint src_topleft, dst_offset, mask_offset;
+	xPoint src_topleft, dst_offset, mask_offset, mask_pix_offset;
+	xPoint temp_offset;
+	int w, h;
 
 	src_topleft.x = xSrc;
 	src_topleft.y = ySrc;
@@ -612,14 +820,16 @@ static int etnaviv_accel_composite_masked(PicturePtr pSrc, PicturePtr pMask,
 	clip_temp.x2 -= xDst;
 	clip_temp.y2 -= yDst;
 
-	/* Get a temporary pixmap. */
-	vTemp = etnaviv_get_scratch_argb(pScreen, ppPixTemp,
-					 clip_temp.x2, clip_temp.y2);
-	if (!vTemp)
-		return FALSE;
-
-	if (pSrc->alphaMap || pMask->alphaMap)
-		goto fallback;
+	/*
+	 * The temporary pixmap covers just the region extents.  Only
+	 * the boxes of the region are rendered into it.  It is created
+	 * by etnaviv_acquire_src(), or by the fallback below, which
+	 * knows that it will be written by the CPU.
+	 */
+	w = clip_temp.x2 - clip_temp.x1;
+	h = clip_temp.y2 - clip_temp.y1;
+	temp_offset.x = -RegionExtents(region)->x1;
+	temp_offset.y = -RegionExtents(region)->y1;
 
 	/* If the source has no drawable, and is not solid, fallback */
 	if (!pSrc->pDrawable && !picture_is_solid(pSrc, NULL))
@@ -650,25 +860,43 @@ static int etnaviv_accel_composite_masked(PicturePtr pSrc, PicturePtr pMask,
 		mask_offset.y += ty;
 
 		/* We don't handle mask repeats (yet) */
-		if (picture_needs_repeat(pMask, mask_offset.x, mask_offset.y,
-					 clip_temp.x2, clip_temp.y2))
+		if (picture_needs_repeat(pMask, mask_offset.x + clip_temp.x1,
+					 mask_offset.y + clip_temp.y1, w, h))
 			goto fallback;
-
-		mask_offset.x += pMask->pDrawable->x;
-		mask_offset.y += pMask->pDrawable->y;
 	} else {
 		goto fallback;
 	}
 
-	/*
-	 * Check whether the mask has a etna bo backing it.  If not,
-	 * fallback to software for the mask operation.
-	 */
-	vMask = etnaviv_drawable_offset(pMask->pDrawable, &mask_offset);
-	if (!vMask)
-		goto fallback;
+	if (pMask->alphaMap) {
+		/*
+		 * Only the alpha channel of a non-component alpha mask
+		 * is used, so the alpha map can be used as the mask.
+		 */
+		if (pMask->componentAlpha)
+			goto fallback;
 
-	etnaviv_set_format(vMask, pMask);
+		vMask = etnaviv_acquire_alpha_map(etnaviv, pMask, &clip_temp,
+						  &mask_offset);
+		if (!vMask)
+			goto fallback;
+	} else {
+		/*
+		 * Check whether the mask has a etna bo backing it.  If
+		 * not, fallback to software for the mask operation.
+		 */
+		vMask = etnaviv_drawable_offset(pMask->pDrawable,
+						&mask_pix_offset);
+		if (!vMask)
+			goto fallback;
+
+		mask_offset.x += pMask->pDrawable->x + mask_pix_offset.x;
+		mask_offset.y += pMask->pDrawable->y + mask_pix_offset.y;
+
+		etnaviv_set_format(vMask, pMask);
+	}
+
+	mask_offset.x += clip_temp.x1;
+	mask_offset.y += clip_temp.y1;
 
 	/*
 	 * Get the source.  The source image will be described by vSrc with
@@ -676,8 +904,8 @@ static int etnaviv_accel_composite_masked(PicturePtr pSrc, PicturePtr pMask,
 	 * which will always have alpha - which is required for the final
 	 * blend.
 	 */
-	vSrc = etnaviv_acquire_src(pScreen, pSrc, &clip_temp, ppPixTemp,
-				   &src_topleft, TRUE);
+	vSrc = etnaviv_acquire_src(pScreen, pSrc, region, &clip_temp,
+				   ppPixTemp, &src_topleft, TRUE);
 	if (!vSrc)
 		goto fallback;
 
@@ -692,15 +920,16 @@ static int etnaviv_accel_composite_masked(PicturePtr pSrc, PicturePtr pMask,
 	 * Blend the source (in the temporary pixmap) with the mask
 	 * via a InReverse op.
 	 */
-	if (!etnaviv_blend(etnaviv, &clip_temp, &mask_op, vSrc, vMask,
-			   &clip_temp, 1, mask_offset, ZERO_OFFSET))
+	if (!etnaviv_blend(etnaviv, RegionExtents(region), &mask_op, vSrc,
+			   vMask, RegionRects(region), RegionNumRects(region),
+			   mask_offset, temp_offset))
 		return FALSE;
 
 finish:
 	vDst = etnaviv_drawable_offset(pDst->pDrawable, &dst_offset);
 
-	src_topleft.x = -(xDst + dst_offset.x);
-	src_topleft.y = -(yDst + dst_offset.y);
+	src_topleft.x = temp_offset.x - dst_offset.x;
+	src_topleft.y = temp_offset.y - dst_offset.y;
 
 	if (!etnaviv_map_gpu(etnaviv, vDst, GPU_ACCESS_RW) ||
 	    !etnaviv_map_gpu(etnaviv, vSrc, GPU_ACCESS_RO))
@@ -712,10 +941,15 @@ finish:
 	return TRUE;
 
 fallback:
+	vTemp = etnaviv_get_scratch_argb(pScreen, ppPixTemp, w, h, FALSE);
+	if (!vTemp)
+		return FALSE;
+
 	/* Do the (src IN mask) in software instead */
 	if (!etnaviv_composite_to_pixmap(PictOpSrc, pSrc, pMask, *ppPixTemp,
-					 xSrc, ySrc, xMask, yMask,
-					 clip_temp.x2, clip_temp.y2))
+					 xSrc + clip_temp.x1, ySrc + clip_temp.y1,
+					 xMask + clip_temp.x1, yMask + clip_temp.y1,
+					 w, h))
 		return FALSE;
 
 	vSrc = vTemp;
@@ -794,6 +1028,112 @@ static Bool etnaviv_accel_reduce_mask(struct etnaviv_blend_op *final_blend,
 	return FALSE;
 }
 
+static Bool etnaviv_blit_buf_equal(const struct etnaviv_blit_buf *a,
+	const struct etnaviv_blit_buf *b)
+{
+	return a->bo == b->bo && a->pitch == b->pitch &&
+	       a->offset.x == b->offset.x && a->offset.y == b->offset.y &&
+	       a->format.format == b->format.format &&
+	       a->format.swizzle == b->format.swizzle &&
+	       a->format.tile == b->format.tile;
+}
+
+/*
+ * Two composite operations can be merged if they only differ in the
+ * rectangles to be drawn.  The clip is not compared: each operation's
+ * rectangles already lie within its own clip.
+ */
+static Bool etnaviv_composite_compatible(struct etnaviv *etnaviv,
+	const struct etnaviv_de_op *op)
+{
+	const struct etnaviv_de_op *q = &etnaviv->composite_op;
+	const struct etnaviv_blend_op *b = &etnaviv->composite_blend;
+
+	return etnaviv_blit_buf_equal(&q->dst, &op->dst) &&
+	       etnaviv_blit_buf_equal(&q->src, &op->src) &&
+	       q->src_origin_mode == op->src_origin_mode &&
+	       q->rop == op->rop && q->cmd == op->cmd &&
+	       q->brush == op->brush &&
+	       (!op->brush || q->fg_colour == op->fg_colour) &&
+	       b->alpha_mode == op->blend_op->alpha_mode &&
+	       b->src_alpha == op->blend_op->src_alpha &&
+	       b->dst_alpha == op->blend_op->dst_alpha;
+}
+
+/*
+ * Emit any deferred composite operation into the command stream.  This
+ * must be called before any other GPU operation is emitted, and before
+ * the command stream is submitted.
+ */
+void etnaviv_render_flush(struct etnaviv *etnaviv)
+{
+	unsigned nbox = etnaviv->composite_nbox;
+
+	if (nbox) {
+		unsigned int stat_op;
+
+		/* Prevent recursion via etnaviv_batch_start() */
+		etnaviv->composite_nbox = 0;
+
+		stat_op = etnaviv_stats_set_op(etnaviv, STAT_COMPOSITE);
+		etnaviv_batch_start(etnaviv, &etnaviv->composite_op);
+		etnaviv_de_op(etnaviv, &etnaviv->composite_op,
+			      etnaviv->composite_box, nbox);
+		etnaviv_de_end(etnaviv);
+		etnaviv_stats_set_op(etnaviv, stat_op);
+	}
+}
+
+/*
+ * Toolkits tend to issue long runs of small composite operations with
+ * the same source, destination and operator.  Rather than emitting each
+ * one with its own state setup and flush, accumulate the rectangles of
+ * compatible operations and emit them as a single DE operation.
+ *
+ * The pixmaps are added to the batch immediately, so that any CPU
+ * access or commit will flush the deferred operation first.
+ */
+static void etnaviv_composite_queue(struct etnaviv *etnaviv,
+	const struct etnaviv_de_op *op, const BoxRec *pBox, unsigned nBox)
+{
+	unsigned n = etnaviv->composite_nbox;
+
+	if (n && (n + nBox > ARRAY_SIZE(etnaviv->composite_box) ||
+		  !etnaviv_composite_compatible(etnaviv, op))) {
+		etnaviv_render_flush(etnaviv);
+		n = 0;
+	}
+
+	if (nBox > ARRAY_SIZE(etnaviv->composite_box)) {
+		etnaviv_batch_start(etnaviv, op);
+		etnaviv_de_op(etnaviv, op, pBox, nBox);
+		etnaviv_de_end(etnaviv);
+		return;
+	}
+
+	if (n == 0) {
+		etnaviv->composite_op = *op;
+		etnaviv->composite_blend = *op->blend_op;
+		etnaviv->composite_clip = *op->clip;
+		etnaviv->composite_op.blend_op = &etnaviv->composite_blend;
+		etnaviv->composite_op.clip = &etnaviv->composite_clip;
+
+		if (op->src.pixmap)
+			etnaviv_batch_add(etnaviv, op->src.pixmap);
+		etnaviv_batch_add(etnaviv, op->dst.pixmap);
+	} else {
+		BoxPtr clip = &etnaviv->composite_clip;
+
+		clip->x1 = mint(clip->x1, op->clip->x1);
+		clip->y1 = mint(clip->y1, op->clip->y1);
+		clip->x2 = maxt(clip->x2, op->clip->x2);
+		clip->y2 = maxt(clip->y2, op->clip->y2);
+	}
+
+	memcpy(&etnaviv->composite_box[n], pBox, nBox * sizeof(*pBox));
+	etnaviv->composite_nbox = n + nBox;
+}
+
 /*
  * A composite operation is: (pSrc IN pMask) OP pDst.  We always try
  * to perform an on-GPU "OP" where possible, which is handled by the
@@ -821,23 +1161,31 @@ static int etnaviv_accel_Composite(CARD8 op, PicturePtr pSrc, PicturePtr pMask,
 #endif
 
 	/* If the destination has an alpha map, fallback */
-	if (pDst->alphaMap)
+	if (pDst->alphaMap) {
+		etnaviv_stats_reason(etnaviv, FB_ALPHAMAP);
 		return FALSE;
+	}
 
 	/* If we can't do the op, there's no point going any further */
-	if (op >= ARRAY_SIZE(etnaviv_composite_op))
+	if (op >= ARRAY_SIZE(etnaviv_composite_op)) {
+		etnaviv_stats_reason(etnaviv, FB_OP);
 		return FALSE;
+	}
 
 	/* The destination pixmap must have a bo */
 	vDst = etnaviv_drawable(pDst->pDrawable);
-	if (!vDst)
+	if (!vDst) {
+		etnaviv_stats_reason(etnaviv, FB_DRAWABLE);
 		return FALSE;
+	}
 
 	etnaviv_set_format(vDst, pDst);
 
 	/* ... and the destination format must be supported */
-	if (!etnaviv_dst_format_valid(etnaviv, vDst->pict_format))
+	if (!etnaviv_dst_format_valid(etnaviv, vDst->pict_format)) {
+		etnaviv_stats_reason(etnaviv, FB_FORMAT);
 		return FALSE;
+	}
 
 	final_blend = etnaviv_composite_op[op];
 
@@ -880,6 +1228,15 @@ static int etnaviv_accel_Composite(CARD8 op, PicturePtr pSrc, PicturePtr pMask,
 	if (pMask)
 		miCompositeSourceValidate(pMask);
 
+	/*
+	 * Default to a source copy for the final operation; the
+	 * sub-functions may override this, eg, for a solid source.
+	 */
+	final_op.src_origin_mode = SRC_ORIGIN_RELATIVE;
+	final_op.rop = 0xcc;
+	final_op.cmd = VIVS_DE_DEST_CONFIG_COMMAND_BIT_BLT;
+	final_op.brush = FALSE;
+
 	if (op == PictOpClear) {
 		/* Short-circuit for PictOpClear */
 		rc = etnaviv_Composite_Clear(pDst, &final_op);
@@ -911,23 +1268,20 @@ static int etnaviv_accel_Composite(CARD8 op, PicturePtr pSrc, PicturePtr pMask,
 	if (rc) {
 		final_op.clip = RegionExtents(&region);
 		final_op.blend_op = &final_blend;
-		final_op.src_origin_mode = SRC_ORIGIN_RELATIVE;
-		final_op.rop = 0xcc;
-		final_op.cmd = VIVS_DE_DEST_CONFIG_COMMAND_BIT_BLT;
-		final_op.brush = FALSE;
 
 #ifdef DEBUG_BLEND
-		etnaviv_batch_wait_commit(etnaviv, final_op.src.pixmap);
-		dump_vPix(etnaviv, final_op.src.pixmap, 1,
-			  "A-FSRC%2.2x-%p", op, pSrc);
+		if (final_op.src.pixmap) {
+			etnaviv_batch_wait_commit(etnaviv, final_op.src.pixmap);
+			dump_vPix(etnaviv, final_op.src.pixmap, 1,
+				  "A-FSRC%2.2x-%p", op, pSrc);
+		}
 		dump_vPix(etnaviv, final_op.dst.pixmap, 1,
 			  "A-FDST%2.2x-%p", op, pDst);
 #endif
 
-		etnaviv_batch_start(etnaviv, &final_op);
-		etnaviv_de_op(etnaviv, &final_op, RegionRects(&region),
-			      RegionNumRects(&region));
-		etnaviv_de_end(etnaviv);
+		etnaviv_composite_queue(etnaviv, &final_op,
+					RegionRects(&region),
+					RegionNumRects(&region));
 
 #ifdef DEBUG_BLEND
 		etnaviv_batch_wait_commit(etnaviv, final_op.dst.pixmap);
@@ -1153,21 +1507,206 @@ static void etnaviv_accel_glyph_upload(ScreenPtr pScreen, PicturePtr pDst,
 	etnaviv_de_end(etnaviv);
 }
 
+/*
+ * Create a cleared A8 mask picture covering bounds, and a pixman image
+ * through which the CPU can rasterise into it.  Only the mask is mapped
+ * for CPU access; the destination remains with the GPU.
+ */
+static PicturePtr etnaviv_mask_start(ScreenPtr pScreen,
+	PictFormatPtr maskFormat, const BoxRec *bounds, pixman_image_t **image)
+{
+	int width = bounds->x2 - bounds->x1;
+	int height = bounds->y2 - bounds->y1;
+	PixmapPtr pixmap;
+	PicturePtr pict;
+	uint8_t *ptr;
+	int error, y;
+
+	pixmap = etnaviv_mask_pool_get(pScreen, width, height);
+	if (!pixmap)
+		return NULL;
+
+	pict = CreatePicture(0, &pixmap->drawable, maskFormat, 0, 0,
+			     serverClient, &error);
+	pScreen->DestroyPixmap(pixmap);
+	if (!pict)
+		return NULL;
+
+	prepare_cpu_drawable(&pixmap->drawable, CPU_ACCESS_RW);
+
+	ptr = pixmap->devPrivate.ptr;
+	for (y = 0; y < height; y++, ptr += pixmap->devKind)
+		memset(ptr, 0, width);
+
+	*image = pixman_image_create_bits(PIXMAN_a8, width, height,
+					  pixmap->devPrivate.ptr,
+					  pixmap->devKind);
+	if (!*image) {
+		finish_cpu_drawable(&pixmap->drawable, CPU_ACCESS_RW);
+		FreePicture(pict, 0);
+		return NULL;
+	}
+
+	return pict;
+}
+
+static void etnaviv_mask_finish(PicturePtr pict, pixman_image_t *image)
+{
+	pixman_image_unref(image);
+	finish_cpu_drawable(pict->pDrawable, CPU_ACCESS_RW);
+}
+
+/*
+ * Trapezoids and triangles are both rasterised by pixman into an A8
+ * mask covering their bounds, which is then composited onto the
+ * destination.  The parts which depend on the shape are described by
+ * one of these.
+ */
+struct etnaviv_shapes {
+	enum etnaviv_stat_op stat;
+	size_t size;
+	void (*bounds)(int n, void *shapes, BoxPtr bounds);
+	void (*origin)(void *shapes, INT16 *x, INT16 *y);
+	void (*rasterize)(pixman_image_t *image, int x, int y, int n,
+		void *shapes);
+	void (*fallback)(CARD8 op, PicturePtr pSrc, PicturePtr pDst,
+		PictFormatPtr maskFormat, INT16 xSrc, INT16 ySrc, int n,
+		void *shapes);
+};
+
+static void etnaviv_trap_bounds(int n, void *shapes, BoxPtr bounds)
+{
+	miTrapezoidBounds(n, shapes, bounds);
+}
+
+static void etnaviv_trap_origin(void *shapes, INT16 *x, INT16 *y)
+{
+	xTrapezoid *trap = shapes;
+
+	*x = trap->left.p1.x >> 16;
+	*y = trap->left.p1.y >> 16;
+}
+
+static void etnaviv_trap_rasterize(pixman_image_t *image, int x, int y,
+	int n, void *shapes)
+{
+	xTrapezoid *traps = shapes;
+	int i;
+
+	for (i = 0; i < n; i++)
+		pixman_rasterize_trapezoid(image,
+					   (pixman_trapezoid_t *)&traps[i],
+					   x, y);
+}
+
+static void etnaviv_trap_fallback(CARD8 op, PicturePtr pSrc,
+	PicturePtr pDst, PictFormatPtr maskFormat, INT16 xSrc, INT16 ySrc,
+	int n, void *shapes)
+{
+	unaccel_Trapezoids(op, pSrc, pDst, maskFormat, xSrc, ySrc, n, shapes);
+}
+
+static const struct etnaviv_shapes etnaviv_trapezoids = {
+	.stat = STAT_TRAPEZOIDS,
+	.size = sizeof(xTrapezoid),
+	.bounds = etnaviv_trap_bounds,
+	.origin = etnaviv_trap_origin,
+	.rasterize = etnaviv_trap_rasterize,
+	.fallback = etnaviv_trap_fallback,
+};
+
+static void etnaviv_tri_bounds(int n, void *shapes, BoxPtr bounds)
+{
+	miTriangleBounds(n, shapes, bounds);
+}
+
+static void etnaviv_tri_origin(void *shapes, INT16 *x, INT16 *y)
+{
+	xTriangle *tri = shapes;
+
+	*x = tri->p1.x >> 16;
+	*y = tri->p1.y >> 16;
+}
+
+static void etnaviv_tri_rasterize(pixman_image_t *image, int x, int y,
+	int n, void *shapes)
+{
+	pixman_add_triangles(image, x, y, n, (pixman_triangle_t *)shapes);
+}
+
+static void etnaviv_tri_fallback(CARD8 op, PicturePtr pSrc,
+	PicturePtr pDst, PictFormatPtr maskFormat, INT16 xSrc, INT16 ySrc,
+	int n, void *shapes)
+{
+	unaccel_Triangles(op, pSrc, pDst, maskFormat, xSrc, ySrc, n, shapes);
+}
+
+static const struct etnaviv_shapes etnaviv_triangles = {
+	.stat = STAT_TRIANGLES,
+	.size = sizeof(xTriangle),
+	.bounds = etnaviv_tri_bounds,
+	.origin = etnaviv_tri_origin,
+	.rasterize = etnaviv_tri_rasterize,
+	.fallback = etnaviv_tri_fallback,
+};
+
+static Bool etnaviv_accel_shapes(const struct etnaviv_shapes *shape,
+	CARD8 op, PicturePtr pSrc, PicturePtr pDst, PictFormatPtr maskFormat,
+	INT16 xSrc, INT16 ySrc, int n, void *shapes)
+{
+	ScreenPtr pScreen = pDst->pDrawable->pScreen;
+	pixman_image_t *image;
+	PicturePtr pMask;
+	BoxRec bounds;
+	INT16 xDst, yDst;
+
+	if (!maskFormat || maskFormat->format != PICT_a8)
+		return FALSE;
+
+	shape->bounds(n, shapes, &bounds);
+	if (bounds.y1 >= bounds.y2 || bounds.x1 >= bounds.x2)
+		return TRUE;
+
+	shape->origin(shapes, &xDst, &yDst);
+
+	pMask = etnaviv_mask_start(pScreen, maskFormat, &bounds, &image);
+	if (!pMask)
+		return FALSE;
+
+	shape->rasterize(image, -bounds.x1, -bounds.y1, n, shapes);
+
+	etnaviv_mask_finish(pMask, image);
+
+	CompositePicture(op, pSrc, pMask, pDst,
+			 xSrc + bounds.x1 - xDst, ySrc + bounds.y1 - yDst,
+			 0, 0, bounds.x1, bounds.y1,
+			 bounds.x2 - bounds.x1, bounds.y2 - bounds.y1);
+
+	FreePicture(pMask, 0);
+
+	return TRUE;
+}
+
 static void
 etnaviv_Composite(CARD8 op, PicturePtr pSrc, PicturePtr pMask, PicturePtr pDst,
 	INT16 xSrc, INT16 ySrc, INT16 xMask, INT16 yMask, INT16 xDst, INT16 yDst,
 	CARD16 width, CARD16 height)
 {
 	struct etnaviv *etnaviv = etnaviv_get_screen_priv(pDst->pDrawable->pScreen);
+	struct etnaviv_stat_mark mark;
 	Bool ret;
 
+	mark = etnaviv_stats_start(etnaviv, STAT_COMPOSITE);
 	if (!etnaviv->force_fallback) {
 		ret = etnaviv_accel_Composite(op, pSrc, pMask, pDst,
 					      xSrc, ySrc, xMask, yMask,
 					      xDst, yDst, width, height);
-		if (ret)
+		if (ret) {
+			etnaviv_stats_end(etnaviv, mark, TRUE);
 			return;
+		}
 	}
+	etnaviv_stats_end(etnaviv, mark, FALSE);
 	unaccel_Composite(op, pSrc, pMask, pDst, xSrc, ySrc,
 			  xMask, yMask, xDst, yDst, width, height);
 }
@@ -1177,12 +1716,70 @@ static void etnaviv_Glyphs(CARD8 op, PicturePtr pSrc, PicturePtr pDst,
 	GlyphListPtr list, GlyphPtr * glyphs)
 {
 	struct etnaviv *etnaviv = etnaviv_get_screen_priv(pDst->pDrawable->pScreen);
+	struct etnaviv_stat_mark mark;
 
+	mark = etnaviv_stats_start(etnaviv, STAT_GLYPHS);
 	if (etnaviv->force_fallback ||
 	    !etnaviv_accel_Glyphs(op, pSrc, pDst, maskFormat,
-				  xSrc, ySrc, nlist, list, glyphs))
+				  xSrc, ySrc, nlist, list, glyphs)) {
+		etnaviv_stats_end(etnaviv, mark, FALSE);
 		unaccel_Glyphs(op, pSrc, pDst, maskFormat,
 			       xSrc, ySrc, nlist, list, glyphs);
+	} else {
+		etnaviv_stats_end(etnaviv, mark, TRUE);
+	}
+}
+
+static void etnaviv_shapes(const struct etnaviv_shapes *shape, CARD8 op,
+	PicturePtr pSrc, PicturePtr pDst, PictFormatPtr maskFormat,
+	INT16 xSrc, INT16 ySrc, int n, void *shapes)
+{
+	ScreenPtr pScreen = pDst->pDrawable->pScreen;
+	struct etnaviv *etnaviv = etnaviv_get_screen_priv(pScreen);
+	struct etnaviv_stat_mark mark;
+
+	/*
+	 * Without a mask format, each shape is composited separately
+	 * with an A8 mask, as miTrapezoids() and miTriangles() do.
+	 */
+	if (!etnaviv->force_fallback && !maskFormat &&
+	    pDst->polyEdge == PolyEdgeSmooth) {
+		PictFormatPtr a8 = PictureMatchFormat(pScreen, 8, PICT_a8);
+
+		if (a8) {
+			for (; n; n--, shapes = (char *)shapes + shape->size)
+				etnaviv_shapes(shape, op, pSrc, pDst, a8,
+					       xSrc, ySrc, 1, shapes);
+			return;
+		}
+	}
+
+	mark = etnaviv_stats_start(etnaviv, shape->stat);
+	if (etnaviv->force_fallback ||
+	    !etnaviv_accel_shapes(shape, op, pSrc, pDst, maskFormat,
+				  xSrc, ySrc, n, shapes)) {
+		etnaviv_stats_end(etnaviv, mark, FALSE);
+		shape->fallback(op, pSrc, pDst, maskFormat,
+				xSrc, ySrc, n, shapes);
+	} else {
+		etnaviv_stats_end(etnaviv, mark, TRUE);
+	}
+}
+
+static void etnaviv_Trapezoids(CARD8 op, PicturePtr pSrc, PicturePtr pDst,
+	PictFormatPtr maskFormat, INT16 xSrc, INT16 ySrc, int ntrap,
+	xTrapezoid *traps)
+{
+	etnaviv_shapes(&etnaviv_trapezoids, op, pSrc, pDst, maskFormat,
+		       xSrc, ySrc, ntrap, traps);
+}
+
+static void etnaviv_Triangles(CARD8 op, PicturePtr pSrc, PicturePtr pDst,
+	PictFormatPtr maskFormat, INT16 xSrc, INT16 ySrc, int ntri,
+	xTriangle *tris)
+{
+	etnaviv_shapes(&etnaviv_triangles, op, pSrc, pDst, maskFormat,
+		       xSrc, ySrc, ntri, tris);
 }
 
 static const unsigned glyph_formats[] = {
@@ -1238,9 +1835,9 @@ void etnaviv_render_screen_init(ScreenPtr pScreen)
 	ps->Glyphs = etnaviv_Glyphs;
 	etnaviv->UnrealizeGlyph = ps->UnrealizeGlyph;
 	etnaviv->Triangles = ps->Triangles;
-	ps->Triangles = unaccel_Triangles;
+	ps->Triangles = etnaviv_Triangles;
 	etnaviv->Trapezoids = ps->Trapezoids;
-	ps->Trapezoids = unaccel_Trapezoids;
+	ps->Trapezoids = etnaviv_Trapezoids;
 	etnaviv->AddTriangles = ps->AddTriangles;
 	ps->AddTriangles = unaccel_AddTriangles;
 	etnaviv->AddTraps = ps->AddTraps;
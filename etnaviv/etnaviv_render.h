@@ -10,14 +10,21 @@
 #include "dix-config.h"
 #endif
 
+struct etnaviv;
+
 #ifdef RENDER
 #include "mipict.h"
 
 #include "etnaviv_op.h"
 
+void etnaviv_render_flush(struct etnaviv *etnaviv);
 void etnaviv_render_screen_init(ScreenPtr);
 void etnaviv_render_close_screen(ScreenPtr);
 #else
+static inline void etnaviv_render_flush(struct etnaviv *etnaviv)
+{
+}
+
 static inline void etnaviv_render_screen_init(ScreenPtr pScreen)
 {
 }
@@ -0,0 +1,148 @@
+/*
+ * Vivante GPU Acceleration Xorg driver
+ *
+ * Accelerated operation statistics.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <signal.h>
+#include <stdlib.h>
+
+#include "xf86.h"
+
+#include "etnaviv_accel.h"
+#include "etnaviv_stats.h"
+
+static const char *etnaviv_stat_op_names[STAT_NR_OPS] = {
+	[STAT_OTHER]		= "Other",
+	[STAT_FILLSPANS]	= "FillSpans",
+	[STAT_PUTIMAGE]		= "PutImage",
+	[STAT_SHMPUTIMAGE]	= "ShmPutImage",
+	[STAT_GETIMAGE]		= "GetImage",
+	[STAT_COPYNTON]		= "CopyNtoN",
+	[STAT_POLYPOINT]	= "PolyPoint",
+	[STAT_POLYLINES]	= "PolyLines",
+	[STAT_POLYSEGMENT]	= "PolySegment",
+	[STAT_POLYFILLRECT]	= "PolyFillRect",
+	[STAT_POLYARC]		= "PolyArc",
+	[STAT_FILLPOLYGON]	= "FillPolygon",
+	[STAT_POLYFILLARC]	= "PolyFillArc",
+	[STAT_IMAGEGLYPHBLT]	= "ImageGlyphBlt",
+	[STAT_POLYGLYPHBLT]	= "PolyGlyphBlt",
+	[STAT_PUSHPIXELS]	= "PushPixels",
+	[STAT_COMPOSITE]	= "Composite",
+	[STAT_GLYPHS]		= "Glyphs",
+	[STAT_TRAPEZOIDS]	= "Trapezoids",
+	[STAT_TRIANGLES]	= "Triangles",
+	[STAT_CREATEPIXMAP]	= "CreatePixmap",
+	[STAT_XV]		= "XvPutImage",
+};
+
+static const char *etnaviv_stat_reason_names[FB_NR_REASONS] = {
+	[FB_OTHER]		= "other",
+	[FB_FORCED]		= "forced",
+	[FB_GC]			= "gc",
+	[FB_DRAWABLE]		= "drawable",
+	[FB_FORMAT]		= "format",
+	[FB_MAP]		= "map",
+	[FB_ALLOC]		= "alloc",
+	[FB_GEOMETRY]		= "geometry",
+	[FB_TRANSFORM]		= "transform",
+	[FB_REPEAT]		= "repeat",
+	[FB_ALPHAMAP]		= "alphamap",
+	[FB_OP]			= "op",
+};
+
+/*
+ * Dump requests are signalled asynchronously, and picked up by each
+ * screen from its block handler.
+ */
+static volatile sig_atomic_t etnaviv_stats_dump_seq;
+static unsigned int etnaviv_stats_users;
+static OsSigHandlerPtr etnaviv_stats_old_handler;
+
+static void etnaviv_stats_signal(int sig)
+{
+	etnaviv_stats_dump_seq++;
+}
+
+struct etnaviv_stats *etnaviv_stats_alloc(void)
+{
+	struct etnaviv_stats *stats;
+
+	stats = calloc(1, sizeof *stats);
+	if (!stats)
+		return NULL;
+
+	if (etnaviv_stats_users++ == 0)
+		etnaviv_stats_old_handler = OsSignal(SIGUSR2,
+						     etnaviv_stats_signal);
+
+	stats->dump_seq = etnaviv_stats_dump_seq;
+
+	return stats;
+}
+
+void etnaviv_stats_free(struct etnaviv_stats *stats)
+{
+	if (!stats)
+		return;
+
+	if (--etnaviv_stats_users == 0)
+		OsSignal(SIGUSR2, etnaviv_stats_old_handler);
+
+	free(stats);
+}
+
+void etnaviv_stats_dump(struct etnaviv *etnaviv)
+{
+	struct etnaviv_stats *stats = etnaviv->stats;
+	unsigned int i, j;
+
+	if (!stats)
+		return;
+
+	xf86DrvMsg(etnaviv->scrnIndex, X_INFO,
+		   "%-12s %10s %10s %10s %12s %10s\n", "operation",
+		   "accel", "fallback", "boxes", "bytes", "usec");
+
+	for (i = 0; i < STAT_NR_OPS; i++) {
+		struct etnaviv_stat *stat = &stats->stat[i];
+		uint64_t fallback = 0;
+
+		for (j = 0; j < FB_NR_REASONS; j++)
+			fallback += stat->fallback[j];
+
+		if (!stat->accel && !fallback && !stat->boxes)
+			continue;
+
+		xf86DrvMsg(etnaviv->scrnIndex, X_INFO,
+			   "%-12s %10llu %10llu %10llu %12llu %10llu\n",
+			   etnaviv_stat_op_names[i],
+			   (unsigned long long)stat->accel,
+			   (unsigned long long)fallback,
+			   (unsigned long long)stat->boxes,
+			   (unsigned long long)stat->bytes,
+			   (unsigned long long)(stat->ns / 1000));
+
+		for (j = 0; j < FB_NR_REASONS; j++)
+			if (stat->fallback[j])
+				xf86DrvMsg(etnaviv->scrnIndex, X_INFO,
+					   "  fallback %-10s %10llu\n",
+					   etnaviv_stat_reason_names[j],
+					   (unsigned long long)stat->fallback[j]);
+	}
+}
+
+void etnaviv_stats_block_handler(struct etnaviv *etnaviv)
+{
+	struct etnaviv_stats *stats = etnaviv->stats;
+	unsigned int seq = etnaviv_stats_dump_seq;
+
+	if (stats && stats->dump_seq != seq) {
+		stats->dump_seq = seq;
+		etnaviv_stats_dump(etnaviv);
+	}
+}
@@ -0,0 +1,168 @@
+#ifndef ETNAVIV_STATS_H
+#define ETNAVIV_STATS_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include "etnaviv_accel.h"
+
+/*
+ * Per-screen accelerated operation statistics, enabled with the
+ * "AccelStats" option.  When disabled, each hook is a single test of
+ * etnaviv->stats.  The statistics are written to the log when the
+ * server receives SIGUSR2, and when the screen is closed.
+ */
+enum etnaviv_stat_op {
+	STAT_OTHER,
+	STAT_FILLSPANS,
+	STAT_PUTIMAGE,
+	STAT_SHMPUTIMAGE,
+	STAT_GETIMAGE,
+	STAT_COPYNTON,
+	STAT_POLYPOINT,
+	STAT_POLYLINES,
+	STAT_POLYSEGMENT,
+	STAT_POLYFILLRECT,
+	STAT_POLYARC,
+	STAT_FILLPOLYGON,
+	STAT_POLYFILLARC,
+	STAT_IMAGEGLYPHBLT,
+	STAT_POLYGLYPHBLT,
+	STAT_PUSHPIXELS,
+	STAT_COMPOSITE,
+	STAT_GLYPHS,
+	STAT_TRAPEZOIDS,
+	STAT_TRIANGLES,
+	STAT_CREATEPIXMAP,
+	STAT_XV,
+	STAT_NR_OPS
+};
+
+enum etnaviv_stat_reason {
+	FB_OTHER,
+	FB_FORCED,	/* force_fallback is set */
+	FB_GC,		/* unsupported GC state */
+	FB_DRAWABLE,	/* drawable is not GPU backed */
+	FB_FORMAT,	/* unsupported pixel or picture format */
+	FB_MAP,		/* unable to map for GPU access */
+	FB_ALLOC,	/* unable to allocate memory or a buffer */
+	FB_GEOMETRY,	/* unsupported shape or size */
+	FB_TRANSFORM,	/* non-integer picture transform */
+	FB_REPEAT,	/* picture repeat required */
+	FB_ALPHAMAP,	/* unsupported alpha map */
+	FB_OP,		/* unsupported operator */
+	FB_NR_REASONS
+};
+
+struct etnaviv_stat {
+	uint64_t accel;
+	uint64_t fallback[FB_NR_REASONS];
+	uint64_t boxes;
+	uint64_t bytes;
+	uint64_t ns;
+};
+
+struct etnaviv_stats {
+	uint8_t op;
+	uint8_t reason;
+	unsigned int dump_seq;
+	struct etnaviv_stat stat[STAT_NR_OPS];
+};
+
+struct etnaviv_stat_mark {
+	uint64_t start;
+	uint8_t op;
+	uint8_t reason;
+};
+
+struct etnaviv_stats *etnaviv_stats_alloc(void);
+void etnaviv_stats_free(struct etnaviv_stats *stats);
+void etnaviv_stats_dump(struct etnaviv *etnaviv);
+void etnaviv_stats_block_handler(struct etnaviv *etnaviv);
+
+static inline uint64_t etnaviv_stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Mark the start of an accelerated entry point */
+static inline struct etnaviv_stat_mark etnaviv_stats_start(
+	struct etnaviv *etnaviv, unsigned int op)
+{
+	struct etnaviv_stats *stats = etnaviv->stats;
+	struct etnaviv_stat_mark mark = { 0, };
+
+	if (stats) {
+		mark.op = stats->op;
+		mark.reason = stats->reason;
+		mark.start = etnaviv_stats_now();
+		stats->op = op;
+		stats->reason = etnaviv->force_fallback ? FB_FORCED : FB_OTHER;
+	}
+
+	return mark;
+}
+
+/* Mark the end of an entry point, and whether it was accelerated */
+static inline void etnaviv_stats_end(struct etnaviv *etnaviv,
+	struct etnaviv_stat_mark mark, Bool accel)
+{
+	struct etnaviv_stats *stats = etnaviv->stats;
+
+	if (stats) {
+		struct etnaviv_stat *stat = &stats->stat[stats->op];
+
+		if (accel)
+			stat->accel++;
+		else
+			stat->fallback[stats->reason]++;
+		stat->ns += etnaviv_stats_now() - mark.start;
+		stats->op = mark.op;
+		stats->reason = mark.reason;
+	}
+}
+
+/* Record why the current operation is about to fall back */
+static inline void etnaviv_stats_reason(struct etnaviv *etnaviv,
+	unsigned int reason)
+{
+	if (etnaviv->stats)
+		etnaviv->stats->reason = reason;
+}
+
+/* Switch the operation to which emitted work is accounted */
+static inline unsigned int etnaviv_stats_set_op(struct etnaviv *etnaviv,
+	unsigned int op)
+{
+	struct etnaviv_stats *stats = etnaviv->stats;
+	unsigned int old = STAT_OTHER;
+
+	if (stats) {
+		old = stats->op;
+		stats->op = op;
+	}
+
+	return old;
+}
+
+static inline void etnaviv_stats_boxes(struct etnaviv *etnaviv, size_t n)
+{
+	struct etnaviv_stats *stats = etnaviv->stats;
+
+	if (stats)
+		stats->stat[stats->op].boxes += n;
+}
+
+static inline void etnaviv_stats_bytes(struct etnaviv *etnaviv, size_t n)
+{
+	struct etnaviv_stats *stats = etnaviv->stats;
+
+	if (stats)
+		stats->stat[stats->op].bytes += n;
+}
+
+#endif
@@ -115,6 +115,8 @@ Bool etnaviv_map_gpu(struct etnaviv *etnaviv, struct etnaviv_pixmap *vPix,
 	} else {
 		state = ST_GPU_R | ST_GPU_W;
 		mask = ST_CPU_R | ST_CPU_W | ST_GPU_R | ST_GPU_W;
+		vPix->generation++;
+		vPix->state |= ST_GPU_WRITTEN;
 	}
 
 	/* If the pixmap is already appropriately mapped, just return */
@@ -200,6 +202,15 @@ void prepare_cpu_drawable(DrawablePtr pDrawable, int access)
 	if (vPix) {
 		struct etnaviv *etnaviv = etnaviv_get_screen_priv(pDrawable->pScreen);
 
+		if (access == CPU_ACCESS_RW)
+			vPix->generation++;
+
+		/* The CPU can only make sense of a linear layout */
+		if (vPix->format.tile && !etnaviv_pixmap_detile(etnaviv, pixmap))
+			xf86DrvMsg(etnaviv->scrnIndex, X_ERROR,
+				   "etnaviv: failed to detile pixmap %p\n",
+				   pixmap);
+
 		/*
 		 * If the CPU is going to write to the pixmap, then we must
 		 * ensure that the GPU is not using it.  Otherwise, tolerate
@@ -13,7 +13,7 @@
 #include "config.h"
 #endif
 
-#include <sys/mman.h>
+#include <string.h>
 
 #include "xf86.h"
 #include "xf86Crtc.h"
@@ -34,6 +34,8 @@
 
 #include "etnaviv_accel.h"
 #include "etnaviv_op.h"
+#include "etnaviv_render.h"
+#include "etnaviv_stats.h"
 #include "etnaviv_utils.h"
 #include "etnaviv_xv.h"
 
@@ -47,6 +49,13 @@
 #define ETNAVIV_XV_MAX_WIDTH  4096
 #define ETNAVIV_XV_MAX_HEIGHT 4096
 
+/*
+ * Number of staging buffers per port.  Client images are copied into
+ * these so that the frame can be processed by the GPU while the X
+ * server gets on with other work.
+ */
+#define ETNAVIV_XV_RING_SIZE 3
+
 static XF86VideoEncodingRec etnaviv_encodings[] = {
 	{
 		.id = 0,
@@ -117,6 +126,9 @@ static const struct xv_image_format etnaviv_image_formats[] = {
 	}, {
 		.u.data = NULL,
 		.xv_image = XVIMAGE_XVBO,
+	}, {
+		.u.data = NULL,
+		.xv_image = XVIMAGE_XVBP,
 	},
 };
 
@@ -125,15 +137,50 @@ static const struct xv_image_format etnaviv_image_formats[] = {
 #define KERNEL_SIZE	(KERNEL_ROWS * KERNEL_INDICES)
 #define KERNEL_STATE_SZ	((KERNEL_SIZE + 1) / 2)
 
-static uint32_t xv_filter_kernel[KERNEL_STATE_SZ];
+enum {
+	FILTER_NEAREST,
+	FILTER_BILINEAR,
+	FILTER_BICUBIC,
+	FILTER_LANCZOS2,
+	FILTER_LANCZOS3,
+	FILTER_LANCZOS4,
+	NR_FILTERS,
+};
+
+/* The support radius of each filter, in source pixels */
+static const float xv_filter_radius[NR_FILTERS] = {
+	[FILTER_NEAREST] = 0.5,
+	[FILTER_BILINEAR] = 1.0,
+	[FILTER_BICUBIC] = 2.0,
+	[FILTER_LANCZOS2] = 2.0,
+	[FILTER_LANCZOS3] = 3.0,
+	[FILTER_LANCZOS4] = 4.0,
+};
+
+/*
+ * Each filter has variants widened for these downscale factors, so
+ * that large downscales are low-pass filtered rather than aliased.
+ */
+static const float xv_filter_scales[] = { 1.0, 1.5, 2.0, 3.0 };
+#define NR_FILTER_SCALES ARRAY_SIZE(xv_filter_scales)
+
+static uint32_t xv_filter_kernel[NR_FILTERS][NR_FILTER_SCALES][KERNEL_STATE_SZ];
 
 enum {
 	attr_sync_to_vblank,
+	attr_filter,
 	attr_last_prop,
 	attr_pipe = attr_last_prop,
 	attr_encoding,
 };
 
+struct etnaviv_xv_buf {
+	struct etna_bo *bo;
+	size_t size;
+	uint32_t fence;
+	Bool busy;
+};
+
 struct etnaviv_xv_priv {
 	struct etnaviv *etnaviv;
 	xf86CrtcPtr desired_crtc;
@@ -149,8 +196,18 @@ struct etnaviv_xv_priv {
 	struct etnaviv_format source_format;
 	struct etnaviv_format stage1_format;
 	uint32_t stage1_pitch;
-	size_t stage1_size;
-	struct etna_bo *stage1_bo;
+	/*
+	 * The stage 1 (vertical filter) surface is only ever touched by
+	 * the GPU, which executes submissions in order, so one surface
+	 * can be reused by the next frame without waiting.
+	 */
+	struct etnaviv_xv_buf stage1;
+
+	/* staging buffers for client images, and the last frame's fence */
+	struct etnaviv_xv_buf ring[ETNAVIV_XV_RING_SIZE];
+	unsigned ring_next;
+	uint32_t fence;
+	Bool busy;
 
 	INT32 props[attr_last_prop];
 };
@@ -174,6 +231,12 @@ static XF86AttributeRec etnaviv_xv_attributes[] = {
 		.max_value = 1,
 		.name = "XV_SYNC_TO_VBLANK",
 	},
+	[attr_filter] = {
+		.flags = XvSettable | XvGettable,
+		.min_value = 0,
+		.max_value = NR_FILTERS - 1,
+		.name = "XV_FILTER",
+	},
 };
 
 static int etnaviv_xv_set_encoding(ScrnInfoPtr pScrn,
@@ -258,6 +321,12 @@ static struct xv_attr_data etnaviv_attributes[] = {
 		.get = etnaviv_xv_get_prop,
 		.attr = &etnaviv_xv_attributes[attr_sync_to_vblank],
 	},
+	[attr_filter] = {
+		.id = attr_filter,
+		.set = etnaviv_xv_set_prop,
+		.get = etnaviv_xv_get_prop,
+		.attr = &etnaviv_xv_attributes[attr_filter],
+	},
 };
 
 static const struct xv_image_format *etnaviv_get_fmt_xv(int id)
@@ -272,8 +341,9 @@ static int etnaviv_get_fmt_info(const struct xv_image_format *fmt,
 	uint32_t size[3];
 	int ret;
 
-	if (fmt->xv_image.id == FOURCC_XVBO) {
-		/* Our special XVBO format is only two uint32_t */
+	if (fmt->xv_image.id == FOURCC_XVBO ||
+	    fmt->xv_image.id == FOURCC_XVBP) {
+		/* Our special XVBO formats are only two uint32_t */
 		pitch[0] = 2 * sizeof(uint32_t);
 		offset[0] = 0;
 		ret = pitch[0];
@@ -318,40 +388,87 @@ static int etnaviv_get_fmt_info(const struct xv_image_format *fmt,
 	return ALIGN(ret, getpagesize());
 }
 
-static Bool etnaviv_realloc_stage1(ScrnInfoPtr pScrn,
-	struct etnaviv_xv_priv *priv, size_t size)
+static void etnaviv_xv_wait_fence(struct etnaviv *etnaviv, uint32_t fence)
 {
-	struct etnaviv *etnaviv = priv->etnaviv;
+	int ret;
 
-	if (priv->stage1_bo)
-		etna_bo_del(etnaviv->conn, priv->stage1_bo, NULL);
+	if (VIV_FENCE_BEFORE_EQ(fence, etnaviv->last_fence))
+		return;
 
-	/*
-	 * We don't need this bo mapped into this process at all, but
-	 * etnaviv and galcore gives us no option.
-	 */
-	priv->stage1_bo = etna_bo_new(etnaviv->conn, size,
-				      DRM_ETNA_GEM_TYPE_BMP |
-				      DRM_ETNA_GEM_CACHE_WBACK);
-	if (!priv->stage1_bo) {
-		xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
-			   "etnaviv Xv: etna_bo_new(size=%zu) failed\n", size);
-		priv->stage1_size = 0;
-		return FALSE;
+	ret = viv_fence_finish(etnaviv->conn, fence, VIV_WAIT_INDEFINITE);
+	if (ret != VIV_STATUS_OK)
+		etnaviv_error(etnaviv, "fence finish", ret);
+
+	etnaviv_finish_fences(etnaviv, fence);
+}
+
+/* Wait for the GPU to finish with this port's buffers */
+static void etnaviv_xv_idle(struct etnaviv_xv_priv *priv)
+{
+	unsigned i;
+
+	if (priv->busy) {
+		etnaviv_xv_wait_fence(priv->etnaviv, priv->fence);
+		priv->busy = FALSE;
+		for (i = 0; i < ETNAVIV_XV_RING_SIZE; i++)
+			priv->ring[i].busy = FALSE;
+		priv->stage1.busy = FALSE;
 	}
+}
 
-	priv->stage1_size = size;
-	return TRUE;
+/*
+ * Prepare a buffer for the next frame, reallocating it if it is too
+ * small.  Buffers the CPU will write must wait for the GPU to finish
+ * with the frame they last held; buffers only the GPU touches are
+ * ordered by the command stream, and are only waited for before being
+ * freed.
+ */
+static struct etnaviv_xv_buf *etnaviv_xv_get_buf(ScrnInfoPtr pScrn,
+	struct etnaviv *etnaviv, struct etnaviv_xv_buf *xb, size_t size,
+	Bool cpu_access)
+{
+	if (xb->busy && (cpu_access || xb->size < size)) {
+		etnaviv_xv_wait_fence(etnaviv, xb->fence);
+		xb->busy = FALSE;
+	}
+
+	if (xb->size < size) {
+		if (xb->bo)
+			etna_bo_del(etnaviv->conn, xb->bo, NULL);
+
+		/*
+		 * Stage 1 surfaces need not be mapped into this process
+		 * at all, but etnaviv and galcore give us no option.
+		 */
+		xb->bo = etna_bo_new(etnaviv->conn, size,
+				     DRM_ETNA_GEM_TYPE_BMP |
+				     DRM_ETNA_GEM_CACHE_WBACK);
+		if (!xb->bo) {
+			xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
+				   "etnaviv Xv: etna_bo_new(size=%zu) failed\n",
+				   size);
+			xb->size = 0;
+			return NULL;
+		}
+		xb->size = size;
+	}
+
+	return xb;
 }
 
-static void etnaviv_del_stage1(struct etnaviv_xv_priv *priv)
+static void etnaviv_xv_del_bufs(struct etnaviv *etnaviv,
+	struct etnaviv_xv_buf *ring, unsigned n)
 {
-	struct etnaviv *etnaviv = priv->etnaviv;
+	unsigned i;
+
+	for (i = 0; i < n; i++) {
+		struct etnaviv_xv_buf *xb = &ring[i];
 
-	if (priv->stage1_bo) {
-		etna_bo_del(etnaviv->conn, priv->stage1_bo, NULL);
-		priv->stage1_bo = NULL;
-		priv->stage1_size = 0;
+		if (xb->bo) {
+			etna_bo_del(etnaviv->conn, xb->bo, NULL);
+			xb->bo = NULL;
+			xb->size = 0;
+		}
 	}
 }
 
@@ -360,7 +477,10 @@ static void etnaviv_StopVideo(ScrnInfoPtr pScrn, pointer data, Bool shutdown)
 	struct etnaviv_xv_priv *priv = data;
 
 	if (shutdown) {
-		etnaviv_del_stage1(priv);
+		etnaviv_xv_idle(priv);
+		etnaviv_xv_del_bufs(priv->etnaviv, priv->ring,
+				    ETNAVIV_XV_RING_SIZE);
+		etnaviv_xv_del_bufs(priv->etnaviv, &priv->stage1, 1);
 		priv->fmt = NULL;
 	}
 }
@@ -437,6 +557,39 @@ static int etnaviv_configure_format(struct etnaviv_xv_priv *priv,
 	return Success;
 }
 
+/*
+ * Load the filter kernel for the port's filter and the given 16.16
+ * scale factor.  The kernel occupies 77 states, so only load it when
+ * it differs from the one last loaded in the current submission.
+ * Each PutImage commits its frame, and etnaviv_commit() forgets the
+ * kernel, so this only saves reloading between the passes of one
+ * frame, never across frames.
+ *
+ * A kernel already loaded in this submission has been used by a
+ * filter blit which may still be running, so drain the pixel engine
+ * before replacing it.
+ */
+static void etnaviv_xv_load_kernel(struct etnaviv_xv_priv *priv,
+	uint32_t scale)
+{
+	struct etnaviv *etnaviv = priv->etnaviv;
+	const uint32_t *kernel;
+	unsigned i;
+
+	for (i = NR_FILTER_SCALES - 1; i > 0; i--)
+		if (scale >= xv_filter_scales[i] * 65536)
+			break;
+
+	kernel = xv_filter_kernel[priv->props[attr_filter]][i];
+	if (etnaviv->xv_kernel != kernel) {
+		if (etnaviv->xv_kernel)
+			etnaviv_flush_stall(etnaviv);
+		etna_set_state_multi(etnaviv->ctx, VIVS_DE_FILTER_KERNEL(0),
+				     KERNEL_STATE_SZ, kernel);
+		etnaviv->xv_kernel = kernel;
+	}
+}
+
 static int etnaviv_PutImage(ScrnInfoPtr pScrn,
 	short src_x, short src_y, short drw_x, short drw_y,
 	short src_w, short src_h, short drw_w, short drw_h,
@@ -445,16 +598,21 @@ static int etnaviv_PutImage(ScrnInfoPtr pScrn,
 {
 	struct etnaviv_xv_priv *priv = data;
 	struct etnaviv *etnaviv = priv->etnaviv;
+	struct etnaviv_stat_mark mark;
 	struct etnaviv_vr_op op;
-	struct etnaviv_pixmap *vPix;
+	struct etnaviv_pixmap *vPix, *src_vPix = NULL;
+	struct etnaviv_xv_buf *xb = NULL, *s1 = NULL;
 	struct etna_bo *usr;
 	drmVBlank vbl;
 	xf86CrtcPtr crtc;
 	BoxRec dst;
 	xPoint dst_offset;
 	INT32 x1, x2, y1, y2;
-	Bool is_xvbo = id == FOURCC_XVBO;
-	int s_w, s_h, xoff;
+	Bool is_xvbp = id == FOURCC_XVBP;
+	Bool is_xvbo = id == FOURCC_XVBO || is_xvbp;
+	uint32_t fence;
+	Bool scale_x, scale_y;
+	int s_w, s_h;
 
 	dst.x1 = drw_x;
 	dst.y1 = drw_y;
@@ -506,7 +664,27 @@ static int etnaviv_PutImage(ScrnInfoPtr pScrn,
 			crtc = NULL;
 	}
 
-	if (is_xvbo) {
+	if (is_xvbp) {
+		/*
+		 * The buffer was imported as a pixmap via DRI3, so we
+		 * can use its bo directly.  It must be linear, since we
+		 * treat it as the client's image layout.
+		 */
+		PixmapPtr pixmap = xvbo_get_pixmap(drawable, buf);
+
+		if (pixmap)
+			src_vPix = etnaviv_get_pixmap_priv(pixmap);
+		if (!src_vPix || !src_vPix->etna_bo ||
+		    !(src_vPix->state & ST_DMABUF) || src_vPix->format.tile)
+			return BadMatch;
+
+		if (!etnaviv_map_gpu(etnaviv, src_vPix, GPU_ACCESS_RO))
+			return BadMatch;
+
+		usr = src_vPix->etna_bo;
+		if (etna_bo_size(usr) < priv->size)
+			return BadAlloc;
+	} else if (is_xvbo) {
 		uint32_t name = ((uint32_t *)buf)[1];
 
 		usr = etna_bo_from_name(etnaviv->conn, name);
@@ -517,30 +695,38 @@ static int etnaviv_PutImage(ScrnInfoPtr pScrn,
 			etna_bo_del(etnaviv->conn, usr, NULL);
 			return BadAlloc;
 		}
-
-		xoff = 0;
 	} else {
-		/* The GPU alignment offset of the buffer. */
-		xoff = (uintptr_t)buf & 63;
-
-		usr = etna_bo_from_usermem_prot(etnaviv->conn, buf - xoff,
-						priv->size + xoff, PROT_READ);
-		if (!usr)
+		/*
+		 * The client image lives in the request buffer, which is
+		 * reused as soon as we return.  Copy it to a staging
+		 * buffer rather than waiting for the GPU to read it.
+		 */
+		xb = etnaviv_xv_get_buf(pScrn, etnaviv,
+					&priv->ring[priv->ring_next],
+					priv->size, TRUE);
+		if (!xb)
 			return BadAlloc;
 
-		xoff = (xoff >> 1) << 16;
+		priv->ring_next = (priv->ring_next + 1) % ETNAVIV_XV_RING_SIZE;
+
+		usr = xb->bo;
+		etna_bo_cpu_prep(usr, NULL, DRM_ETNA_PREP_WRITE);
+		memcpy(etna_bo_map(usr), buf, priv->size);
+		etna_bo_cpu_fini(usr);
 	}
 
 	op.src = INIT_BLIT_BO(usr, 0, priv->source_format, ZERO_OFFSET);
 	op.src_pitches = priv->pitches;
 	op.src_offsets = priv->offsets;
-	op.src_bounds.x1 = xoff >> 16;
+	op.src_bounds.x1 = 0;
 	op.src_bounds.y1 = 0;
-	op.src_bounds.x2 = op.src_bounds.x1 + width;
+	op.src_bounds.x2 = width;
 	op.src_bounds.y2 = height;
 
-	etna_set_state_multi(etnaviv->ctx, VIVS_DE_FILTER_KERNEL(0), KERNEL_STATE_SZ,
-			     xv_filter_kernel);
+	/* The filter kernel is loaded directly, so emit any pending render */
+	etnaviv_render_flush(etnaviv);
+
+	mark = etnaviv_stats_start(etnaviv, STAT_XV);
 
 	/*
 	 * The resulting width/height of the source/destination
@@ -551,8 +737,16 @@ static int etnaviv_PutImage(ScrnInfoPtr pScrn,
 	drw_w = dst.x2 - dst.x1;
 	drw_h = dst.y2 - dst.y1;
 
-	/* Check whether we need to scale in the vertical direction first. */
-	if (s_h != drw_h << 16) {
+	scale_x = s_w != drw_w << 16;
+	scale_y = s_h != drw_h << 16;
+
+	/*
+	 * Scaling in both directions needs a vertical filter blit into
+	 * an intermediate surface first.  When only one direction is
+	 * scaled, a single filter blit straight to the destination will
+	 * do.
+	 */
+	if (scale_x && scale_y) {
 		size_t stage1_size = priv->stage1_pitch;
 		BoxRec box;
 
@@ -561,10 +755,12 @@ static int etnaviv_PutImage(ScrnInfoPtr pScrn,
 		else
 			stage1_size *= drw_h;
 
-		/* Check whether we need to reallocate the temporary bo */
-		if (stage1_size > priv->stage1_size &&
-		    !etnaviv_realloc_stage1(pScrn, priv, stage1_size))
+		s1 = etnaviv_xv_get_buf(pScrn, etnaviv, &priv->stage1,
+					stage1_size, FALSE);
+		if (!s1) {
+			etnaviv_stats_reason(etnaviv, FB_ALLOC);
 			goto bad_alloc;
+		}
 
 		box.x1 = 0;
 		box.y1 = 0;
@@ -578,13 +774,19 @@ static int etnaviv_PutImage(ScrnInfoPtr pScrn,
 		 */
 		op.h_scale = 1 << 16;
 		op.v_scale = s_h / drw_h;
-		op.dst = INIT_BLIT_BO(priv->stage1_bo, priv->stage1_pitch,
+		op.dst = INIT_BLIT_BO(s1->bo, priv->stage1_pitch,
 				      priv->stage1_format, ZERO_OFFSET);
 		op.cmd = VIVS_DE_DEST_CONFIG_COMMAND_VER_FILTER_BLT;
 		op.vr_op = VIVS_DE_VR_CONFIG_START_VERTICAL_BLIT;
 
-		etnaviv_vr_op(etnaviv, &op, &box, xoff, y1, &box, 1);
-		/* GC320 and GC600 do not seem to need a flush here */
+		etnaviv_xv_load_kernel(priv, op.v_scale);
+		etnaviv_vr_op(etnaviv, &op, &box, 0, y1, &box, 1);
+		/*
+		 * GC320 and GC600 do not seem to need a flush here when
+		 * the next pass uses the same kernel.  When it does not,
+		 * etnaviv_xv_load_kernel() drains the pixel engine
+		 * before reloading it.
+		 */
 
 		/* Set the source for the next stage */
 		op.src = op.dst;
@@ -599,45 +801,77 @@ static int etnaviv_PutImage(ScrnInfoPtr pScrn,
 		op.src_bounds.x1 = 0;
 		op.src_bounds.x2 = (x2 + 0xffff) >> 16;
 		op.src_bounds.y2 = drw_h;
-	} else {
-		/* No need for the vertical scaling stage. */
-		x1 += xoff;
-		x2 += xoff;
+		scale_y = FALSE;
 	}
 
 	op.dst = INIT_BLIT_BO(vPix->etna_bo, vPix->pitch, vPix->format, dst_offset);
 	op.h_scale = s_w / drw_w;
-	op.v_scale = 1 << 16;
-	op.cmd = VIVS_DE_DEST_CONFIG_COMMAND_HOR_FILTER_BLT;
-	op.vr_op = VIVS_DE_VR_CONFIG_START_HORIZONTAL_BLIT;
 
-	/* Perform horizontal filter blt */
+	if (scale_y) {
+		/* Perform vertical filter blt */
+		op.v_scale = s_h / drw_h;
+		op.cmd = VIVS_DE_DEST_CONFIG_COMMAND_VER_FILTER_BLT;
+		op.vr_op = VIVS_DE_VR_CONFIG_START_VERTICAL_BLIT;
+		etnaviv_xv_load_kernel(priv, op.v_scale);
+	} else {
+		/* Perform horizontal filter blt */
+		op.v_scale = 1 << 16;
+		op.cmd = VIVS_DE_DEST_CONFIG_COMMAND_HOR_FILTER_BLT;
+		op.vr_op = VIVS_DE_VR_CONFIG_START_HORIZONTAL_BLIT;
+		etnaviv_xv_load_kernel(priv, op.h_scale);
+	}
+
 	etnaviv_vr_op(etnaviv, &op, &dst, x1, y1, RegionRects(clipBoxes),
 		      RegionNumRects(clipBoxes));
 	etnaviv_flush(etnaviv);
 
+	/*
+	 * Submit the frame without waiting for it.  The destination is
+	 * fenced like any other pixmap, so CPU access to it will wait
+	 * for the GPU, the staging buffers are only waited for when
+	 * their ring comes back around to them, and the stage 1 surface
+	 * is only waited for before it is reallocated.
+	 */
+	etnaviv_batch_add(etnaviv, vPix);
+	if (src_vPix)
+		etnaviv_batch_add(etnaviv, src_vPix);
+	fence = etnaviv->last_fence;
+	etnaviv_commit(etnaviv, FALSE, &fence);
+
+	priv->fence = fence;
+	priv->busy = TRUE;
+	if (s1) {
+		s1->fence = fence;
+		s1->busy = TRUE;
+	}
+	if (xb) {
+		xb->fence = fence;
+		xb->busy = TRUE;
+	} else if (!src_vPix) {
+		/* The kernel holds its own reference for the submission */
+		etna_bo_del(etnaviv->conn, usr, NULL);
+	}
+
+	/* The client asked for the image to be complete on return */
+	if (sync)
+		etnaviv_xv_idle(priv);
+
+	etnaviv_stats_end(etnaviv, mark, TRUE);
+
 	/* Wait for vsync */
 	if (crtc && priv->props[attr_sync_to_vblank]) {
 		vbl.request.sequence = vbl.reply.sequence + 1;
 		common_drm_vblank_wait(pScrn, crtc, &vbl, __FUNCTION__, FALSE);
 	}
 
-	/*
-	 * It would be nice not to wait for the GPU to finish rendering
-	 * here, but it seems we can't avoid it.  In theory, 'sync'
-	 * would tell us whether we can, but in the case of non-shmem,
-	 * that is always false, and the passed buffer is part of the
-	 * client specific request buffer on the server.
-	 */
-	etna_finish(etnaviv->ctx);
-
-	etna_bo_del(etnaviv->conn, usr, NULL);
 	DamageDamageRegion(drawable, clipBoxes);
 
 	return Success;
 
  bad_alloc:
-	etna_bo_del(etnaviv->conn, usr, NULL);
+	etnaviv_stats_end(etnaviv, mark, FALSE);
+	if (!xb && !src_vPix)
+		etna_bo_del(etnaviv->conn, usr, NULL);
 
 	return BadAlloc;
 }
@@ -699,6 +933,33 @@ static inline float sinc(float x)
 	return x != 0.0 ? sinf(x) / x : 1.0;
 }
 
+static float etnaviv_filter_weight(unsigned filter, float x)
+{
+	float ax = fabsf(x);
+
+	switch (filter) {
+	case FILTER_NEAREST:
+		return ax < 0.5 ? 1.0 : ax == 0.5 ? 0.5 : 0.0;
+
+	case FILTER_BILINEAR:
+		return ax < 1.0 ? 1.0 - ax : 0.0;
+
+	case FILTER_BICUBIC:
+		/* Catmull-Rom */
+		if (ax < 1.0)
+			return (1.5 * ax - 2.5) * ax * ax + 1.0;
+		if (ax < 2.0)
+			return ((-0.5 * ax + 2.5) * ax - 4.0) * ax + 2.0;
+		return 0.0;
+
+	default:
+		if (ax <= xv_filter_radius[filter])
+			return sinc(M_PI * x) *
+			       sinc(M_PI * x / xv_filter_radius[filter]);
+		return 0.0;
+	}
+}
+
 /*
  * Some interesting observations of the kernel.  According to the etnaviv
  * rnndb files:
@@ -721,14 +982,23 @@ static inline float sinc(float x)
  * ninth filter tap.  If this is always zero, what's the point of having
  * hardware deal with nine filter taps?  This makes no sense to me.
  */
-static void etnaviv_init_filter_kernel(void)
+static void etnaviv_init_filter_kernel(uint32_t *state, unsigned filter,
+	float scale)
 {
 	unsigned row, idx, i;
 	int16_t kernel_val[KERNEL_STATE_SZ * 2];
 	float row_ofs = 0.5;
-	float radius = 4.0;
 
-	/* Compute lanczos filter kernel */
+	/*
+	 * Widen the filter by the downscale factor, limited by the
+	 * nine taps.  Nearest stays nearest whatever the scale.
+	 */
+	if (filter == FILTER_NEAREST)
+		scale = 1.0;
+	else if (scale * xv_filter_radius[filter] > 4.5)
+		scale = 4.5 / xv_filter_radius[filter];
+
+	/* Compute the filter kernel */
 	for (row = i = 0; row < KERNEL_ROWS; row++) {
 		float kernel[KERNEL_INDICES] = { 0.0 };
 		float sum = 0.0;
@@ -736,10 +1006,7 @@ static void etnaviv_init_filter_kernel(void)
 		for (idx = 0; idx < KERNEL_INDICES; idx++) {
 			float x = idx - 4.0 + row_ofs;
 
-			if (fabs(x) <= radius)
-				kernel[idx] = sinc(M_PI * x) *
-					      sinc(M_PI * x / radius);
-
+			kernel[idx] = etnaviv_filter_weight(filter, x / scale);
 			sum += kernel[idx];
 		}
 
@@ -767,11 +1034,22 @@ static void etnaviv_init_filter_kernel(void)
 
 	/* Now convert the kernel values into state values */
 	for (i = 0; i < KERNEL_STATE_SZ * 2; i += 2)
-		xv_filter_kernel[i / 2] =
+		state[i / 2] =
 			VIVS_DE_FILTER_KERNEL_COEFFICIENT0(kernel_val[i]) |
 			VIVS_DE_FILTER_KERNEL_COEFFICIENT1(kernel_val[i + 1]);
 }
 
+static void etnaviv_init_filter_kernels(void)
+{
+	unsigned filter, i;
+
+	for (filter = 0; filter < NR_FILTERS; filter++)
+		for (i = 0; i < NR_FILTER_SCALES; i++)
+			etnaviv_init_filter_kernel(xv_filter_kernel[filter][i],
+						   filter,
+						   xv_filter_scales[i]);
+}
+
 static Bool etnaviv_xv_CloseScreen(CLOSE_SCREEN_ARGS_DECL)
 {
 	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
@@ -810,8 +1088,12 @@ XF86VideoAdaptorPtr etnaviv_xv_init(ScreenPtr pScreen, unsigned int *caps)
 			*caps = XVBO_CAP_GPU_DRM;
 	}
 #endif
+#ifdef HAVE_DRI3
+	if (etnaviv->dri3_enabled)
+		*caps |= XVBO_CAP_PIXMAP;
+#endif
 
-	etnaviv_init_filter_kernel();
+	etnaviv_init_filter_kernels();
 
 	etnaviv_xv_attributes[attr_pipe].max_value =
 		XF86_CRTC_CONFIG_PTR(pScrn)->num_crtc - 1;
@@ -839,13 +1121,20 @@ XF86VideoAdaptorPtr etnaviv_xv_init(ScreenPtr pScreen, unsigned int *caps)
 		if (f && !etnaviv_src_format_valid(etnaviv, *f))
 			continue;
 
-		if (fmt->xv_image.format == FOURCC_XVBO) {
+		if (fmt->xv_image.id == FOURCC_XVBO) {
 #ifdef HAVE_DRI2
 			if(!etnaviv->dri2_enabled)
 #endif
 				continue;
 		}
 
+		if (fmt->xv_image.id == FOURCC_XVBP) {
+#ifdef HAVE_DRI3
+			if (!etnaviv->dri3_enabled)
+#endif
+				continue;
+		}
+
 		images[num_images++] = fmt->xv_image;
 	}
 
@@ -872,6 +1161,7 @@ XF86VideoAdaptorPtr etnaviv_xv_init(ScreenPtr pScreen, unsigned int *caps)
 	for (i = 0; i < nports; i++) {
 		priv[i].etnaviv = etnaviv;
 		priv[i].props[attr_sync_to_vblank] = 1;
+		priv[i].props[attr_filter] = FILTER_LANCZOS4;
 		p->pPortPrivates[i].ptr = (pointer) &priv[i];
 	}
 
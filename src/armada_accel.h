@@ -20,6 +20,7 @@ enum {
 	/* xv_init capabilities */
 	XVBO_CAP_KMS_DRM = 1,
 	XVBO_CAP_GPU_DRM = 2,
+	XVBO_CAP_PIXMAP = 4,
 };
 
 struct armada_accel_ops {
@@ -34,6 +35,7 @@ struct armada_accel_ops {
 			       void *user_data);
 	XF86VideoAdaptorPtr (*xv_init)(ScreenPtr, unsigned int *);
 	int (*export_name)(ScreenPtr, uint32_t);
+	int (*export_pixmap)(ScreenPtr, PixmapPtr);
 };
 
 Bool accel_module_init(const struct armada_accel_ops **);
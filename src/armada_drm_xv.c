@@ -29,6 +29,7 @@
 #include "armada_fourcc.h"
 #include "armada_ioctl.h"
 #include "xv_attribute.h"
+#include "xv_copy.h"
 #include "xv_image_format.h"
 #include "xvbo.h"
 
@@ -38,6 +39,9 @@ typedef uint32_t phys_t;
 
 #define NR_BUFS	3
 
+/* Number of imported XVBO buffers to keep framebuffers for */
+#define NR_XVBO_CACHE	8
+
 enum armada_drm_properties {
 	PROP_DRM_SATURATION,
 	PROP_DRM_BRIGHTNESS,
@@ -60,6 +64,7 @@ struct drm_xv {
 	/* Common information */
 	xf86CrtcPtr desired_crtc;
 	Bool has_xvbo;
+	Bool has_xvbp;
 	Bool is_xvbo;
 	Bool autopaint_colorkey;
 
@@ -72,16 +77,29 @@ struct drm_xv {
 	uint32_t pitches[3];
 	uint32_t offsets[3];
 
+	/* Client image layout, and the buffer plane for each image plane */
+	const struct xv_image_format *image_format;
+	uint32_t image_pitches[3];
+	uint32_t image_offsets[3];
+	unsigned plane_map[3];
+
 	unsigned bo_idx;
 	struct {
 		struct drm_armada_bo *bo;
 		uint32_t fb_id;
 	} bufs[NR_BUFS];
 
-	struct drm_armada_bo *last_bo;
+	/* Imported XVBO buffers and their framebuffers */
+	unsigned xvbo_lru;
+	struct {
+		struct drm_armada_bo *bo;
+		uint32_t name;
+		uint32_t fb_id;
+		unsigned lru;
+	} xvbo_cache[NR_XVBO_CACHE];
 
-	int (*get_fb)(ScrnInfoPtr, struct drm_xv *, unsigned char *,
-		uint32_t *);
+	int (*get_fb)(ScrnInfoPtr, struct drm_xv *, DrawablePtr,
+		unsigned char *, uint32_t *);
 	struct drm_armada_bo *(*import_name)(ScrnInfoPtr, struct drm_xv *,
 		uint32_t);
 
@@ -386,9 +404,12 @@ static const struct xv_image_format armada_drm_formats[] = {
 		.u.drm_format = DRM_FORMAT_BGR565,
 		.xv_image = XVIMAGE_BGR565
 	}, {
-		/* This must be the last */
+		/* These must be the last */
 		.u.drm_format = 0,
 		.xv_image = XVIMAGE_XVBO
+	}, {
+		.u.drm_format = 0,
+		.xv_image = XVIMAGE_XVBP
 	},
 };
 
@@ -405,6 +426,37 @@ static const struct xv_image_format *armada_drm_lookup_drmfourcc(uint32_t fmt)
 			    ARRAY_SIZE(armada_drm_formats), fmt);
 }
 
+/*
+ * These pairs of formats differ only in the order of their chroma
+ * planes, so either can be displayed in the other's place by swapping
+ * the planes while copying the image.
+ */
+static uint32_t armada_drm_uv_swapped(uint32_t fmt)
+{
+	switch (fmt) {
+	case DRM_FORMAT_YUV420:
+		return DRM_FORMAT_YVU420;
+	case DRM_FORMAT_YVU420:
+		return DRM_FORMAT_YUV420;
+	case DRM_FORMAT_YUV422:
+		return DRM_FORMAT_YVU422;
+	case DRM_FORMAT_YVU422:
+		return DRM_FORMAT_YUV422;
+	}
+	return 0;
+}
+
+static Bool armada_drm_plane_has_format(struct drm_xv *drmxv, uint32_t fmt)
+{
+	unsigned i;
+
+	for (i = 0; i < drmxv->planes[0]->count_formats; i++)
+		if (drmxv->planes[0]->formats[i] == fmt)
+			return TRUE;
+
+	return FALSE;
+}
+
 static int
 armada_drm_get_fmt_info(const struct xv_image_format *fmt,
 	uint32_t *pitch, uint32_t *offset, short width, short height)
@@ -412,8 +464,8 @@ armada_drm_get_fmt_info(const struct xv_image_format *fmt,
 	const XF86ImageRec *img = &fmt->xv_image;
 	int ret = 0;
 
-	if (img->id == FOURCC_XVBO) {
-		/* Our special XVBO format is only two uint32_t */
+	if (img->id == FOURCC_XVBO || img->id == FOURCC_XVBP) {
+		/* Our special XVBO formats are only two uint32_t */
 		pitch[0] = 2 * sizeof(uint32_t);
 		offset[0] = 0;
 		ret = pitch[0];
@@ -449,10 +501,27 @@ armada_drm_coords_to_box(BoxPtr box, short x, short y, short w, short h)
 	box->y2 = y + h;
 }
 
+static void armada_drm_xvbo_evict(struct drm_xv *drmxv, unsigned i)
+{
+	if (drmxv->xvbo_cache[i].fb_id) {
+		if (drmxv->xvbo_cache[i].fb_id == drmxv->plane_fb_id)
+			drmxv->plane_fb_id = 0;
+		drmModeRmFB(drmxv->fd, drmxv->xvbo_cache[i].fb_id);
+		drmxv->xvbo_cache[i].fb_id = 0;
+	}
+	if (drmxv->xvbo_cache[i].bo) {
+		drm_armada_bo_put(drmxv->xvbo_cache[i].bo);
+		drmxv->xvbo_cache[i].bo = NULL;
+	}
+}
+
 static void armada_drm_bufs_free(struct drm_xv *drmxv)
 {
 	unsigned i;
 
+	for (i = 0; i < ARRAY_SIZE(drmxv->xvbo_cache); i++)
+		armada_drm_xvbo_evict(drmxv, i);
+
 	for (i = 0; i < ARRAY_SIZE(drmxv->bufs); i++) {
 		if (drmxv->bufs[i].fb_id) {
 			if (drmxv->bufs[i].fb_id == drmxv->plane_fb_id)
@@ -465,16 +534,6 @@ static void armada_drm_bufs_free(struct drm_xv *drmxv)
 			drmxv->bufs[i].bo = NULL;
 		}
 	}
-
-	if (drmxv->plane_fb_id) {
-		drmModeRmFB(drmxv->fd, drmxv->plane_fb_id);
-		drmxv->plane_fb_id = 0;
-	}
-
-	if (drmxv->last_bo) {
-		drm_armada_bo_put(drmxv->last_bo);
-		drmxv->last_bo = NULL;
-	}
 }
 
 static Bool
@@ -568,54 +627,165 @@ static Bool armada_drm_is_bmm(unsigned char *buf)
 	return armada_drm_bmm_chk(buf, len) == ptr[len];
 }
 
+/*
+ * Decoders cycle through a pool of buffers, so keep the imported
+ * buffers and their framebuffers in a small cache, rather than
+ * creating and destroying a framebuffer each frame.  Buffers passed
+ * by global name are looked up by name before importing; our
+ * reference on the buffer keeps the name bound to it.  Imported
+ * buffers are also matched against the cached buffer objects, as
+ * the buffer manager hands back the same object for a buffer it
+ * already knows.  The cache is emptied by armada_drm_bufs_free()
+ * when the format or size changes.
+ *
+ * Consumes the reference on bo.
+ */
 static int
-armada_drm_get_xvbo(ScrnInfoPtr pScrn, struct drm_xv *drmxv, unsigned char *buf,
-	uint32_t *id)
+armada_drm_xvbo_fb(ScrnInfoPtr pScrn, struct drm_xv *drmxv,
+	struct drm_armada_bo *bo, uint32_t name, uint32_t *id)
 {
-	struct drm_armada_bo *bo;
-	uint32_t name = ((uint32_t *)buf)[1];
+	unsigned i, victim = 0;
+
+	for (i = 0; i < ARRAY_SIZE(drmxv->xvbo_cache); i++) {
+		if (drmxv->xvbo_cache[i].bo &&
+		    ((name && drmxv->xvbo_cache[i].name == name) ||
+		     drmxv->xvbo_cache[i].bo == bo)) {
+			if (bo)
+				drm_armada_bo_put(bo);
+			drmxv->xvbo_cache[i].lru = ++drmxv->xvbo_lru;
+			*id = drmxv->xvbo_cache[i].fb_id;
+			return Success;
+		}
 
-	/* Lookup the bo for the global name on the DRI2 device */
-	bo = drmxv->import_name(pScrn, drmxv, name);
-	if (!bo) {
-		xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
-			   "[drm] xvbo: import of name 0x%08x failed: %s\n",
-			   name, strerror(errno));
-		return BadAlloc;
+		/* Prefer an empty slot, otherwise the least recently used */
+		if (drmxv->xvbo_cache[victim].bo &&
+		    (!drmxv->xvbo_cache[i].bo ||
+		     drmxv->xvbo_cache[i].lru < drmxv->xvbo_cache[victim].lru))
+			victim = i;
 	}
 
-	/* Is this a re-display of the previous frame? */
-	if (drmxv->last_bo == bo) {
-		drm_armada_bo_put(bo);
-		*id = drmxv->plane_fb_id;
-		return Success;
+	if (!bo) {
+		/* Lookup the bo for the global name on the DRI2 device */
+		bo = drmxv->import_name(pScrn, drmxv, name);
+		if (!bo) {
+			xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
+				   "[drm] xvbo: import of name 0x%08x failed: %s\n",
+				   name, strerror(errno));
+			return BadAlloc;
+		}
 	}
 
 	if (!armada_drm_create_fbid(drmxv, bo, id)) {
 		xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
 			"[drm] XVBO: drmModeAddFB2 failed: %s\n",
 			strerror(errno));
+		drm_armada_bo_put(bo);
 		return BadAlloc;
 	}
 
-	/* Now replace the last bo with the current bo */
-	if (drmxv->last_bo)
-		drm_armada_bo_put(drmxv->last_bo);
+	armada_drm_xvbo_evict(drmxv, victim);
 
-	drmxv->last_bo = bo;
+	drmxv->xvbo_cache[victim].bo = bo;
+	drmxv->xvbo_cache[victim].name = name;
+	drmxv->xvbo_cache[victim].fb_id = *id;
+	drmxv->xvbo_cache[victim].lru = ++drmxv->xvbo_lru;
 
 	return Success;
 }
 
 static int
-armada_drm_get_std(ScrnInfoPtr pScrn, struct drm_xv *drmxv, unsigned char *src,
-	uint32_t *id)
+armada_drm_get_xvbo(ScrnInfoPtr pScrn, struct drm_xv *drmxv,
+	DrawablePtr pDraw, unsigned char *buf, uint32_t *id)
+{
+	return armada_drm_xvbo_fb(pScrn, drmxv, NULL, ((uint32_t *)buf)[1], id);
+}
+
+/*
+ * XVBP passes a pixmap which the client created from a DMA-BUF using
+ * DRI3.  Pixmap XIDs are reused, so always export the pixmap's buffer
+ * and import it into our DRM device, and let the cache match the
+ * resulting buffer object.
+ */
+static int
+armada_drm_get_xvbp(ScrnInfoPtr pScrn, struct drm_xv *drmxv,
+	DrawablePtr pDraw, unsigned char *buf, uint32_t *id)
+{
+	ScreenPtr scrn = screenInfo.screens[pScrn->scrnIndex];
+	struct armada_drm_info *arm = GET_ARMADA_DRM_INFO(pScrn);
+	struct drm_armada_bo *bo;
+	PixmapPtr pixmap;
+	int fd;
+
+	pixmap = xvbo_get_pixmap(pDraw, buf);
+	if (!pixmap)
+		return BadMatch;
+
+	fd = arm->accel_ops->export_pixmap(scrn, pixmap);
+	if (fd == -1) {
+		xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
+			   "[drm] xvbp: export_pixmap failed\n");
+		return BadAlloc;
+	}
+
+	bo = drm_armada_bo_from_fd(drmxv->bufmgr, fd);
+	close(fd);
+	if (!bo) {
+		xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
+			   "[drm] xvbp: drm_armada_bo_from_fd failed: %s\n",
+			   strerror(errno));
+		return BadAlloc;
+	}
+
+	if (bo->size < drmxv->image_size) {
+		drm_armada_bo_put(bo);
+		return BadAlloc;
+	}
+
+	return armada_drm_xvbo_fb(pScrn, drmxv, bo, 0, id);
+}
+
+/*
+ * Copy the client image into the overlay buffer plane by plane, using
+ * each layout's own pitches, and swapping the chroma planes in the
+ * same pass if the overlay displays the image in the swapped format.
+ */
+static void armada_drm_copy_image(struct drm_xv *drmxv, unsigned char *dst,
+	const unsigned char *src)
+{
+	const XF86ImageRec *img = &drmxv->image_format->xv_image;
+	uint32_t width[3], height[3];
+	unsigned i;
+
+	if (img->format == XvPlanar) {
+		width[0] = drmxv->width / img->horz_y_period;
+		width[1] = drmxv->width / img->horz_u_period;
+		width[2] = drmxv->width / img->horz_v_period;
+		height[0] = drmxv->height / img->vert_y_period;
+		height[1] = drmxv->height / img->vert_u_period;
+		height[2] = drmxv->height / img->vert_v_period;
+	} else {
+		width[0] = drmxv->width * ((img->bits_per_pixel + 7) / 8);
+		height[0] = drmxv->height;
+	}
+
+	for (i = 0; i < img->num_planes; i++) {
+		unsigned j = drmxv->plane_map[i];
+
+		xv_copy_plane(dst + drmxv->offsets[j], drmxv->pitches[j],
+			      src + drmxv->image_offsets[i],
+			      drmxv->image_pitches[i], width[i], height[i]);
+	}
+}
+
+static int
+armada_drm_get_std(ScrnInfoPtr pScrn, struct drm_xv *drmxv,
+	DrawablePtr pDraw, unsigned char *src, uint32_t *id)
 {
 	struct drm_armada_bo *bo = drmxv->bufs[drmxv->bo_idx].bo;
 
 	if (bo) {
 		/* Copy new image data into the buffer */
-		memcpy(bo->ptr, src, drmxv->image_size);
+		armada_drm_copy_image(drmxv, bo->ptr, src);
 
 		/* Return this buffer's framebuffer id */
 		*id = drmxv->bufs[drmxv->bo_idx].fb_id;
@@ -701,13 +871,20 @@ armada_drm_Xv_QueryImageAttributes_noxvbo(ScrnInfoPtr pScrn, int image,
 
 /* Plane interface support */
 static int
-armada_drm_plane_fbid(ScrnInfoPtr pScrn, struct drm_xv *drmxv, int image,
-	unsigned char *buf, short width, short height, uint32_t *id)
+armada_drm_plane_fbid(ScrnInfoPtr pScrn, struct drm_xv *drmxv,
+	DrawablePtr pDraw, int image, unsigned char *buf, short width,
+	short height, uint32_t *id)
 {
 	const struct xv_image_format *fmt;
-	Bool is_xvbo = image == FOURCC_XVBO;
+	Bool is_xvbp = image == FOURCC_XVBP;
+	Bool is_xvbo = image == FOURCC_XVBO || is_xvbp;
+	int (*get_fb)(ScrnInfoPtr, struct drm_xv *, DrawablePtr,
+		unsigned char *, uint32_t *);
 	int ret;
 
+	if (is_xvbp && !drmxv->has_xvbp)
+		return BadMatch;
+
 	if (is_xvbo)
 		/*
 		 * XVBO support allows applications to prepare the DRM
@@ -725,25 +902,54 @@ armada_drm_plane_fbid(ScrnInfoPtr pScrn, struct drm_xv *drmxv, int image,
 		 */
 		return BadAlloc;
 
+	if (is_xvbp)
+		get_fb = armada_drm_get_xvbp;
+	else if (is_xvbo)
+		get_fb = armada_drm_get_xvbo;
+	else
+		get_fb = armada_drm_get_std;
+
 	if (drmxv->width != width || drmxv->height != height ||
 	    drmxv->fourcc != image || !drmxv->plane_format ||
-	    drmxv->is_xvbo != is_xvbo) {
+	    drmxv->is_xvbo != is_xvbo || drmxv->get_fb != get_fb) {
 		uint32_t size;
+		unsigned i;
 
 		/* format or size changed */
 		fmt = armada_drm_lookup_xvfourcc(image);
 		if (!fmt)
 			return BadMatch;
 
-		/* Check whether this is XVBO mapping */
-		if (is_xvbo) {
-			drmxv->is_xvbo = TRUE;
-			drmxv->get_fb = armada_drm_get_xvbo;
-		} else {
-			drmxv->is_xvbo = FALSE;
-			drmxv->get_fb = armada_drm_get_std;
+		drmxv->image_format = fmt;
+		armada_drm_get_fmt_info(fmt, drmxv->image_pitches,
+					drmxv->image_offsets, width, height);
+
+		/*
+		 * If the overlay can not display this image, but can
+		 * display it with the chroma planes swapped, do that
+		 * while copying it into our buffers.
+		 */
+		if (!is_xvbo &&
+		    !armada_drm_plane_has_format(drmxv, fmt->u.drm_format)) {
+			uint32_t swapped;
+
+			swapped = armada_drm_uv_swapped(fmt->u.drm_format);
+			if (swapped &&
+			    armada_drm_plane_has_format(drmxv, swapped))
+				fmt = armada_drm_lookup_drmfourcc(swapped);
+		}
+
+		for (i = 0; i < fmt->xv_image.num_planes; i++)
+			drmxv->plane_map[i] = i;
+		if (fmt != drmxv->image_format) {
+			drmxv->plane_map[1] = 2;
+			drmxv->plane_map[2] = 1;
 		}
 
+		/* Check whether this is XVBO mapping */
+		drmxv->is_xvbo = is_xvbo;
+		drmxv->get_fb = get_fb;
+
 		armada_drm_bufs_free(drmxv);
 
 		size = armada_drm_get_fmt_info(fmt, drmxv->pitches,
@@ -770,7 +976,7 @@ armada_drm_plane_fbid(ScrnInfoPtr pScrn, struct drm_xv *drmxv, int image,
 
 	}
 
-	ret = drmxv->get_fb(pScrn, drmxv, buf, id);
+	ret = drmxv->get_fb(pScrn, drmxv, pDraw, buf, id);
 	if (ret != Success) {
 		xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
 			   "[drm] Xv: failed to get framebuffer\n");
@@ -904,8 +1110,8 @@ static int armada_drm_plane_PutImage(ScrnInfoPtr pScrn,
 
 	armada_drm_coords_to_box(&dst, drw_x, drw_y, drw_w, drw_h);
 
-	ret = armada_drm_plane_fbid(pScrn, drmxv, image, buf, width, height,
-				    &fb_id);
+	ret = armada_drm_plane_fbid(pScrn, drmxv, pDraw, image, buf, width,
+				    height, &fb_id);
 	if (ret != Success)
 		return ret;
 
@@ -913,13 +1119,7 @@ static int armada_drm_plane_PutImage(ScrnInfoPtr pScrn,
 				    src_x, src_y, src_w, src_h,
 				    width, height, &dst, clipBoxes);
 
-	/* If there was a previous fb, release it. */
-	if (drmxv->is_xvbo &&
-	    drmxv->plane_fb_id && drmxv->plane_fb_id != fb_id) {
-		drmModeRmFB(drmxv->fd, drmxv->plane_fb_id);
-		drmxv->plane_fb_id = 0;
-	}
-
+	/* The framebuffers are owned by the buffers or the XVBO cache */
 	drmxv->plane_fb_id = fb_id;
 
 	return ret;
@@ -955,7 +1155,8 @@ armada_drm_XvInitPlane(ScrnInfoPtr pScrn, DevUnion *priv, struct drm_xv *drmxv)
 	if (!p)
 		return NULL;
 
-	images = calloc(drmxv->planes[0]->count_formats + 1, sizeof(*images));
+	images = calloc(drmxv->planes[0]->count_formats * 2 + 2,
+			sizeof(*images));
 	if (!images) {
 		free(p);
 		return NULL;
@@ -973,8 +1174,24 @@ armada_drm_XvInitPlane(ScrnInfoPtr pScrn, DevUnion *priv, struct drm_xv *drmxv)
 			images[num_images++] = fmt->xv_image;
 	}
 
+	/* Formats we can display by swapping their chroma planes */
+	for (i = 0; i < drmxv->planes[0]->count_formats; i++) {
+		const struct xv_image_format *fmt;
+		uint32_t id;
+
+		id = armada_drm_uv_swapped(drmxv->planes[0]->formats[i]);
+		if (id == 0 || armada_drm_plane_has_format(drmxv, id))
+			continue;
+
+		fmt = armada_drm_lookup_drmfourcc(id);
+		if (fmt)
+			images[num_images++] = fmt->xv_image;
+	}
+
 	if (drmxv->has_xvbo)
 		images[num_images++] = (XF86ImageRec)XVIMAGE_XVBO;
+	if (drmxv->has_xvbp)
+		images[num_images++] = (XF86ImageRec)XVIMAGE_XVBP;
 
 	p->type = XvWindowMask | XvInputMask | XvImageMask;
 	p->flags = VIDEO_OVERLAID_IMAGES;
@@ -1112,6 +1329,8 @@ Bool armada_drm_XvInit(ScrnInfoPtr pScrn)
 		drmxv->has_xvbo = TRUE;
 		drmxv->import_name = armada_drm_import_accel_name;
 	}
+	if (cap & XVBO_CAP_PIXMAP && arm->accel_ops->export_pixmap)
+		drmxv->has_xvbp = TRUE;
 	drmxv->fd = drm->fd;
 	drmxv->bufmgr = arm->bufmgr;
 	drmxv->autopaint_colorkey = TRUE;